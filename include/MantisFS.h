@@ -9,6 +9,7 @@
 #ifndef __MANTIS_FILESYSTEM_HPP__
 #define __MANTIS_FILESYSTEM_HPP__
 
+#include <cstdint>
 #include <vector>
 #include <string>
 
@@ -21,6 +22,8 @@ namespace mantis {
 		// http://stackoverflow.com/questions/12774207/fastest-way-to-check-if-a-file-exist-using-standard-c-c11-c
 		bool DirExists(const char* path);
 		void MakeDir(const char* path);
+		/** the size of the file at path in bytes, 0 if there is none */
+		uint64_t FileSize(const char* path);
 		// Taken from
 		// https://stackoverflow.com/questions/19189014/how-do-i-find-files-with-a-specific-extension-in-a-directory-that-is-provided-by
 		std::vector<std::string> GetFilesExt(const char *dir, const char *ext);
@@ -3,6 +3,7 @@
 #include <memory>
 #include "spdlog/spdlog.h"
 #include "json.hpp"
+#include "mantisconfig.hpp"
 
 
 class BuildOpts {
@@ -33,18 +34,75 @@ class QueryOpts {
   uint64_t k = 0;
   uint32_t numThreads = 1;
   bool use_json{false};
+  std::string format{"tsv"}; // tsv, json or binary, see resultWriter.h
   std::shared_ptr<spdlog::logger> console{nullptr};
   bool process_in_bulk{false};
   bool use_colorclasses{false};
   bool keep_colorclasses{false};
   bool remove_colorClasses{false};
+  uint64_t cache_budget_mb{mantis::DEFAULT_COLOR_CACHE_MB};
+  uint64_t max_memory_mb{0}; // 0 means no limit, see memoryPlan.h
+  bool lazy_colors{false}; // map or lazily load the color classes even if they fit
+  uint32_t max_mst_depth{0};
+  std::string mst_tmp_dir; // where mst sorts the edges of the color graph, the index directory if empty
+  uint64_t mst_memory_mb{mantis::DEFAULT_MST_MEMORY_MB};
+  uint64_t mst_color_memory_mb{0}; // color class buffers mst keeps loaded, 0 for two at a time
+  uint64_t mst_bucket_edges{mantis::DEFAULT_MST_BUCKET_EDGES};
+  double theta{0}; // 0 means report the count of every sample
+  std::string samples_file; // if set, only these samples are searched
+  std::string stats_file; // if set, a JSON summary of the query latencies and phases is written there
+  bool load_cache{false};
+  bool save_cache{false};
+  bool use_unitigs{false};
+  double sample_rate{1}; // screen queries from this fraction of their k-mers
+  uint32_t minimizer_window{0}; // or from the minimizers of windows of this many k-mers
+  bool refine{false}; // decide the samples too close to theta over all the k-mers
+};
+
+class WarmCacheOpts {
+ public:
+  std::string prefix;
+  uint64_t num_colors{1000000};
+  uint32_t numThreads{1};
+  std::shared_ptr<spdlog::logger> console{nullptr};
+};
+
+class UnitigOpts {
+ public:
+  std::string prefix;
+  std::shared_ptr<spdlog::logger> console{nullptr};
+};
+
+class ServeOpts {
+ public:
+  std::string prefix;
+  std::string socket;
+  uint64_t k = 0;
+  uint32_t numThreads{1};
+  uint64_t cache_budget_mb{mantis::DEFAULT_COLOR_CACHE_MB};
+  uint64_t max_memory_mb{0};
+  bool lazy_colors{false};
+  bool load_cache{false};
+  std::shared_ptr<spdlog::logger> console{nullptr};
+};
+
+class ResultsOpts {
+ public:
+  std::string input;
+  std::string output;
+  bool use_json{false};
+  std::shared_ptr<spdlog::logger> console{nullptr};
 };
 
 class ValidateOpts {
  public:
   std::string inlist;
   std::string prefix;
-  std::string query_file;
+  std::string query_file; // if empty, the k-mers of the inputs are checked instead
+  uint32_t numThreads{1};
+  double sample_rate{1.0};
+  uint64_t seed{0};
+  std::string report_file;
   std::shared_ptr<spdlog::logger> console{nullptr};
 };
 
@@ -52,7 +110,10 @@ class MSTValidateOpts {
 public:
     std::string prefix;
     std::uint64_t numSamples;
-    std::uint16_t k;
+    std::uint16_t k{0};
+    uint32_t numThreads{1};
+    uint64_t cache_budget_mb{0};
+    std::string stats_file;
     std::shared_ptr<spdlog::logger> console{nullptr};
 };
 
@@ -0,0 +1,198 @@
+//
+// Shared machinery of the bulk query mode: every distinct k-mer of a query file is
+// looked up once and every distinct color class is decoded once.
+//
+
+#ifndef MANTIS_BULKQUERY_H
+#define MANTIS_BULKQUERY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common_types.h"
+#include "resultWriter.h"
+#include "sampleCounter.h"
+#include "sampleMask.h"
+#include "tsl/hopscotch_map.h"
+
+namespace mantis {
+    /**
+     * calls f(i, threadId) for every i in [0, n) on numThreads threads, handing out chunks of indices.
+     * If f throws, no more chunks are handed out and the first exception is rethrown once all threads are done.
+     */
+    template <typename F>
+    void parallel_for(uint64_t n, uint32_t numThreads, F f, uint64_t chunk = 64) {
+        numThreads = std::max<uint32_t>(1, numThreads);
+        std::atomic<uint64_t> next{0};
+        auto work = [&](uint32_t t) {
+            for (uint64_t s = next.fetch_add(chunk); s < n; s = next.fetch_add(chunk)) {
+                for (uint64_t i = s; i < std::min(n, s + chunk); i++) {
+                    f(i, t);
+                }
+            }
+        };
+        if (numThreads == 1) {
+            work(0);
+            return;
+        }
+        std::exception_ptr error;
+        std::mutex errorMtx;
+        std::vector<std::thread> threads;
+        for (uint32_t t = 0; t < numThreads; t++) {
+            threads.emplace_back([&, t]() {
+                try {
+                    work(t);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(errorMtx);
+                    if (!error) error = std::current_exception();
+                    next = n;
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+/**
+ * The distinct k-mers of all the queries of a file, each with its color class.
+ * K-mers are split into one shard per thread by hash, so both building the table and
+ * looking the k-mers up in the CQF run in parallel without any locking.
+ */
+class BulkKmerTable {
+public:
+    BulkKmerTable(const mantis::QuerySets &queries, uint32_t numThreadsIn) :
+            numThreads(std::max<uint32_t>(1, numThreadsIn)), shards(std::max<uint32_t>(1, numThreadsIn)) {
+        // every thread first buckets the k-mers of its queries by shard, then owns one shard
+        std::vector<std::vector<std::vector<mantis::KmerHash>>> buckets(
+                numThreads, std::vector<std::vector<mantis::KmerHash>>(numThreads));
+        mantis::parallel_for(queries.size(), numThreads, [&](uint64_t q, uint32_t t) {
+            for (auto k : queries[q]) {
+                buckets[t][shardOf(k)].push_back(k);
+            }
+        }, 16);
+        mantis::parallel_for(numThreads, numThreads, [&](uint64_t s, uint32_t) {
+            uint64_t cnt{0};
+            for (auto &b : buckets) cnt += b[s].size();
+            shards[s].reserve(cnt);
+            for (auto &b : buckets) {
+                for (auto k : b[s]) {
+                    shards[s].emplace(k, 0);
+                }
+                std::vector<mantis::KmerHash>().swap(b[s]);
+            }
+        }, 1);
+    }
+
+    /** sets the class of every k-mer to lookup(kmer), one thread per shard; 0 means not found */
+    template <typename F>
+    void assignClasses(F lookup) {
+        mantis::parallel_for(numThreads, numThreads, [&](uint64_t s, uint32_t) {
+            for (auto it = shards[s].begin(); it != shards[s].end(); ++it) {
+                it.value() = lookup(it->first);
+            }
+        }, 1);
+    }
+
+    uint64_t classOf(mantis::KmerHash k) const {
+        auto &shard = shards[shardOf(k)];
+        auto it = shard.find(k);
+        return it == shard.end() ? 0 : it->second;
+    }
+
+    /** the distinct classes assigned to the k-mers, 0 excluded */
+    std::vector<uint64_t> classes() const {
+        tsl::hopscotch_map<uint64_t, bool> seen;
+        for (auto &shard : shards) {
+            for (auto &kv : shard) {
+                if (kv.second) seen.emplace(kv.second, true);
+            }
+        }
+        std::vector<uint64_t> res;
+        res.reserve(seen.size());
+        for (auto &kv : seen) res.push_back(kv.first);
+        std::sort(res.begin(), res.end());
+        return res;
+    }
+
+    uint64_t size() const {
+        uint64_t cnt{0};
+        for (auto &shard : shards) cnt += shard.size();
+        return cnt;
+    }
+
+private:
+    uint32_t shardOf(mantis::KmerHash k) const {
+        return static_cast<uint32_t>(((k * 0x9E3779B97F4A7C15ULL) >> 32) % numThreads);
+    }
+
+    uint32_t numThreads;
+    std::vector<tsl::hopscotch_map<mantis::KmerHash, uint64_t>> shards;
+};
+
+/**
+ * counts the k-mers of every sample for each query and writes the counts with writer in
+ * query order. Queries are counted and formatted in parallel, a block at a time, so only
+ * the records of one block are ever kept in memory.
+ * @param colorOf returns the color bitset of a class assigned in table
+ * @param names the names of the queries, or empty if they have none
+ * @param mask if set, the colors are restricted to it and only its samples are counted
+ * @param totals if set, the queries were screened out of totals[i] distinct k-mers, and the
+ * containment bounds of the samples are written too
+ */
+template <typename ColorOf>
+void assembleBulkResults(const mantis::QuerySets &queries, const BulkKmerTable &table,
+                         uint64_t numSamples, uint32_t numThreads, ColorOf colorOf,
+                         ResultWriter &writer, const std::vector<std::string> &names,
+                         const SampleMask *mask = nullptr,
+                         const std::vector<uint64_t> *totals = nullptr) {
+    static const std::string noName;
+    constexpr uint64_t BLOCK{4096};
+    numThreads = std::max<uint32_t>(1, numThreads);
+    std::vector<SampleCounter> counters(numThreads, SampleCounter(numSamples));
+    if (mask) {
+        for (auto &counter : counters) {
+            counter.restrictTo(mask->firstWord(), mask->endWord());
+        }
+    }
+    std::vector<tsl::hopscotch_map<uint64_t, uint64_t>> classCnts(numThreads);
+    std::vector<SampleBounds> bounds(totals ? numThreads : 0);
+    std::vector<std::string> records(std::min<uint64_t>(BLOCK, queries.size()));
+    for (uint64_t start = 0; start < queries.size(); start += BLOCK) {
+        uint64_t end = std::min<uint64_t>(queries.size(), start + BLOCK);
+        mantis::parallel_for(end - start, numThreads, [&](uint64_t i, uint32_t t) {
+            auto &classCnt = classCnts[t];
+            classCnt.clear();
+            for (auto k : queries[start + i]) {
+                uint64_t c = table.classOf(k);
+                if (c) classCnt[c]++;
+            }
+            auto &counter = counters[t];
+            counter.reset();
+            for (auto &kv : classCnt) {
+                counter.add(colorOf(kv.first), kv.second);
+            }
+            if (totals) {
+                containmentBounds(counter.counts(), queries[start + i].size(), (*totals)[start + i], bounds[t]);
+            }
+            records[i].clear();
+            writer.formatCounts(start + i, names.empty() ? noName : names[start + i], queries[start + i].size(),
+                                counter.counts(), totals ? &bounds[t] : nullptr, records[i]);
+        }, 8);
+        for (uint64_t i = 0; i < end - start; i++) {
+            writer.emit(records[i]);
+        }
+    }
+}
+
+#endif //MANTIS_BULKQUERY_H
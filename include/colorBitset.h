@@ -0,0 +1,120 @@
+//
+// Bitset over the samples of an index, used to decode and count colors word by word.
+//
+
+#ifndef MANTIS_COLORBITSET_H
+#define MANTIS_COLORBITSET_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/**
+ * The set of samples of a color class, one bit per sample packed in 64-bit words.
+ * It is meant to be reused: reset() only reallocates when the number of samples grows.
+ */
+class ColorBitset {
+public:
+    ColorBitset() = default;
+
+    explicit ColorBitset(uint64_t numSamplesIn) { reset(numSamplesIn); }
+
+    /** clears all the bits and resizes the set to numSamplesIn samples */
+    void reset(uint64_t numSamplesIn) {
+        numSamples = numSamplesIn;
+        wrds.assign((numSamples + 63) / 64, 0);
+    }
+
+    void clear() { std::fill(wrds.begin(), wrds.end(), 0); }
+
+    void flip(uint64_t s) { wrds[s >> 6] ^= (1ULL << (s & 63)); }
+
+    void set(uint64_t s) { wrds[s >> 6] |= (1ULL << (s & 63)); }
+
+    bool test(uint64_t s) const { return (wrds[s >> 6] >> (s & 63)) & 0x01; }
+
+    /** XORs numWords() words from src into the set */
+    void xorWith(const uint64_t *src) {
+        for (uint64_t w = 0; w < wrds.size(); w++) {
+            wrds[w] ^= src[w];
+        }
+    }
+
+    uint64_t count() const {
+        uint64_t cnt{0};
+        for (auto wrd : wrds) {
+            cnt += __builtin_popcountll(wrd);
+        }
+        return cnt;
+    }
+
+    /** calls f(sampleId) for every set bit in increasing order */
+    template <typename F>
+    void forEachSetBit(F f) const {
+        for (uint64_t w = 0; w < wrds.size(); w++) {
+            uint64_t wrd = wrds[w];
+            while (wrd) {
+                f((w << 6) + __builtin_ctzll(wrd));
+                wrd &= wrd - 1;
+            }
+        }
+    }
+
+    /** writes the sorted ids of the set samples to setbits */
+    void toList(std::vector<uint64_t> &setbits) const {
+        setbits.clear();
+        forEachSetBit([&setbits](uint64_t s) { setbits.push_back(s); });
+    }
+
+    uint64_t size() const { return numSamples; }
+
+    uint64_t numWords() const { return wrds.size(); }
+
+    uint64_t *data() { return wrds.data(); }
+
+    const uint64_t *data() const { return wrds.data(); }
+
+private:
+    uint64_t numSamples{0};
+    std::vector<uint64_t> wrds;
+};
+
+/**
+ * The colors of the classes of a query, one after the other in a single buffer, so that a
+ * query doesn't allocate a bitset per class. Like ColorBitset, it is meant to be reused:
+ * clear() keeps the buffer. Pointers to colors stay valid until the next add() or clear().
+ */
+class ColorArena {
+public:
+    explicit ColorArena(uint64_t numSamples = 0) : numWrds((numSamples + 63) / 64) {}
+
+    /** adds an empty color, returns its slot */
+    uint64_t add() {
+        wrds.resize(wrds.size() + numWrds, 0);
+        return numColors++;
+    }
+
+    /** replaces the colors with numColorsIn empty ones, e.g. to fill them from several threads */
+    void assign(uint64_t numColorsIn) {
+        wrds.assign(numColorsIn * numWrds, 0);
+        numColors = numColorsIn;
+    }
+
+    uint64_t *color(uint64_t slot) { return wrds.data() + slot * numWrds; }
+
+    const uint64_t *color(uint64_t slot) const { return wrds.data() + slot * numWrds; }
+
+    uint64_t size() const { return numColors; }
+
+    void clear() {
+        wrds.clear();
+        numColors = 0;
+    }
+
+private:
+    uint64_t numWrds;
+    uint64_t numColors{0};
+    std::vector<uint64_t> wrds;
+};
+
+#endif //MANTIS_COLORBITSET_H
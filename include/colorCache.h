@@ -0,0 +1,180 @@
+//
+// Concurrent cache of decoded color classes shared by the query workers.
+//
+
+#ifndef MANTIS_COLORCACHE_H
+#define MANTIS_COLORCACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "tsl/hopscotch_map.h"
+
+struct ColorCacheStats {
+    uint64_t hits{0};
+    uint64_t misses{0};
+    uint64_t insertions{0};
+    uint64_t evictions{0};
+    uint64_t rejections{0};
+    uint64_t ancestorProbes{0}; // lookups of the ancestors of a color decoded from the MST
+    uint64_t ancestorHits{0};
+    uint64_t entries{0};
+    uint64_t bytes{0};
+};
+
+/**
+ * A sharded, thread-safe cache from color class id to its decoded color.
+ *
+ * Colors are kept in a per-shard arena of 64-bit words, either as a bitset
+ * over the samples or as a list of 32-bit sample ids, whichever is smaller.
+ * The size of the cache is bounded by a memory budget in bytes rather than
+ * by a number of entries.
+ *
+ * Eviction uses the CLOCK algorithm guarded by a TinyLFU admission filter:
+ * a new color only replaces the CLOCK victim if it has been requested more
+ * often recently, so a one-off scan over cold colors can not flush the hot ones.
+ */
+class ColorCache {
+public:
+    enum Encoding : uint8_t { BITSET = 0, IDLIST = 1 };
+
+    ColorCache(uint64_t numSamplesIn, uint64_t budgetBytesIn, uint32_t numShardsIn = 64);
+
+    ColorCache(const ColorCache &) = delete;
+    ColorCache &operator=(const ColorCache &) = delete;
+
+    /**
+     * looks up a color class and on a hit writes its sorted sample ids to setbits
+     * @return true if eqid was in the cache
+     */
+    bool get(uint64_t eqid, std::vector<uint64_t> &setbits);
+
+    /**
+     * same as get, but XORs the color into the bitset dst (numSamples bits) instead,
+     * a word at a time for colors kept as bitsets
+     */
+    bool xorInto(uint64_t eqid, uint64_t *dst);
+
+    /**
+     * same as xorInto, for an ancestor of a color being decoded from the MST. The probe is
+     * counted apart from the hits and misses and isn't recorded in the frequency sketch, so the
+     * walk up to a cached ancestor doesn't inflate the misses or the admission of ancestors.
+     */
+    bool xorAncestorInto(uint64_t eqid, uint64_t *dst);
+
+    /** same as get, but does not touch the counters or the frequency sketch */
+    bool contains(uint64_t eqid);
+
+    /** offers the decoded color of eqid (sorted sample ids) to the cache */
+    void put(uint64_t eqid, const std::vector<uint64_t> &setbits);
+
+    /** same as put, but takes the color as a bitset over the samples, encoded without a copy */
+    void putBitset(uint64_t eqid, const uint64_t *row);
+
+    ColorCacheStats stats() const;
+
+    uint64_t budget() const { return budgetBytes; }
+
+    uint64_t getNumSamples() const { return numSamples; }
+
+    /** calls f(eqid, setbits) for every cached color, one shard locked at a time */
+    template <typename F>
+    void forEach(F f) {
+        std::vector<uint64_t> setbits;
+        for (auto &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            for (auto &e : shard.slots) {
+                if (!e.used) continue;
+                decode(shard.arena.data() + e.offset, e.len, e.card, e.enc, setbits);
+                f(e.eqid, setbits);
+            }
+        }
+    }
+
+    /**
+     * chooses the smaller encoding for a color of card samples
+     * @return the number of 64-bit words the encoded color takes
+     */
+    static uint32_t encodedWords(uint64_t card, uint64_t numWrds, Encoding &enc);
+
+    /** writes sorted sample ids setbits into the zeroed words dst using encoding enc */
+    static void encode(const std::vector<uint64_t> &setbits, Encoding enc, uint64_t *dst);
+
+    /** expands an encoded color of len words back into its sorted sample ids */
+    static void decode(const uint64_t *src, uint32_t len, uint32_t card, Encoding enc,
+                       std::vector<uint64_t> &setbits);
+
+    /** XORs an encoded color of len words into the bitset dst */
+    static void xorDecoded(const uint64_t *src, uint32_t len, uint32_t card, Encoding enc,
+                           uint64_t *dst);
+
+private:
+    struct Entry {
+        uint64_t eqid{0};
+        uint64_t offset{0};   // first word in the shard arena
+        uint32_t len{0};      // number of words in the arena
+        uint32_t card{0};     // number of samples in the color
+        Encoding enc{BITSET};
+        bool referenced{false};
+        bool used{false};
+    };
+
+    // 4-bit count-min sketch approximating how often each color is requested
+    struct FrequencySketch {
+        std::vector<uint64_t> table;
+        uint64_t mask{0};
+        uint64_t additions{0};
+        uint64_t resetAt{0};
+
+        void init(uint64_t expectedEntries);
+        void record(uint64_t h);
+        uint32_t frequency(uint64_t h) const;
+    };
+
+    struct Shard {
+        mutable std::mutex mtx;
+        tsl::hopscotch_map<uint64_t, uint32_t> slotOf; // eqid -> index in slots
+        std::vector<Entry> slots;                      // the CLOCK ring
+        std::vector<uint32_t> freeSlots;
+        std::vector<uint64_t> arena;
+        uint64_t deadWords{0};
+        uint64_t bytes{0};
+        uint64_t hand{0};
+        FrequencySketch sketch;
+    };
+
+    uint64_t entryBytes(uint32_t words) const { return words * sizeof(uint64_t) + sizeof(Entry); }
+
+    Shard &shardOf(uint64_t h) { return shards[h & (numShards - 1)]; }
+
+    /**
+     * makes room for a color of card samples in the locked shard of eqid (hash h)
+     * @return the zeroed words to encode it into, nullptr if it isn't let in
+     */
+    uint64_t *admit(Shard &shard, uint64_t h, uint64_t eqid, uint32_t card, Encoding &enc);
+
+    uint32_t nextVictim(Shard &shard);
+
+    void evict(Shard &shard, uint32_t slot);
+
+    void compact(Shard &shard);
+
+    uint64_t numSamples;
+    uint64_t numWrds;
+    uint64_t budgetBytes;
+    uint64_t shardBudget;
+    uint32_t numShards;
+    std::vector<Shard> shards;
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> insertions{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> rejections{0};
+    std::atomic<uint64_t> ancestorProbes{0};
+    std::atomic<uint64_t> ancestorHits{0};
+};
+
+#endif //MANTIS_COLORCACHE_H
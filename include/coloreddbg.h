@@ -11,12 +11,17 @@
 #ifndef _COLORED_DBG_H_
 #define _COLORED_DBG_H_
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <unordered_map>
 #include <set>
 #include <unordered_set>
 #include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 
 #include <inttypes.h>
 
@@ -27,12 +32,19 @@
 #include "gqf/hashutil.h"
 #include "common_types.h"
 #include "mantisconfig.hpp"
+#include "MantisFS.h"
+#include "sampleCounter.h"
+#include "sampleMask.h"
+#include "queryProfile.h"
+#include "colorCache.h"
 
 #define MANTIS_DBG_IN_MEMORY (0x01)
 #define MANTIS_DBG_ON_DISK (0x02)
 
 typedef sdsl::bit_vector BitVector;
-typedef sdsl::rrr_vector<63> BitVectorRRR;
+// bits per RRR block, the most get_int can return from a single block
+constexpr uint64_t RRR_BLOCK_BITS{63};
+typedef sdsl::rrr_vector<RRR_BLOCK_BITS> BitVectorRRR;
 
 struct hash128 {
 	uint64_t operator()(const __uint128_t& val128) const
@@ -53,8 +65,14 @@ using default_cdbg_bv_map_t = cdbg_bv_map_t<__uint128_t,
 template <class qf_obj, class key_obj>
 class ColoredDbg {
 	public:
+		/**
+		 * loads an index. With lazy_colors, a block of color classes (an eqclass file) is
+		 * only loaded when a query first needs it, and the least recently used blocks are
+		 * dropped to keep at most color_budget bytes of them loaded (0 for no limit).
+		 */
 		ColoredDbg(std::string& cqf_file, std::vector<std::string>& eqclass_files,
-							 std::string& sample_file, int flag);
+							 std::string& sample_file, int flag, bool lazy_colors = false,
+							 uint64_t color_budget = 0);
 
 		ColoredDbg(uint64_t qbits, uint64_t key_bits, enum qf_hashmode hashmode,
 							 uint32_t seed, std::string& prefix, uint64_t nqf, int flag);
@@ -103,8 +121,46 @@ class ColoredDbg {
 		std::vector<uint64_t>
 			find_samples(const mantis::QuerySet& kmers);
 
-        std::unordered_map<uint64_t, std::vector<uint64_t>>
-            find_samples(const std::unordered_map<mantis::KmerHash, uint64_t> &uniqueKmers);
+        /** @return the color class of kmer counting from 1, or 0 if it isn't in the dbg */
+        uint64_t get_eqclass(mantis::KmerHash kmer) { return dbg.query(key_obj(kmer, 0, 0), 0); }
+
+        /** same as get_eqclass, for a k-mer given by its hash in the dbg (and in its input CQFs) */
+        uint64_t get_eqclass_of_hash(uint64_t hash) { return dbg.query(key_obj(hash, 0, 0), QF_KEY_IS_HASH); }
+
+        /** whether sample is in the color of eqclass_id (counting from 1), decoding a single RRR block */
+        bool has_sample(uint64_t eqclass_id, uint64_t sample) const;
+
+        /**
+         * writes the color of eqclass_id (counting from 1) as a bitset of num_samples bits to row.
+         * With a sample mask, only the words of the mask are extracted.
+         */
+        void get_color_row(uint64_t eqclass_id, uint64_t *row) const;
+
+        /**
+         * the color classes of block idx (NUM_BV_BUFFER classes of num_samples bits), which
+         * stays valid for as long as the pointer is held, even if the block is dropped
+         * @throws std::runtime_error if its file can't be read
+         */
+        std::shared_ptr<const BitVectorRRR> get_eqclass_block(uint64_t idx) const;
+
+        /** restricts the colors, and so the query results, to the samples of mask */
+        void set_sample_mask(const SampleMask *mask) { sample_mask = mask; }
+
+        /**
+         * get_color_row then keeps the rows of frequently queried color classes in cache and
+         * reads them from there. With a sample mask the cached rows are restricted to it, so a
+         * cache must not be shared across masks.
+         */
+        void set_color_cache(ColorCache *cache) { color_cache = cache; }
+
+        /** times the lookup, decode and count phases of the queries in profile */
+        void set_profile(QueryProfile *profile_in) { profile = profile_in; }
+
+        /**
+         * @return the samples containing at least a fraction theta of kmers,
+         * reading only the parts of the color classes that can still change the answer
+         */
+        std::vector<uint64_t> find_samples_above(const mantis::QuerySet& kmers, double theta);
 
 		void serialize();
 		void reinit(default_cdbg_bv_map_t& map);
@@ -142,13 +198,40 @@ class ColoredDbg {
 		CQF<key_obj> dbg;
 		BitVector bv_buffer;
 		std::vector<BitVectorRRR> eqclasses;
+		// with lazy colors, the blocks loaded so far and when each was last used
+		bool lazy_eqclasses{false};
+		uint64_t eqclass_budget{0};
+		std::vector<std::string> eqclass_block_files;
+		std::vector<uint64_t> eqclass_block_bytes;
+		uint64_t eqclass_last_block_bits{0};
+		mutable std::mutex eqclass_mtx;
+		mutable std::vector<std::shared_ptr<const BitVectorRRR>> eqclass_blocks;
+		// set while a thread loads the block, for the other threads asking for it to wait on
+		mutable std::vector<std::shared_future<std::shared_ptr<const BitVectorRRR>>> eqclass_loading;
+		mutable std::vector<uint64_t> eqclass_last_use;
+		mutable uint64_t eqclass_clock{0};
+		mutable uint64_t eqclass_resident{0};
 		std::string prefix;
 		uint64_t num_samples;
 		uint64_t num_serializations;
 		int dbg_alloc_flag;
 		bool flush_eqclass_dis{false};
 		std::time_t start_time_;
-		spdlog::logger* console;
+		spdlog::logger* console{nullptr};
+		const SampleMask *sample_mask{nullptr};
+		ColorCache *color_cache{nullptr};
+		QueryProfile *profile{nullptr};
+		// color class -> number of query k-mers, reused across queries
+		tsl::hopscotch_map<uint64_t, uint64_t> query_eqclass_map;
+
+		/**
+		 * ORs the n bits of bv starting at bit begin into row, reading the RRR blocks they
+		 * span once each, in order, rather than the one or two blocks of every 64-bit word
+		 */
+		static void extract_bits(const BitVectorRRR& bv, uint64_t begin, uint64_t n, uint64_t *row);
+
+		/** fills query_eqclass_map with the classes of kmers found in the dbg */
+		void count_query_classes(const mantis::QuerySet& kmers);
 };
 
 template <class T>
@@ -189,6 +272,13 @@ std::string ColoredDbg<qf_obj, key_obj>::get_sample(uint32_t id) const {
 
 template <class qf_obj, class key_obj>
 uint64_t ColoredDbg<qf_obj, key_obj>::get_num_bitvectors(void) const {
+	if (lazy_eqclasses) {
+		// every block but the last one is full
+		if (num_serializations == 0)
+			return 0;
+		return (num_serializations - 1) * mantis::NUM_BV_BUFFER +
+			eqclass_last_block_bits / num_samples;
+	}
 	uint64_t total = 0;
 	for (uint32_t i = 0; i < num_serializations; i++)
 		total += eqclasses[i].size();
@@ -342,7 +432,7 @@ void ColoredDbg<qf_obj, key_obj>::serialize() {
 
 	if (flush_eqclass_dis) {
 		// dump eq class abundance dist for further analysis.
-		std::ofstream tmpfile(prefix + "eqclass_dist.lst");
+		std::ofstream tmpfile(prefix + mantis::EQCLASS_DIST_FILE);
 		for (auto sample : eqclass_map)
 			tmpfile << sample.second.first << " " << sample.second.second <<
 				std::endl;
@@ -355,69 +445,197 @@ std::vector<uint64_t>
 ColoredDbg<qf_obj,key_obj>::find_samples(const mantis::QuerySet& kmers) {
 	// Find a list of eq classes and the number of kmers that belong those eq
 	// classes.
-	std::unordered_map<uint64_t, uint64_t> query_eqclass_map;
-	for (auto k : kmers) {
-		key_obj key(k, 0, 0);
-		uint64_t eqclass = dbg.query(key, 0);
-		if (eqclass)
-			query_eqclass_map[eqclass] += 1;
-	}
+	count_query_classes(kmers);
 
-	std::vector<uint64_t> sample_map(num_samples, 0);
+	SampleCounter counter(num_samples);
+	if (sample_mask)
+		counter.restrictTo(sample_mask->firstWord(), sample_mask->endWord());
+	std::vector<uint64_t> row((num_samples + 63) / 64, 0);
 	for (auto it = query_eqclass_map.begin(); it != query_eqclass_map.end();
 			 ++it) {
-		auto eqclass_id = it->first;
-		auto count = it->second;
+		{
+			PhaseTimer timer(profile, QueryPhase::decode);
+			get_color_row(it->first, row.data());
+		}
+		if (sample_mask and !sample_mask->intersects(row.data()))
+			continue;
+		PhaseTimer timer(profile, QueryPhase::count);
+		counter.add(row.data(), it->second);
+	}
+	PhaseTimer timer(profile, QueryPhase::count);
+	return std::move(counter.counts());
+}
+
+template <class qf_obj, class key_obj>
+std::vector<uint64_t>
+ColoredDbg<qf_obj,key_obj>::find_samples_above(const mantis::QuerySet& kmers, double theta) {
+	count_query_classes(kmers);
+	// the most frequent color classes decide most samples, so they go first
+	std::vector<std::pair<uint64_t, uint64_t>> classes(query_eqclass_map.begin(),
+																										 query_eqclass_map.end());
+	std::sort(classes.begin(), classes.end(),
+						[](const std::pair<uint64_t, uint64_t>& c1, const std::pair<uint64_t, uint64_t>& c2) {
+							return c1.second > c2.second;
+						});
+	uint64_t found_kmers = 0;
+	for (auto& c : classes)
+		found_kmers += c.second;
+
+	ThresholdFilter filter(num_samples, kmers.size(), theta, found_kmers,
+												 sample_mask ? sample_mask->data() : nullptr);
+	std::vector<uint64_t> row((num_samples + 63) / 64, 0);
+	for (auto& c : classes) {
+		if (filter.done())
+			break;
+		PhaseTimer decode_timer(profile, QueryPhase::decode);
 		// counter starts from 1.
-		uint64_t start_idx = (eqclass_id - 1);
+		uint64_t start_idx = (c.first - 1);
 		uint64_t bucket_idx = start_idx / mantis::NUM_BV_BUFFER;
 		uint64_t bucket_offset = (start_idx % mantis::NUM_BV_BUFFER) * num_samples;
-		for (uint32_t w = 0; w <= num_samples / 64; w++) {
-			uint64_t len = std::min((uint64_t)64, num_samples - w * 64);
-			uint64_t wrd = eqclasses[bucket_idx].get_int(bucket_offset, len);
-			for (uint32_t i = 0, sCntr = w * 64; i < len; i++, sCntr++)
-				if ((wrd >> i) & 0x01)
-					sample_map[sCntr] += count;
-			bucket_offset += len;
+		const uint64_t *undecided = filter.undecided();
+		auto block = get_eqclass_block(bucket_idx);
+		std::fill(row.begin(), row.end(), 0);
+		// decided samples are ignored by the filter, so only runs of undecided words are extracted
+		for (uint64_t w = 0; w < row.size(); w++) {
+			if (!undecided[w])
+				continue;
+			uint64_t end = w + 1;
+			while (end < row.size() and undecided[end])
+				end++;
+			extract_bits(*block, bucket_offset + w * 64, std::min(num_samples, end * 64) - w * 64,
+									 row.data() + w);
+			w = end;
 		}
+		decode_timer.stop();
+		PhaseTimer count_timer(profile, QueryPhase::count);
+		filter.add(row.data(), c.second);
 	}
-	return sample_map;
+	return filter.accepted();
 }
 
 template <class qf_obj, class key_obj>
-std::unordered_map<uint64_t, std::vector<uint64_t>>
-ColoredDbg<qf_obj,key_obj>::find_samples(const std::unordered_map<mantis::KmerHash, uint64_t> &uniqueKmers) {
-	// Find a list of eq classes and the number of kmers that belong those eq
-	// classes.
-	std::unordered_map<uint64_t, std::vector<uint64_t>> query_eqclass_map;
-	for (auto kv : uniqueKmers) {
-		key_obj key(kv.first, 0, 0);
+void ColoredDbg<qf_obj,key_obj>::count_query_classes(const mantis::QuerySet& kmers) {
+	mantis::clearTable(query_eqclass_map);
+	PhaseTimer lookup_timer(profile, QueryPhase::lookup);
+	for (auto k : kmers) {
+		key_obj key(k, 0, 0);
 		uint64_t eqclass = dbg.query(key, 0);
-		if (eqclass) {
-		    kv.second = eqclass;
-            query_eqclass_map[eqclass] = std::vector<uint64_t>();
-        }
+		if (eqclass)
+			query_eqclass_map[eqclass] += 1;
 	}
+	lookup_timer.stop();
+}
 
-	std::vector<uint64_t> sample_map(num_samples, 0);
-	for (auto it = query_eqclass_map.begin(); it != query_eqclass_map.end();
-		 ++it) {
-		auto eqclass_id = it->first;
-		auto &vec = it->second;
-		// counter starts from 1.
-		uint64_t start_idx = (eqclass_id - 1);
-		uint64_t bucket_idx = start_idx / mantis::NUM_BV_BUFFER;
-		uint64_t bucket_offset = (start_idx % mantis::NUM_BV_BUFFER) * num_samples;
-		for (uint32_t w = 0; w <= num_samples / 64; w++) {
-			uint64_t len = std::min((uint64_t)64, num_samples - w * 64);
-			uint64_t wrd = eqclasses[bucket_idx].get_int(bucket_offset, len);
-			for (uint32_t i = 0, sCntr = w * 64; i < len; i++, sCntr++)
-				if ((wrd >> i) & 0x01)
-					vec.push_back(sCntr);
-			bucket_offset += len;
+template <class qf_obj, class key_obj>
+void ColoredDbg<qf_obj,key_obj>::get_color_row(uint64_t eqclass_id, uint64_t *row) const {
+	uint64_t num_words = (num_samples + 63) / 64;
+	std::fill(row, row + num_words, 0);
+	if (color_cache and color_cache->xorInto(eqclass_id, row))
+		return;
+	// counter starts from 1.
+	uint64_t start_idx = (eqclass_id - 1);
+	uint64_t bucket_idx = start_idx / mantis::NUM_BV_BUFFER;
+	uint64_t bucket_offset = (start_idx % mantis::NUM_BV_BUFFER) * num_samples;
+	// with a sample mask, only the words between its first and last samples are extracted
+	uint64_t first_word = sample_mask ? sample_mask->firstWord() : 0;
+	uint64_t end_word = sample_mask ? sample_mask->endWord() : num_words;
+	if (first_word < end_word) {
+		auto block = get_eqclass_block(bucket_idx);
+		uint64_t end_bit = std::min(num_samples, end_word * 64);
+		extract_bits(*block, bucket_offset + first_word * 64, end_bit - first_word * 64,
+								 row + first_word);
+	}
+	if (sample_mask)
+		sample_mask->apply(row);
+	if (color_cache)
+		color_cache->putBitset(eqclass_id, row);
+}
+
+template <class qf_obj, class key_obj>
+bool ColoredDbg<qf_obj,key_obj>::has_sample(uint64_t eqclass_id, uint64_t sample) const {
+	// counter starts from 1.
+	uint64_t start_idx = (eqclass_id - 1);
+	uint64_t bucket_idx = start_idx / mantis::NUM_BV_BUFFER;
+	uint64_t bucket_offset = (start_idx % mantis::NUM_BV_BUFFER) * num_samples;
+	return (*get_eqclass_block(bucket_idx))[bucket_offset + sample];
+}
+
+template <class qf_obj, class key_obj>
+void ColoredDbg<qf_obj,key_obj>::extract_bits(const BitVectorRRR& bv, uint64_t begin, uint64_t n,
+																							uint64_t *row) {
+	uint64_t end = begin + n;
+	for (uint64_t pos = begin - begin % RRR_BLOCK_BITS; pos < end; pos += RRR_BLOCK_BITS) {
+		uint64_t from = std::max(pos, begin);
+		uint64_t len = std::min(pos + RRR_BLOCK_BITS, end) - from;
+		// a get_int aligned on a block only decodes that block
+		uint64_t bits = bv.get_int(pos, std::min(RRR_BLOCK_BITS, bv.size() - pos)) >> (from - pos);
+		bits &= (1ULL << len) - 1;
+		uint64_t dst = from - begin, shift = dst & 63;
+		row[dst >> 6] |= bits << shift;
+		if (shift + len > 64)
+			row[(dst >> 6) + 1] |= bits >> (64 - shift);
+	}
+}
+
+template <class qf_obj, class key_obj>
+std::shared_ptr<const BitVectorRRR>
+ColoredDbg<qf_obj,key_obj>::get_eqclass_block(uint64_t idx) const {
+	if (!lazy_eqclasses)
+		// doesn't own the block, so copying it costs no reference counting
+		return std::shared_ptr<const BitVectorRRR>(std::shared_ptr<const BitVectorRRR>(), &eqclasses[idx]);
+	std::shared_future<std::shared_ptr<const BitVectorRRR>> pending;
+	std::promise<std::shared_ptr<const BitVectorRRR>> loaded;
+	{
+		std::lock_guard<std::mutex> lock(eqclass_mtx);
+		eqclass_last_use[idx] = ++eqclass_clock;
+		if (eqclass_blocks[idx])
+			return eqclass_blocks[idx];
+		if (eqclass_loading[idx].valid()) {
+			pending = eqclass_loading[idx];
+		} else {
+			// drop the least recently used blocks to make room, but always load the one asked for
+			while (eqclass_budget and eqclass_resident + eqclass_block_bytes[idx] > eqclass_budget) {
+				uint64_t lru = eqclass_blocks.size();
+				for (uint64_t b = 0; b < eqclass_blocks.size(); b++) {
+					if (eqclass_blocks[b] and (lru == eqclass_blocks.size() or
+																		 eqclass_last_use[b] < eqclass_last_use[lru]))
+						lru = b;
+				}
+				if (lru == eqclass_blocks.size())
+					break;
+				eqclass_blocks[lru].reset();
+				eqclass_resident -= eqclass_block_bytes[lru];
+			}
+			// counted from now, so that blocks loaded at the same time stay within the budget
+			eqclass_resident += eqclass_block_bytes[idx];
+			eqclass_loading[idx] = loaded.get_future().share();
+		}
+	}
+	// the file is read without the lock, so the threads using other blocks don't wait for it
+	if (pending.valid())
+		return pending.get();
+	auto block = std::make_shared<BitVectorRRR>();
+	if (!sdsl::load_from_file(*block, eqclass_block_files[idx])) {
+		if (console)
+			console->error("Couldn't load the color classes in {}.", eqclass_block_files[idx]);
+		// the block is loaded again by the next query that needs it
+		{
+			std::lock_guard<std::mutex> lock(eqclass_mtx);
+			eqclass_resident -= eqclass_block_bytes[idx];
+			eqclass_loading[idx] = {};
 		}
+		auto error = std::make_exception_ptr(
+			std::runtime_error("couldn't load the color classes in " + eqclass_block_files[idx]));
+		loaded.set_exception(error);
+		std::rethrow_exception(error);
+	}
+	{
+		std::lock_guard<std::mutex> lock(eqclass_mtx);
+		eqclass_blocks[idx] = block;
+		eqclass_loading[idx] = {};
 	}
-	return query_eqclass_map;
+	loaded.set_value(block);
+	return block;
 }
 
 template <class qf_obj, class key_obj>
@@ -588,7 +806,8 @@ template <class qf_obj, class key_obj>
 ColoredDbg<qf_obj, key_obj>::ColoredDbg(std::string& cqf_file,
 																				std::vector<std::string>&
 																				eqclass_files, std::string&
-																				sample_file, int flag) : bv_buffer(),
+																				sample_file, int flag, bool lazy_colors,
+																				uint64_t color_budget) : bv_buffer(),
 	start_time_(std::time(nullptr)) {
 		num_samples = 0;
 		num_serializations = 0;
@@ -612,12 +831,31 @@ ColoredDbg<qf_obj, key_obj>::ColoredDbg(std::string& cqf_file,
 			sorted_files[id] = file;
 		}
 
-		eqclasses.reserve(sorted_files.size());
-		BitVectorRRR bv;
-		for (auto file : sorted_files) {
-			sdsl::load_from_file(bv, file.second);
-			eqclasses.push_back(bv);
-			num_serializations++;
+		if (lazy_colors) {
+			lazy_eqclasses = true;
+			eqclass_budget = color_budget;
+			for (auto file : sorted_files) {
+				eqclass_block_files.push_back(file.second);
+				eqclass_block_bytes.push_back(mantis::fs::FileSize(file.second.c_str()));
+				num_serializations++;
+			}
+			eqclass_blocks.resize(num_serializations);
+			eqclass_loading.resize(num_serializations);
+			eqclass_last_use.resize(num_serializations, 0);
+			// an RRR vector is serialized with its length in bits first, so the number of
+			// classes in the last block is known without loading it
+			if (num_serializations) {
+				std::ifstream last(eqclass_block_files.back(), std::ios::binary);
+				last.read(reinterpret_cast<char *>(&eqclass_last_block_bits), sizeof(uint64_t));
+			}
+		} else {
+			eqclasses.reserve(sorted_files.size());
+			BitVectorRRR bv;
+			for (auto file : sorted_files) {
+				sdsl::load_from_file(bv, file.second);
+				eqclasses.push_back(bv);
+				num_serializations++;
+			}
 		}
 
 		std::ifstream sampleid(sample_file.c_str());
@@ -1,17 +1,21 @@
 #ifndef __MANTIS_COMMON_TYPES__
 #define __MANTIS_COMMON_TYPES__
 
-#include <unordered_set>
-#include <unordered_map>
+#include <cstdint>
 #include <vector>
 
+#include "tsl/hopscotch_map.h"
+#include "tsl/hopscotch_set.h"
+
 namespace mantis {
   using KmerHash = uint64_t;
   using ExperimentID = uint64_t;
-  using QuerySet = std::unordered_set<KmerHash>;
+  // open-addressing tables: a query allocates a few flat arrays instead of a node per k-mer
+  using QuerySet = tsl::hopscotch_set<KmerHash>;
   using QuerySets = std::vector<QuerySet>;
-  using QueryMap = std::unordered_map<KmerHash, uint64_t>;
-  using EqMap = std::unordered_map<KmerHash, std::vector<ExperimentID>>;
+  using QueryMap = tsl::hopscotch_map<KmerHash, uint64_t>;
+  /** color class id -> slot of its color in a ColorArena */
+  using EqMap = tsl::hopscotch_map<uint64_t, uint64_t>;
   struct BulkQuery {
     QuerySet qs;
      EqMap qmap;
@@ -20,6 +24,19 @@ namespace mantis {
 
   using QueryResult = std::vector<uint64_t>;//std::unordered_map<uint64_t, uint64_t>;
   using QueryResults = std::vector<QueryResult>;
+
+  /**
+   * empties a table reused across queries. Clearing keeps the buckets but walks all of them,
+   * so a table left mostly empty by one long query gets its memory back instead.
+   */
+  template <typename Table>
+  void clearTable(Table &table) {
+    if (table.bucket_count() > 4096 and table.size() * 8 < table.bucket_count()) {
+      Table().swap(table);
+    } else {
+      table.clear();
+    }
+  }
 }
 
 #endif //__MANTIS_COMMON_TYPES__
@@ -0,0 +1,96 @@
+//
+// Out-of-memory sort of the edges of the color graph for the MST construction.
+//
+
+#ifndef MANTIS_EDGESORT_H
+#define MANTIS_EDGESORT_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+namespace mantis {
+    /** an edge (n1, n2) of the color graph as one integer, so that edges sort by n1 then n2 */
+    inline uint64_t packEdge(uint32_t n1, uint32_t n2) { return (static_cast<uint64_t>(n1) << 32) | n2; }
+
+    inline uint32_t edgeSource(uint64_t edge) { return static_cast<uint32_t>(edge >> 32); }
+
+    inline uint32_t edgeTarget(uint64_t edge) { return static_cast<uint32_t>(edge); }
+
+    /**
+     * sorts keys with an LSD radix sort of 8-bit digits. The counts of all the digits are taken
+     * in one pass, and the digits that are the same in every key (e.g. the high bytes of small
+     * color class ids) are skipped. tmp is scratch space.
+     */
+    void radixSort(std::vector<uint64_t> &keys, std::vector<uint64_t> &tmp);
+}
+
+/**
+ * The edges (n1 < n2) of the color graph, sorted out of memory.
+ *
+ * Each thread building the graph fills a buffer of bufferEdges() edges. A full buffer is
+ * radix-sorted, deduplicated and ordered by bucket (the pair of color class buffers of its ends)
+ * and is then written to the temporary directory as a run, whose bucket offsets stay in memory.
+ * Runs are sorted by the threads that fill them, so they are sorted in parallel.
+ *
+ * The edges of a bucket are read back by a k-way merge of its part of every run, which also
+ * drops the edges found in several runs, and handed out in sorted batches. So the
+ * weights of a bucket are computed as it is merged, and the whole graph is never in memory.
+ */
+class EdgeSorter {
+public:
+    /**
+     * @param numBuffersIn the number of color class buffers, of bufferWidthIn color classes each
+     * @param memoryBytes the memory for the buffers of numProducers threads, and later for the merge
+     */
+    EdgeSorter(std::string tmpDirIn, uint64_t numBuffersIn, uint64_t bufferWidthIn, uint64_t memoryBytes,
+               uint32_t numProducers, spdlog::logger *loggerIn);
+
+    /** removes the runs */
+    ~EdgeSorter();
+
+    EdgeSorter(const EdgeSorter &) = delete;
+    EdgeSorter &operator=(const EdgeSorter &) = delete;
+
+    /** the number of edges a thread buffers before writing them as a run */
+    uint64_t bufferEdges() const { return bufferSize; }
+
+    /** sorts edges, writes them as a run and clears them. tmp is scratch space. Thread-safe. */
+    void writeRun(std::vector<uint64_t> &edges, std::vector<uint64_t> &tmp);
+
+    /** calls f(edges, n) with the distinct edges of bucket b in increasing order, a batch at a time */
+    void mergeBucket(uint64_t b, const std::function<void(const uint64_t *, uint64_t)> &f);
+
+    uint64_t numRuns() const { return runs.size(); }
+
+    /** edges written, counting the ones written in several runs once per run */
+    uint64_t numWritten() const { return written; }
+
+private:
+    struct Run {
+        std::string file;
+        std::vector<uint64_t> starts; // the offset of each bucket, and the number of edges last
+    };
+
+    uint64_t bucketOf(uint64_t edge) const {
+        return (mantis::edgeSource(edge) / bufferWidth) * numBuffers + mantis::edgeTarget(edge) / bufferWidth;
+    }
+
+    std::string tmpDir;
+    uint64_t numBuffers;
+    uint64_t bufferWidth;
+    uint64_t memory;
+    uint64_t bufferSize;
+    spdlog::logger *logger;
+    std::mutex runsMtx;
+    std::vector<Run> runs;
+    std::atomic<uint64_t> nextRun{0};
+    std::atomic<uint64_t> written{0};
+};
+
+#endif //MANTIS_EDGESORT_H
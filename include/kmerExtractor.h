@@ -0,0 +1,211 @@
+//
+// K-mer extraction shared by the query, validate and stats commands: 2-bit encoding of
+// blocks of bases, splitting on non-ACGT bases in place, and rolling canonical k-mers.
+//
+
+#ifndef MANTIS_KMEREXTRACTOR_H
+#define MANTIS_KMEREXTRACTOR_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace mantis {
+    /** the 2-bit code of every byte (C=0, A=1, T=2, G=3, either case), INVALID_BASE for anything else */
+    extern const std::array<uint8_t, 256> BASE_CODE;
+    constexpr uint8_t INVALID_BASE{4};
+    constexpr uint64_t BASE_BLOCK{64};
+
+    /**
+     * writes the 2-bit codes of the n <= BASE_BLOCK bases of seq to codes
+     * @return a mask with bit i set if base i isn't one of ACGT (its code is meaningless then)
+     */
+    uint64_t encodeBases(const char *seq, uint64_t n, uint8_t *codes);
+
+    /** the reverse complement of a k-mer of k <= 32 bases, in a constant number of word operations */
+    inline uint64_t reverseComplement(uint64_t kmer, uint32_t k) {
+        kmer = (kmer >> 32) | (kmer << 32);
+        kmer = ((kmer >> 16) & 0x0000ffff0000ffffULL) | ((kmer << 16) & 0xffff0000ffff0000ULL);
+        kmer = ((kmer >> 8) & 0x00ff00ff00ff00ffULL) | ((kmer << 8) & 0xff00ff00ff00ff00ULL);
+        kmer = ((kmer >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((kmer << 4) & 0xf0f0f0f0f0f0f0f0ULL);
+        kmer = ((kmer >> 2) & 0x3333333333333333ULL) | ((kmer << 2) & 0xccccccccccccccccULL);
+        // complementing is 3 - code, i.e. flipping both bits
+        return ~kmer >> (64 - 2 * k);
+    }
+
+    /** the canonical form of a k-mer given both strands: the larger one, as in Kmer::compare_kmers */
+    inline uint64_t canonicalKmer(uint64_t fwd, uint64_t rev) {
+        uint64_t takeRev = -static_cast<uint64_t>(fwd < rev);
+        return fwd ^ ((fwd ^ rev) & takeRev);
+    }
+
+    /** a hash of a canonical k-mer with well spread bits (canonical k-mers have skewed high bits) */
+    inline uint64_t mixKmer(uint64_t kmer) {
+        kmer ^= kmer >> 33;
+        kmer *= 0xff51afd7ed558ccdULL;
+        kmer ^= kmer >> 33;
+        return kmer;
+    }
+
+    /** a k-mer and its reverse complement, updated one base at a time */
+    class RollingKmer {
+    public:
+        explicit RollingKmer(uint32_t k) :
+                mask(k == 32 ? ~0ULL : (1ULL << (2 * k)) - 1), shift(2 * k - 2) {}
+
+        void push(uint8_t code) {
+            fwd = ((fwd << 2) | code) & mask;
+            rev = (rev >> 2) | (static_cast<uint64_t>(3 - code) << shift);
+        }
+
+        uint64_t canonical() const { return canonicalKmer(fwd, rev); }
+
+        uint64_t forward() const { return fwd; }
+
+    private:
+        uint64_t mask;
+        uint32_t shift;
+        uint64_t fwd{0}, rev{0};
+    };
+
+    /**
+     * calls onBase(code) for every ACGT base of seq and onBreak() for every other character,
+     * in order. The sequence is encoded a block of BASE_BLOCK bases at a time.
+     */
+    template <typename OnBase, typename OnBreak>
+    void forEachBase(const char *seq, uint64_t len, OnBase onBase, OnBreak onBreak) {
+        uint8_t codes[BASE_BLOCK];
+        for (uint64_t start = 0; start < len; start += BASE_BLOCK) {
+            uint64_t n = std::min(BASE_BLOCK, len - start);
+            uint64_t invalid = encodeBases(seq + start, n, codes);
+            if (!invalid) {
+                for (uint64_t i = 0; i < n; i++) {
+                    onBase(codes[i]);
+                }
+                continue;
+            }
+            for (uint64_t i = 0; i < n; i++) {
+                if ((invalid >> i) & 1) {
+                    onBreak();
+                } else {
+                    onBase(codes[i]);
+                }
+            }
+        }
+    }
+
+    /**
+     * Extracts the canonical k-mers (k <= 32) of sequences. A k-mer spanning a base other
+     * than ACGT (e.g. N) is skipped and extraction restarts after it.
+     */
+    class KmerExtractor {
+    public:
+        explicit KmerExtractor(uint32_t kIn) : k(kIn) {}
+
+        /** calls f(kmer) for the canonical k-mers of seq, in order, duplicates included */
+        template <typename F>
+        void forEach(const char *seq, uint64_t len, F f) const {
+            RollingKmer kmer(k);
+            uint64_t run{0}; // number of bases since the last break
+            forEachBase(seq, len,
+                        [&](uint8_t code) {
+                            kmer.push(code);
+                            if (++run >= k) f(kmer.canonical());
+                        },
+                        [&run]() { run = 0; });
+        }
+
+        template <typename F>
+        void forEach(const std::string &seq, F f) const { forEach(seq.data(), seq.size(), f); }
+
+        /**
+         * appends the canonical k-mers of seq to out
+         * @return the number of k-mers appended
+         */
+        uint64_t extract(const std::string &seq, std::vector<uint64_t> &out) const {
+            uint64_t before = out.size();
+            forEach(seq, [&out](uint64_t kmer) { out.push_back(kmer); });
+            return out.size() - before;
+        }
+
+        uint32_t kmerSize() const { return k; }
+
+    private:
+        uint32_t k;
+    };
+
+    /**
+     * Keeps a deterministic subset of the canonical k-mers of sequences, to screen long queries
+     * from a fraction of their k-mers. Either the k-mers whose hash falls in a fraction rate of
+     * the hash space are kept, which are the same k-mers in every query, or the k-mer of smallest
+     * hash in every window of w consecutive k-mers, so any w consecutive k-mers have one kept.
+     */
+    class KmerSampler {
+    public:
+        /** keeps every k-mer */
+        KmerSampler() = default;
+
+        /** @param window if more than 1, keep window minimizers instead of sampling by rate */
+        KmerSampler(uint32_t kIn, double rate, uint32_t windowIn) : k(kIn), window(windowIn) {
+            // clamped, as casting 2^64 or more to uint64_t is undefined
+            double max = rate * 18446744073709551616.0;
+            if (rate < 1) maxHash = max < 18446744073709551616.0 ? static_cast<uint64_t>(max) :
+                                    std::numeric_limits<uint64_t>::max();
+        }
+
+        bool enabled() const { return maxHash != std::numeric_limits<uint64_t>::max() or window > 1; }
+
+        /** calls f(kmer) for the kept k-mers of seq; a minimizer may be reported more than once */
+        template <typename F>
+        void forEach(const std::string &seq, F f) const {
+            if (window <= 1) {
+                uint64_t max = maxHash;
+                KmerExtractor(k).forEach(seq, [max, &f](uint64_t kmer) {
+                    if (mixKmer(kmer) <= max) f(kmer);
+                });
+                return;
+            }
+            // a window never spans a base other than ACGT
+            struct Candidate {
+                uint64_t hash, kmer, idx;
+            };
+            std::deque<Candidate> minimizers; // increasing hashes, the first one is the minimizer
+            uint64_t idx{0}; // number of k-mers since the last break
+            uint64_t reported{std::numeric_limits<uint64_t>::max()};
+            uint64_t run{0};
+            RollingKmer kmer(k);
+            auto endStretch = [&]() {
+                // a stretch shorter than a window still gets its minimizer
+                if (idx > 0 and idx < window) f(minimizers.front().kmer);
+                minimizers.clear();
+                idx = 0;
+                run = 0;
+                reported = std::numeric_limits<uint64_t>::max();
+            };
+            forEachBase(seq.data(), seq.size(), [&](uint8_t code) {
+                kmer.push(code);
+                if (++run < k) return;
+                uint64_t hash = mixKmer(kmer.canonical());
+                while (!minimizers.empty() and minimizers.back().hash > hash) minimizers.pop_back();
+                minimizers.push_back(Candidate{hash, kmer.canonical(), idx});
+                if (minimizers.front().idx + window <= idx) minimizers.pop_front();
+                if (++idx >= window and minimizers.front().idx != reported) {
+                    reported = minimizers.front().idx;
+                    f(minimizers.front().kmer);
+                }
+            }, endStretch);
+            endStretch();
+        }
+
+    private:
+        uint32_t k{0};
+        uint32_t window{0};
+        uint64_t maxHash{std::numeric_limits<uint64_t>::max()};
+    };
+}
+
+#endif //MANTIS_KMEREXTRACTOR_H
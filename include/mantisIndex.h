@@ -0,0 +1,104 @@
+//
+// Embeddable query API: an index loaded once and queried from any number of threads.
+//
+
+#ifndef MANTIS_MANTISINDEX_H
+#define MANTIS_MANTISINDEX_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+#include "mantisconfig.hpp"
+
+namespace mantis {
+    /**
+     * The answer to a query: the samples sharing k-mers with it, in increasing order,
+     * with the number of distinct k-mers of the query found in each.
+     */
+    struct QueryHits {
+        uint64_t numKmers{0}; // distinct k-mers of the query
+        std::vector<uint32_t> samples;
+        std::vector<uint32_t> counts;
+    };
+
+    enum class IndexEncoding {
+        mst, // built with mantis mst, the default
+        rrr  // the color classes as written by mantis build
+    };
+
+    struct IndexOptions {
+        IndexEncoding encoding{IndexEncoding::mst};
+        uint64_t cacheBudgetMb{DEFAULT_COLOR_CACHE_MB}; // of the cache of decoded color classes
+        uint64_t maxMemoryMb{0}; // for the whole index, 0 for no limit (see memoryPlan.h)
+        bool lazyColors{false}; // map or load the colors on demand even if they fit
+        bool loadWarmCache{false}; // see mantis warmcache
+        bool useUnitigs{false}; // see mantis unitigs
+    };
+
+    /**
+     * A Mantis index, kept in memory for as long as the object lives. Queries only read the
+     * index, so query and query_batch can be called from any number of threads at once: each
+     * call borrows query state (k-mer tables, decoded colors) from a pool that grows to the
+     * number of concurrent calls. MST indexes share one color cache across all calls.
+     *
+     *     auto index = mantis::Index::open("/path/to/index/");
+     *     if (!index) return; // a file of the index is missing
+     *     mantis::QueryHits hits = index->query("ACGT...");
+     *     for (uint64_t i = 0; i < hits.samples.size(); i++)
+     *         std::cout << index->sampleNames()[hits.samples[i]] << "\t" << hits.counts[i] << "\n";
+     *     std::vector<mantis::QueryHits> all = index->query_batch(reads, 8); // on 8 threads
+     *
+     * See the C++ API section of the README for the options.
+     */
+    class Index {
+    public:
+        /**
+         * loads the index in directory prefix
+         * @param logger where loading is reported; defaults to a logger that discards everything
+         * @return nullptr if a file of the index is missing (logged as an error)
+         */
+        static std::unique_ptr<Index> open(const std::string &prefix,
+                                           const IndexOptions &opt = IndexOptions(),
+                                           spdlog::logger *logger = nullptr);
+
+        ~Index();
+
+        Index(const Index &) = delete;
+        Index &operator=(const Index &) = delete;
+
+        /**
+         * counts the distinct k-mers of seq in every sample; bases other than ACGT break k-mers
+         * @throws std::runtime_error if a lazily loaded color class file can't be read
+         */
+        QueryHits query(std::string_view seq) const;
+
+        /** answers every query of seqs, in order, on numThreads threads */
+        std::vector<QueryHits> query_batch(const std::vector<std::string_view> &seqs,
+                                           uint32_t numThreads = 1) const;
+
+        std::vector<QueryHits> query_batch(const std::vector<std::string> &seqs,
+                                           uint32_t numThreads = 1) const;
+
+        uint32_t kmerSize() const;
+
+        uint64_t numSamples() const;
+
+        /** the sample names, by sample id */
+        const std::vector<std::string> &sampleNames() const;
+
+        IndexEncoding encoding() const;
+
+    private:
+        struct Impl;
+
+        explicit Index(std::unique_ptr<Impl> implIn);
+
+        std::unique_ptr<Impl> impl;
+    };
+}
+
+#endif //MANTIS_MANTISINDEX_H
@@ -16,10 +16,17 @@ namespace mantis{
     constexpr char PARENTBV_FILE[] = "parents.bv";
     constexpr char DELTABV_FILE[] = "deltas.bv";
     constexpr char BOUNDARYBV_FILE[] = "boundaries.bv";
+    constexpr char WARMCACHE_FILE[] = "warm_colors.cache";
+    constexpr char UNITIG_FILE[] = "unitigs.bin";
+    constexpr char EQCLASS_DIST_FILE[] = "eqclass_dist.lst";
 
     constexpr const uint64_t NUM_BV_BUFFER{20000000};
     constexpr const uint64_t INITIAL_EQ_CLASSES{10000};
     constexpr const uint64_t SAMPLE_SIZE{(1ULL << 26)};
+    constexpr const uint64_t DEFAULT_COLOR_CACHE_MB{512};
+    constexpr const uint64_t DEFAULT_MST_MEMORY_MB{512}; // for sorting the edges of the color graph
+    // a weight bucket of the color graph gets another thread in the MST for every this many edges
+    constexpr const uint64_t DEFAULT_MST_BUCKET_EDGES{1ULL << 16};
 } // namespace mantis
 
 #endif // __MANTIS_CONFIG_HPP__
@@ -0,0 +1,41 @@
+//
+// Choosing which structures of an index a query reads into memory and which it maps.
+//
+
+#ifndef MANTIS_MEMORYPLAN_H
+#define MANTIS_MEMORYPLAN_H
+
+#include <cstdint>
+#include <string>
+
+#include "spdlog/spdlog.h"
+
+/**
+ * How a query holds the structures of an index: read into memory, or mapped (the CQF and
+ * the MST files) or loaded a block at a time (RRR color classes) on first use, so a few
+ * queries against a large index only bring in the parts they touch.
+ *
+ * Without a budget everything is read, unless lazy colors are asked for. With a budget,
+ * everything is read if it fits, and the color cache gets what is left. Otherwise the colors
+ * are lazy, and the CQF is mapped as well if it would take more than half of the budget.
+ * The rest of the budget then goes to the color cache of an MST index, whose mapped files
+ * are in the page cache where the kernel can drop them, or is split between the RRR blocks
+ * kept loaded and the cache of decoded rows, which gets at most half of it.
+ */
+struct MemoryPlan {
+    bool mapCqf{false};
+    bool lazyColors{false};
+    uint64_t colorBudget{0}; // bytes of RRR blocks kept loaded with lazy colors, 0 for no limit
+    uint64_t cacheBudget{0}; // bytes of the color cache
+
+    /**
+     * @param mst whether the index is queried through its MST or its RRR color classes
+     * @param maxMemory bytes the index may take, 0 for no limit
+     * @param lazy make the colors lazy even if they fit
+     * @param cacheBudgetIn bytes asked for the color cache
+     */
+    static MemoryPlan choose(const std::string &prefix, bool mst, uint64_t maxMemory, bool lazy,
+                             uint64_t cacheBudgetIn, spdlog::logger *logger);
+};
+
+#endif //MANTIS_MEMORYPLAN_H
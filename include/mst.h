@@ -5,6 +5,8 @@
 #ifndef MANTIS_MST_H
 #define MANTIS_MST_H
 
+#include <atomic>
+#include <memory>
 #include <set>
 #include <vector>
 #include <queue>
@@ -22,10 +24,8 @@
 #include "canonicalKmer.h"
 #include "sdsl/bit_vectors.hpp"
 #include "gqf/hashutil.h"
+#include "edgeSort.h"
 
-#include "lru/lru.hpp"
-
-using LRUCacheMap =  LRU::Cache<uint64_t, std::vector<uint64_t>>;
 using SpinLockT = std::mutex;
 
 typedef sdsl::bit_vector BitVector;
@@ -67,102 +67,106 @@ struct workItem {
 };
 
 
-struct DisjointSetNode {
-    colorIdType parent{0};
-    uint64_t rnk{0}, w{0}, edges{0};
-
-    void setParent(colorIdType p) { parent = p; }
-
-    void mergeWith(DisjointSetNode &n, uint32_t edgeW, colorIdType id) {
-        n.setParent(parent);
-        w += (n.w + static_cast<uint64_t>(edgeW));
-        edges += (n.edges + 1);
-        n.edges = 0;
-        n.w = 0;
-        if (rnk == n.rnk) {
-            rnk++;
+/**
+ * Disjoint sets of color classes that threads merge concurrently without locks.
+ *
+ * find halves the path it walks with compare-and-swap, and unite links a root under another
+ * only while it is still a root. Roots are linked in the order of a hash of their ids, so
+ * concurrent links never make a cycle and the trees stay shallow without ranks.
+ */
+class ConcurrentDisjointSets {
+public:
+    explicit ConcurrentDisjointSets(uint64_t n) : parents(n) {
+        for (uint64_t i = 0; i < n; i++) {
+            parents[i].store(static_cast<colorIdType>(i), std::memory_order_relaxed);
         }
     }
-};
 
-// To represent Disjoint Sets
-struct DisjointSets {
-    std::vector<DisjointSetNode> els;
-    uint64_t n;
-
-    // Constructor.
-    explicit DisjointSets(uint64_t n) {
-        // Allocate memory
-        this->n = n;
-        els.resize(n);
-        // Initially, all vertices are in
-        // different sets and have rank 0.
-        for (uint64_t i = 0; i < n; i++) {
-            //every element is parent of itself
-            els[i].setParent(static_cast<colorIdType>(i));
+    colorIdType find(colorIdType u) {
+        while (true) {
+            colorIdType p = parents[u].load(std::memory_order_relaxed);
+            if (p == u) return u;
+            colorIdType gp = parents[p].load(std::memory_order_relaxed);
+            if (p != gp) {
+                parents[u].compare_exchange_weak(p, gp, std::memory_order_relaxed);
+            }
+            u = gp;
         }
     }
 
-    // Find the parent of a node 'u'
-    // Path Compression
-    uint32_t find(colorIdType u) {
-        /* Make the parent of the nodes in the path
-           from u--> parent[u] point to parent[u] */
-        if (u != els[u].parent)
-            els[u].parent = find(els[u].parent);
-        return els[u].parent;
+    /** @return true if u and v were in different sets, which are now merged */
+    bool unite(colorIdType u, colorIdType v) {
+        while (true) {
+            u = find(u);
+            v = find(v);
+            if (u == v) return false;
+            if (priority(u) > priority(v)) std::swap(u, v);
+            colorIdType root = u;
+            if (parents[u].compare_exchange_strong(root, v)) return true;
+        }
     }
 
-    // Union by rank
-    void merge(colorIdType x, colorIdType y, uint32_t edgeW) {
-        x = find(x), y = find(y);
-
-        /* Make tree with smaller height
-           a subtree of the other tree  */
-        if (els[x].rnk > els[y].rnk) {
-            els[x].mergeWith(els[y], edgeW, x);
+private:
+    // a bijection, so no two ids have the same priority
+    static uint64_t priority(colorIdType u) { return static_cast<uint64_t>(u) * 0x9E3779B97F4A7C15ULL; }
 
-        } else {// If rnk[x] <= rnk[y]
-            els[y].mergeWith(els[x], edgeW, y);
-        }
-    }
+    std::vector<std::atomic<colorIdType>> parents;
 };
 
 class MST {
 public:
-    MST(std::string prefix, std::shared_ptr<spdlog::logger> logger, uint32_t numThreads);
+    /**
+     * @param tmpDirIn where the edges of the color graph are sorted, the index directory if empty
+     * @param edgeMemoryIn bytes for sorting the edges
+     * @param colorMemoryIn bytes for the color class buffers loaded together, 0 for two at a time
+     * @param bucketEdgesIn the edges of one weight each thread finding the MST needs at least
+     */
+    MST(std::string prefix, std::shared_ptr<spdlog::logger> logger, uint32_t numThreads,
+        uint32_t maxDepthIn = 0, std::string tmpDirIn = "",
+        uint64_t edgeMemoryIn = mantis::DEFAULT_MST_MEMORY_MB << 20, uint64_t colorMemoryIn = 0,
+        uint64_t bucketEdgesIn = mantis::DEFAULT_MST_BUCKET_EDGES);
 
     void buildMST();
 
 private:
     bool buildEdgeSets();
 
-    void findNeighborEdges(CQF<KeyObject> &cqf, KeyObject &keyobj, std::vector<Edge> &edgeList);
+    void findNeighborEdges(CQF<KeyObject> &cqf, KeyObject &keyobj, std::vector<uint64_t> &edgeList);
 
     bool calculateWeights();
 
     bool encodeColorClassUsingMST();
 
-    DisjointSets kruskalMSF();
+    void kruskalMSF();
+
+    void boundDecodeDepth(sdsl::int_vector<> &parentbv, sdsl::int_vector<> &weightbv,
+                          std::vector<colorIdType> &bfsOrder);
 
     std::set<workItem> neighbors(CQF<KeyObject> &cqf, workItem n);
 
     bool exists(CQF<KeyObject> &cqf, dna::canonical_kmer e, uint64_t &eqid);
 
     uint64_t hammingDist(uint64_t eqid1, uint64_t eqid2,
-                         uint64_t &srcId, std::vector<uint64_t> &srcEq);
+                         uint64_t &srcId, std::vector<uint64_t> &srcEq,
+                         const BitVectorRRR *bv1, const BitVectorRRR *bv2);
 
     std::vector<uint32_t> getDeltaList(uint64_t eqid1, uint64_t eqid2);
 
-    void buildColor(std::vector<uint64_t> &eq, uint64_t eqid, BitVectorRRR *bv);
+    void buildColor(std::vector<uint64_t> &eq, uint64_t eqid, const BitVectorRRR *bv);
 
     inline uint64_t getBucketId(uint64_t c1, uint64_t c2);
 
     void buildPairedColorIdEdgesInParallel(uint32_t threadId, CQF<KeyObject> &cqf,
-                                           std::vector<spp::sparse_hash_set<Edge, edge_hash>> &edgesetList,
-                                           sdsl::bit_vector &nodes, uint64_t &maxId, uint64_t &numOfKmers);
+                                           uint64_t &maxId, uint64_t &numOfKmers);
+
+    void weighEdges(const uint64_t *edges, uint64_t numEdges, const BitVectorRRR *bv1, const BitVectorRRR *bv2,
+                    std::vector<std::vector<Edge>> &localWeightBucket);
+
+    void kruskalBucketInParallel(uint32_t threadId, uint32_t numWorkers, uint32_t w,
+                                 const std::vector<Edge> &edges, ConcurrentDisjointSets &ds,
+                                 std::vector<std::pair<Edge, uint32_t>> &selected);
 
-    void calcHammingDistInParallel(uint32_t i, std::vector<Edge> &edgeList);
+    void fillMSTInParallel(uint32_t threadId, const std::vector<std::vector<std::pair<Edge, uint32_t>>> &selected);
 
     void calcDeltasInParallel(uint32_t threadID, uint64_t cbvID1, uint64_t cbvID2,
             sdsl::int_vector<> &parentbv, sdsl::int_vector<> &deltabv,
@@ -177,14 +181,18 @@ private:
     uint64_t mstTotalWeight = 0;
     colorIdType zero = static_cast<colorIdType>(UINT64_MAX);
     BitVectorRRR *bvp1, *bvp2;
-    LRUCacheMap lru_cache;
     uint64_t gcntr = 0;
     std::vector<std::string> eqclass_files;
-    std::vector<std::vector<Edge>> edgeBucketList;
+    std::string tmpDir;
+    uint64_t edgeMemory;
+    uint64_t colorMemory;
+    uint64_t bucketEdges; // a weight bucket gets another thread in kruskalMSF for every this many edges
+    std::unique_ptr<EdgeSorter> edgeSorter;
     std::vector<std::vector<Edge>> weightBuckets;
     std::vector<std::vector<std::pair<colorIdType, uint32_t> >> mst;
     spdlog::logger *logger{nullptr};
     uint32_t nThreads = 1;
+    uint32_t maxDepth = 0; // 0 means the decode depth isn't bounded
     SpinLockT colorMutex;
 
 };
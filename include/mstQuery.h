@@ -8,27 +8,36 @@
 #include "spdlog/spdlog.h"
 #include "sdsl/bit_vectors.hpp"
 #include "mantisconfig.hpp"
-#include "lru/lru.hpp"
 #include "gqf_cpp.h"
 #include "common_types.h"
 #include "tsl/hopscotch_map.h"
+#include "tsl/hopscotch_set.h"
 #include "nonstd/optional.hpp"
-
-using LRUCacheMap =  LRU::Cache<uint64_t, std::vector<uint64_t>>;
+#include "colorBitset.h"
+#include "colorCache.h"
+#include "warmCache.h"
+#include "sampleMask.h"
+#include "queryProfile.h"
+#include "resultWriter.h"
+#include "unitigTable.h"
+#include "kmerExtractor.h"
 
 struct QueryStats {
-    uint32_t cnt = 0, cacheCntr = 0, noCacheCntr{0};
+    uint32_t cnt = 0, cacheCntr = 0, noCacheCntr{0}, warmCntr{0};
     uint64_t totSel{0};
-    std::chrono::duration<double> selectTime{0};
-    std::chrono::duration<double> flipTime{0};
     uint64_t totEqcls{0};
     uint64_t rootedNonZero{0};
+    uint64_t skippedClasses{0}; // not decoded since they couldn't change a threshold query
+    uint64_t sampledKmers{0}; // distinct k-mers queried when screening
+    uint64_t refinedQueries{0}, refinedSamples{0}; // screened queries and samples decided over all the k-mers
     uint64_t nextCacheUpdate{10000};
     uint64_t globalQueryNum{0};
     std::vector<uint64_t> buffer;
+    ColorBitset color; // reused by buildColor
     uint64_t numSamples{0};
     tsl::hopscotch_map<uint32_t, uint64_t> numOcc;
     bool trySample{false};
+    QueryProfile profile;
     //std::unordered_map<uint32_t, uint64_t> numOcc;
 };
 
@@ -55,43 +64,233 @@ private:
     uint32_t maxRank_{0};
 };
 
+/** read-only view of the words of a packed integer vector, read into memory or mapped */
+class PackedView {
+public:
+    PackedView() = default;
+
+    PackedView(const uint64_t *wordsIn, uint64_t sizeIn, uint8_t widthIn) :
+            words(wordsIn), n(sizeIn), w(widthIn) {}
+
+    uint64_t size() const { return n; }
+
+    uint8_t width() const { return w; }
+
+    const uint64_t *data() const { return words; }
+
+    /** the len <= 64 bits starting at bit idx, as sdsl::int_vector::get_int */
+    uint64_t get_int(uint64_t idx, uint8_t len = 64) const {
+        uint64_t wrd = idx >> 6, offset = idx & 63;
+        uint64_t value = words[wrd] >> offset;
+        if (offset + len > 64) {
+            value |= words[wrd + 1] << (64 - offset);
+        }
+        return len == 64 ? value : value & ((1ULL << len) - 1);
+    }
+
+    uint64_t operator[](uint64_t i) const { return get_int(i * w, w); }
+
+private:
+    const uint64_t *words{nullptr};
+    uint64_t n{0};
+    uint8_t w{0};
+};
+
+/**
+ * The MST representation of the color classes of an index. It is read-only once loaded,
+ * so any number of MSTQuery objects (e.g. one per server worker) can share one copy.
+ *
+ * The files are either read into memory or, with mapped set, mapped as they are (the sdsl
+ * serialization of a vector is its size and width in one word, followed by its words), so
+ * a query only faults in the pages of the colors it decodes and the kernel can drop them
+ * again. The select structure over the boundaries is then replaced by the position of
+ * every SELECT_SAMPLE-th boundary, a word per SELECT_SAMPLE color classes.
+ */
+class MSTIndex {
+public:
+    static constexpr uint64_t SELECT_SAMPLE{64};
+
+    MSTIndex(const std::string &prefix, spdlog::logger *logger, bool mapped = false);
+
+    ~MSTIndex();
+
+    MSTIndex(const MSTIndex &) = delete;
+    MSTIndex &operator=(const MSTIndex &) = delete;
+
+    uint64_t numColorClasses() const { return parentbv.size() - 1; }
+
+    bool isMapped() const { return !mappings.empty(); }
+
+    /** the position in deltabv of the first delta of color class i */
+    uint64_t deltaStart(uint64_t i) const {
+        if (i == 0) return 0;
+        return (isMapped() ? sampledSelect(i) : sbbv(i)) + 1;
+    }
+
+    uint32_t zero; // the dummy root, its color is empty
+    PackedView parentbv;
+    PackedView deltabv;
+    PackedView bbv;
+
+private:
+    /** maps the sdsl vector in file, of width fixedWidth or of the width stored in it if 0 */
+    PackedView mapVector(const std::string &file, uint8_t fixedWidth, spdlog::logger *logger);
+
+    /** the position of the i-th (from 1) set bit of bbv */
+    uint64_t sampledSelect(uint64_t i) const;
+
+    sdsl::int_vector<> parents;
+    sdsl::int_vector<> deltas;
+    sdsl::bit_vector boundaries;
+    sdsl::bit_vector::select_1_type sbbv;
+    std::vector<uint64_t> selectSamples; // position of set bits 1, SELECT_SAMPLE + 1, ... of bbv
+    std::vector<std::pair<void *, size_t>> mappings;
+};
+
 class MSTQuery {
 private:
+    // values of kmer2cidMap other than color class ids
+    static constexpr uint64_t NOT_LOOKED_UP{std::numeric_limits<uint64_t>::max()};
+    static constexpr uint64_t ABSENT{NOT_LOOKED_UP - 1};
+
     uint64_t numSamples;
     uint64_t numWrds;
-    uint32_t zero;
-    sdsl::bit_vector bbv;
+    std::shared_ptr<const MSTIndex> index;
     spdlog::logger *logger{nullptr};
+    // reused across queries, so that their capacity is only allocated for the first few reads
     mantis::QueryMap kmer2cidMap;
-    mantis::EqMap cid2expMap;
+    tsl::hopscotch_map<uint64_t, uint64_t> classCnt; // color class id -> number of k-mers
+    mantis::EqMap cid2slot; // color class id -> its decoded color in colors
+    ColorArena colors;
+    ColorBitset decoded;
+    const WarmColorCache *warmCache{nullptr};
+    const SampleMask *sampleMask{nullptr};
+    const UnitigTable *unitigs{nullptr};
+    uint64_t unitigKmers{0}, unitigLookups{0};
+    mantis::KmerSampler sampler;
+
+    void xorDeltas(uint64_t from, ColorBitset &color) const;
+
+    /** looks the parsed k-mers up in the CQF and counts the k-mers of each color class in classCnt */
+    void lookupKmers(CQF<KeyObject> &dbg);
+
+    /** parseKmers without the sampler */
+    void parseAllKmers(const std::string &read, uint64_t kmer_size);
 
 public:
     uint32_t queryK;
     uint32_t indexK;
-    sdsl::int_vector<> parentbv;
-    sdsl::int_vector<> deltabv;
-    sdsl::bit_vector::select_1_type sbbv;
 
     MSTQuery(std::string prefix, uint32_t indexKIn, uint32_t queryKIn,
             uint64_t numSamplesIn, spdlog::logger *loggerIn) :
-    numSamples(numSamplesIn), indexK(indexKIn), queryK(queryKIn), logger(loggerIn) {
+    numSamples(numSamplesIn), indexK(indexKIn), queryK(queryKIn), logger(loggerIn),
+    colors(numSamplesIn) {
         numWrds = (uint64_t) std::ceil((double) numSamples / 64.0);
-        loadIdx(prefix);
+        index = std::make_shared<const MSTIndex>(prefix, logger);
     }
 
-    void loadIdx(std::string indexDir);
+    /** a query over an index that was already loaded, e.g. by another MSTQuery */
+    MSTQuery(std::shared_ptr<const MSTIndex> indexIn, uint32_t indexKIn, uint32_t queryKIn,
+             uint64_t numSamplesIn, spdlog::logger *loggerIn) :
+    numSamples(numSamplesIn), index(std::move(indexIn)), indexK(indexKIn), queryK(queryKIn),
+    logger(loggerIn), colors(numSamplesIn) {
+        numWrds = (uint64_t) std::ceil((double) numSamples / 64.0);
+    }
+
+    std::shared_ptr<const MSTIndex> getIndex() const { return index; }
+
+    uint64_t numColorClasses() const { return index->numColorClasses(); }
+
+    /** colors found in warmCacheIn are used as is instead of being decoded from the MST */
+    void setWarmCache(const WarmColorCache *warmCacheIn) { warmCache = warmCacheIn; }
+
+    /**
+     * restricts the decoded colors, and so the results, to the samples of mask. Colors put in the
+     * color cache are then restricted as well, so a cache must not be shared across masks.
+     */
+    void setSampleMask(const SampleMask *mask) { sampleMask = mask; }
+
+    /**
+     * k-mers of the index k are then matched along the unitigs of unitigsIn while they are
+     * parsed, instead of being looked up in the CQF. unitigsIn must be built from that CQF.
+     */
+    void setUnitigs(const UnitigTable *unitigsIn) { unitigs = unitigsIn; }
+
+    /** the number of k-mers parsed through the unitigs, and how many of them were looked up there */
+    uint64_t numUnitigKmers() const { return unitigKmers; }
+
+    uint64_t numUnitigLookups() const { return unitigLookups; }
+
+    /** only the k-mers kept by samplerIn are parsed from then on, to screen queries */
+    void setSampler(const mantis::KmerSampler &samplerIn) { sampler = samplerIn; }
+
+    const mantis::KmerSampler &getSampler() const { return sampler; }
+
+    /**
+     * decodes the color of eqid from the MST, stopping at the first ancestor found in the warm
+     * cache or in cache. eqid itself isn't looked up in cache, the caller does that first.
+     */
+    void buildColor(uint64_t eqid, QueryStats &queryStats,
+                    ColorCache *cache,
+                    RankScores* rs,
+                    nonstd::optional<uint64_t>& toDecode, // output param.  Also decode these
+                    ColorBitset &color);
+
+    /** same as above, but returns the sorted sample ids of the color */
     std::vector<uint64_t> buildColor(uint64_t eqid, QueryStats &queryStats,
-                                     LRUCacheMap *lru_cache,
+                                     ColorCache *cache,
                                      RankScores* rs,
                                      nonstd::optional<uint64_t>& toDecode // output param.  Also decode these
                                      );
 
-    void parseKmers(std::string read, uint64_t kmer_size);
+    void parseKmers(const std::string &read, uint64_t kmer_size);
+
+    /** adds the k-mers parsed since the last reset to kmers */
+    void collectKmers(mantis::QuerySet &kmers) const {
+        kmers.reserve(kmers.size() + kmer2cidMap.size());
+        for (auto &kv : kmer2cidMap) kmers.insert(kv.first);
+    }
+
+    /**
+     * writes the color of eqclass_id to color, from the warm cache, the color cache or the MST.
+     * Only reads the index, so threads with their own queryStats can share one MSTQuery.
+     */
+    void decodeClass(uint64_t eqclass_id, ColorBitset &color, ColorCache &cache,
+                     RankScores *rs, QueryStats &queryStats);
     void findSamples(CQF<KeyObject> &dbg,
-                                        LRUCacheMap &lru_cache,
+                                        ColorCache &cache,
                                         RankScores *rs,
                                         QueryStats &queryStats);
-    mantis::QueryResult convertIndexK2QueryK(std::string &read);
+
+    /**
+     * answers a threshold query over the parsed k-mers
+     * @param candidates if set, the bitset of the only samples to consider
+     * @return the samples containing at least a fraction theta of them
+     */
+    std::vector<uint64_t> findSamplesAboveThreshold(CQF<KeyObject> &dbg,
+                                                    ColorCache &cache,
+                                                    RankScores *rs,
+                                                    QueryStats &queryStats,
+                                                    double theta,
+                                                    const uint64_t *candidates = nullptr);
+
+    /**
+     * answers a threshold query over the k-mers of read kept by the sampler, which must have
+     * been parsed, and writes the confidence interval of the containment of each sample to
+     * bounds (see containmentBounds). The samples containing a fraction theta of the sampled
+     * k-mers are reported or, with refine, those whose interval is above theta, and those
+     * whose interval contains theta are decided over all the k-mers of read.
+     */
+    std::vector<uint64_t> screenAboveThreshold(const std::string &read,
+                                               CQF<KeyObject> &dbg,
+                                               ColorCache &cache,
+                                               RankScores *rs,
+                                               QueryStats &queryStats,
+                                               double theta,
+                                               bool refine,
+                                               SampleBounds &bounds);
+
+    mantis::QueryResult convertIndexK2QueryK(const std::string &read);
 
     mantis::QueryResult getResultList();
 
@@ -102,4 +301,10 @@ public:
     }
 };
 
+std::vector<std::string> loadSampleFile(const std::string &sampleFileAddr);
+
+void query_read(std::string &read, const std::string &name, MSTQuery &mstQuery, CQF<KeyObject> &cqf, ColorCache &cache,
+                RankScores &rs, ResultWriter &writer, QueryStats &queryStats, double theta = 0,
+                bool refine = false);
+
 #endif //MANTIS_MSTQUERY_H
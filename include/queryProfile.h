@@ -0,0 +1,149 @@
+//
+// Instrumentation of the query pipeline: per-phase timers, latency histograms and a JSON summary.
+//
+
+#ifndef MANTIS_QUERYPROFILE_H
+#define MANTIS_QUERYPROFILE_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * Histogram of durations in nanoseconds. Every power of two is split in 2^SUB_BITS
+ * buckets, so a percentile is within 12.5% of the exact value at any scale while
+ * recording stays a couple of bit operations.
+ */
+class LatencyHistogram {
+public:
+    static constexpr uint32_t SUB_BITS{3};
+    static constexpr uint32_t NUM_BUCKETS{64 << SUB_BITS};
+
+    void record(uint64_t ns);
+
+    void merge(const LatencyHistogram &other);
+
+    /** an upper bound of the p-quantile of the recorded values, p in [0, 1] */
+    uint64_t percentile(double p) const;
+
+    uint64_t count() const { return cnt; }
+
+    uint64_t total() const { return sum; }
+
+    /** count, mean, p50, p99, p999 and max in microseconds as a JSON object */
+    std::string toJson() const;
+
+    /** the p50, p99 and p999 in microseconds, for logs */
+    std::string summary() const;
+
+private:
+    static uint32_t bucketOf(uint64_t ns);
+
+    static uint64_t bucketEnd(uint32_t bucket);
+
+    std::array<uint64_t, NUM_BUCKETS> buckets{};
+    uint64_t cnt{0};
+    uint64_t sum{0};
+    uint64_t max{0};
+};
+
+enum class QueryPhase : uint32_t {
+    parse, lookup, decode, count, output
+};
+
+/**
+ * Where the time of the queries goes. The latency of every query is recorded, while the
+ * phases of a query are only timed for one query out of sampleEvery, so that leaving the
+ * profile on costs two clock reads per query and a few per sampled query.
+ * A profile is owned by one thread (it lives in QueryStats); profiles of several threads are merged.
+ */
+class QueryProfile {
+public:
+    static constexpr uint32_t NUM_PHASES{5};
+    static constexpr uint32_t DEFAULT_SAMPLE_EVERY{16};
+    static constexpr uint32_t MAX_DEPTH{64}; // deeper MST decodes share the last bucket of the depth histogram
+
+    using clock = std::chrono::steady_clock;
+
+    static const char *phaseName(QueryPhase phase);
+
+    explicit QueryProfile(uint32_t sampleEveryIn = DEFAULT_SAMPLE_EVERY) : sampleEvery(sampleEveryIn) {}
+
+    void beginQuery();
+
+    void endQuery();
+
+    /** whether phases are timed now: during sampled queries, and always outside of a query (e.g. in bulk mode) */
+    bool timing() const { return inSample or !inQuery; }
+
+    /** adds ns to phase for the current query, or to the phase total outside of a query */
+    void addPhase(QueryPhase phase, uint64_t ns);
+
+    /** number of MST nodes visited to decode a color */
+    void recordDepth(uint64_t depth) { depths[std::min<uint64_t>(depth, MAX_DEPTH)]++; }
+
+    void merge(const QueryProfile &other);
+
+    const LatencyHistogram &queryLatency() const { return latency; }
+
+    /** the query latencies, the phases and the MST decode depth histogram as a JSON object */
+    std::string toJson() const;
+
+private:
+    uint32_t sampleEvery;
+    uint64_t queryCntr{0};
+    bool inQuery{false};
+    bool inSample{false};
+    clock::time_point queryStart;
+    std::array<uint64_t, NUM_PHASES> current{};     // phases of the current query
+    std::array<uint64_t, NUM_PHASES> phaseTotals{}; // ns over all the sampled queries and bulk phases
+    std::array<LatencyHistogram, NUM_PHASES> phases;
+    LatencyHistogram latency;
+    std::array<uint64_t, MAX_DEPTH + 1> depths{};
+};
+
+/**
+ * Adds the time until it goes out of scope (or until stop) to a phase of profile, if the profile is timing.
+ */
+class PhaseTimer {
+public:
+    PhaseTimer(QueryProfile &profileIn, QueryPhase phaseIn) : PhaseTimer(&profileIn, phaseIn) {}
+
+    /** does nothing if profileIn is null */
+    PhaseTimer(QueryProfile *profileIn, QueryPhase phaseIn) :
+            profile(profileIn), phase(phaseIn), active(profileIn and profileIn->timing()) {
+        if (active) start = QueryProfile::clock::now();
+    }
+
+    ~PhaseTimer() { stop(); }
+
+    /** adds the time so far, the timer does nothing afterwards */
+    void stop() {
+        if (active) {
+            profile->addPhase(phase, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    QueryProfile::clock::now() - start).count());
+            active = false;
+        }
+    }
+
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+    QueryProfile *profile;
+    QueryPhase phase;
+    bool active;
+    QueryProfile::clock::time_point start;
+};
+
+/**
+ * writes {"name": value, ...} to file, values being JSON already
+ * @return false if the file couldn't be written
+ */
+bool writeJsonSummary(const std::string &file, const std::vector<std::pair<std::string, std::string>> &fields);
+
+#endif //MANTIS_QUERYPROFILE_H
@@ -0,0 +1,95 @@
+//
+// Query server keeping an MST index resident and answering batches over a UNIX domain socket.
+//
+
+#ifndef MANTIS_QUERYSERVER_H
+#define MANTIS_QUERYSERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "ProgOpts.h"
+#include "gqf_cpp.h"
+#include "mstQuery.h"
+
+/**
+ * Keeps the latencies of the most recent batches and answers percentiles over them.
+ */
+class LatencyRecorder {
+public:
+    static constexpr uint64_t WINDOW{4096};
+
+    void record(double ms);
+
+    /** writes count, mean, p50, p99 and max as a JSON object */
+    std::string toJson() const;
+
+private:
+    mutable std::mutex mtx;
+    std::vector<double> window;
+    uint64_t next{0};
+    uint64_t cnt{0};
+    double total{0};
+    double max{0};
+};
+
+/**
+ * Protocol: a client writes query sequences, one per line, and ends a batch with an empty
+ * line (or by closing its side of the connection). The results of the batch come back in
+ * the TSV or JSON format of `mantis query`, followed by an empty line.
+ * A connection can carry any number of batches. Lines starting with '#' are directives:
+ *   #json, #tsv   output format of the current connection (TSV by default)
+ *   #stats        replies with the server statistics as a JSON object, then an empty line
+ */
+class QueryServer {
+public:
+    explicit QueryServer(ServeOpts &optIn);
+
+    QueryServer(const QueryServer &) = delete;
+    QueryServer &operator=(const QueryServer &) = delete;
+
+    /** serves until SIGINT or SIGTERM */
+    int run();
+
+private:
+    void worker();
+
+    void serveConnection(int fd, MSTQuery &mstQuery, QueryStats &queryStats, RankScores &rs);
+
+    bool answerBatch(int fd, std::vector<std::string> &reads, bool use_json,
+                     MSTQuery &mstQuery, QueryStats &queryStats, RankScores &rs);
+
+    std::string statsJson();
+
+    ServeOpts &opt;
+    spdlog::logger *logger;
+    std::vector<std::string> sampleNames;
+    std::unique_ptr<CQF<KeyObject>> cqf;
+    uint32_t indexK{0};
+    uint32_t queryK{0};
+    std::shared_ptr<const MSTIndex> index;
+    WarmColorCache warmCache;
+    bool useWarmCache{false};
+    std::unique_ptr<ColorCache> cache;
+
+    std::mutex queueMtx;
+    std::condition_variable queueCv;
+    std::deque<int> pending; // accepted connections no worker picked up yet
+    std::unordered_set<int> active;
+    bool stopping{false};
+
+    std::atomic<uint64_t> connections{0};
+    std::atomic<uint64_t> batches{0};
+    std::atomic<uint64_t> queries{0};
+    LatencyRecorder latency;
+};
+
+#endif //MANTIS_QUERYSERVER_H
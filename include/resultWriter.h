@@ -0,0 +1,176 @@
+//
+// Writers of query results in TSV, JSON and a compact binary format, and a reader of the latter.
+//
+
+#ifndef MANTIS_RESULTWRITER_H
+#define MANTIS_RESULTWRITER_H
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "common_types.h"
+
+enum class ResultFormat {
+    tsv, json, binary
+};
+
+/**
+ * The containment of each sample in a query screened from a subset of its k-mers, by sample
+ * id: a 95% confidence interval [low, high] of the fraction of its k-mers the sample contains
+ * (see containmentBounds).
+ */
+struct SampleBounds {
+    std::vector<double> low;
+    std::vector<double> high;
+};
+
+/** the format named name ("tsv", "json" or "binary"), false if there is none */
+bool parseResultFormat(const std::string &name, ResultFormat &format);
+
+/**
+ * Writes query results to a stream through a large buffer. A result is first formatted to
+ * a record, which only reads the writer, so records can be formatted by several threads
+ * and then emitted in query order. Sample names are formatted once, when the writer is made.
+ *
+ * A run writes either per-sample counts (writeCounts) or, for threshold queries, the
+ * samples passing the threshold (writeSamples). A query is named by its record name in the
+ * query file, or by its number if it has none. A writer made withBounds also writes the
+ * containment bounds of every sample it reports.
+ */
+class ResultWriter {
+public:
+    static constexpr uint64_t BUFFER_SIZE{1ULL << 20};
+
+    /**
+     * @param queryPrefix written before the number of unnamed queries in TSV outputs
+     * @param samplesOnly whether the results are lists of samples instead of counts
+     * @param withBounds whether the queries are screened, and each reported sample has SampleBounds
+     */
+    static std::unique_ptr<ResultWriter> create(ResultFormat format, std::ostream &out,
+                                                const std::vector<std::string> &sampleNames,
+                                                const std::string &queryPrefix, bool samplesOnly,
+                                                bool withBounds = false);
+
+    virtual ~ResultWriter() = default;
+
+    /**
+     * appends the non-zero counts of query qnum to record
+     * @param bounds read for the samples reported if the writer is made withBounds, [0, 1] if null
+     */
+    virtual void formatCounts(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                              const mantis::QueryResult &counts, const SampleBounds *bounds,
+                              std::string &record) const = 0;
+
+    /** appends the samples (ids, ascending) reported for query qnum to record */
+    virtual void formatSamples(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                               const std::vector<uint64_t> &samples, const SampleBounds *bounds,
+                               std::string &record) const = 0;
+
+    /** writes a formatted record, after the previous ones */
+    void emit(const std::string &record);
+
+    void writeCounts(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                     const mantis::QueryResult &counts, const SampleBounds *bounds = nullptr);
+
+    void writeSamples(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                      const std::vector<uint64_t> &samples, const SampleBounds *bounds = nullptr);
+
+    /** closes the output (e.g. the JSON array) and flushes it. Nothing can be written afterwards. */
+    void finish();
+
+    uint64_t numRecords() const { return records; }
+
+protected:
+    ResultWriter(std::ostream &outIn, bool withBoundsIn) : out(outIn), withBounds(withBoundsIn) {
+        buffer.reserve(BUFFER_SIZE);
+    }
+
+    /** the bounds of sample s, [0, 1] (nothing known) without bounds */
+    static void boundsOf(const SampleBounds *bounds, uint64_t s, double &low, double &high) {
+        low = bounds ? bounds->low[s] : 0;
+        high = bounds ? bounds->high[s] : 1;
+    }
+
+    /** what goes before every record but the first */
+    virtual const char *separator() const { return ""; }
+
+    virtual void writeFooter() {}
+
+    void flush();
+
+    std::ostream &out;
+    bool withBounds;
+    std::string buffer;
+    std::string scratch;
+    uint64_t records{0};
+    bool finished{false};
+};
+
+/**
+ * A record of a binary result file. samples are ascending, counts is empty if the
+ * file holds lists of samples, and low and high, the bounds of the samples, are empty
+ * if it holds no bounds.
+ */
+struct ResultRecord {
+    uint64_t qnum{0};
+    std::string name;
+    uint64_t numKmers{0};
+    std::vector<uint32_t> samples;
+    std::vector<uint32_t> counts;
+    std::vector<float> low;
+    std::vector<float> high;
+};
+
+/**
+ * Reads the binary result format:
+ *   "MANTISRB", uint32 version, uint32 flags (SAMPLES_ONLY, BOUNDS), uint64 numSamples,
+ *   uint32 length + bytes of the query prefix and of every sample name,
+ * then for every query: uint64 qnum, uint32 length + bytes of its name (empty if the query
+ * had none), uint64 numKmers, uint32 n, uint32 sampleIds[n], unless SAMPLES_ONLY
+ * uint32 counts[n], and with BOUNDS float32 low[n] and float32 high[n]; and a last qnum
+ * of UINT64_MAX. Integers and floats are little-endian.
+ */
+class ResultReader {
+public:
+    static constexpr char MAGIC[9]{"MANTISRB"};
+    static constexpr uint32_t VERSION{3};
+    static constexpr uint32_t SAMPLES_ONLY{1};
+    static constexpr uint32_t BOUNDS{2};
+    static constexpr uint64_t END_OF_RESULTS{UINT64_MAX};
+
+    /** @return false if file can't be opened or isn't a binary result file */
+    bool open(const std::string &file);
+
+    /**
+     * reads the next record
+     * @return false at the end of the results; check truncated() then
+     */
+    bool next(ResultRecord &record);
+
+    /** whether the file ended before its end marker */
+    bool truncated() const { return !complete; }
+
+    bool samplesOnly() const { return onlySamples; }
+
+    bool hasBounds() const { return bounds; }
+
+    const std::vector<std::string> &sampleNames() const { return names; }
+
+    const std::string &queryPrefix() const { return prefix; }
+
+private:
+    bool readString(std::string &s);
+
+    std::ifstream in;
+    bool onlySamples{false};
+    bool bounds{false};
+    bool complete{false};
+    std::vector<std::string> names;
+    std::string prefix;
+};
+
+#endif //MANTIS_RESULTWRITER_H
@@ -0,0 +1,124 @@
+//
+// Per-sample hit counting over color bitsets, shared by the RRR and MST queries.
+//
+
+#ifndef MANTIS_SAMPLECOUNTER_H
+#define MANTIS_SAMPLECOUNTER_H
+
+#include <cstdint>
+#include <vector>
+
+/**
+ * Accumulates (color bitset, multiplicity) pairs into one counter per sample.
+ *
+ * Counters are kept bit-sliced: for every word of samples there are NUM_PLANES
+ * words holding bit p of the 64 counters of that word, so adding a color is a
+ * ripple-carry over a few words per set word of the color instead of one
+ * increment per sample. The slices are flushed into the 64-bit totals before
+ * they can overflow, and whenever the totals are read.
+ */
+class SampleCounter {
+public:
+    static constexpr uint32_t NUM_PLANES{8};
+    static constexpr uint64_t MAX_PENDING{(1ULL << NUM_PLANES) - 1};
+
+    explicit SampleCounter(uint64_t numSamplesIn);
+
+    /** adds multiplicity to the counter of every sample set in bits (numSamples bits) */
+    void add(const uint64_t *bits, uint64_t multiplicity);
+
+    /** the count of each sample, valid until the next call to add */
+    std::vector<uint64_t> &counts();
+
+    void reset();
+
+    /** only counts the samples in words [begin, end) of the bitsets, e.g. the words of a SampleMask */
+    void restrictTo(uint64_t begin, uint64_t end) {
+        wordBegin = begin;
+        wordEnd = end;
+    }
+
+private:
+    void flush();
+
+    uint64_t numSamples;
+    uint64_t numWrds;
+    uint64_t wordBegin{0};
+    uint64_t wordEnd;
+    std::vector<uint64_t> planes; // NUM_PLANES words per word of samples
+    uint64_t pending{0};          // upper bound on any bit-sliced counter
+    std::vector<uint64_t> totals;
+};
+
+/**
+ * Finds the samples containing at least a fraction theta of the k-mers of a query.
+ *
+ * Colors are added with the number of query k-mers they cover, best in decreasing order
+ * of that number. A sample is accepted as soon as its count reaches the threshold, and
+ * pruned as soon as the k-mers not added yet can't bring it there anymore.
+ * Once every sample is decided, the remaining colors can't change the answer
+ * and don't need to be decoded at all.
+ */
+class ThresholdFilter {
+public:
+    /**
+     * @param numKmers number of distinct k-mers in the query
+     * @param foundKmers number of those found in the index, i.e. the sum of all the multiplicities to come
+     * @param candidates if set, the bitset of the only samples that can be accepted
+     */
+    ThresholdFilter(uint64_t numSamplesIn, uint64_t numKmers, double theta, uint64_t foundKmers,
+                    const uint64_t *candidates = nullptr);
+
+    /** adds multiplicity to the samples in bits that are still undecided */
+    void add(const uint64_t *bits, uint64_t multiplicity);
+
+    bool done() const { return numUndecided == 0; }
+
+    /** bitset of the samples whose answer still depends on the colors to come */
+    const uint64_t *undecided() const { return undecidedBits.data(); }
+
+    /** the ids of the accepted samples in increasing order */
+    std::vector<uint64_t> accepted() const;
+
+    uint64_t threshold() const { return minCount; }
+
+    /**
+     * the smallest count reaching a fraction theta of numKmers, at least 1. The product is
+     * rounded down by a relative 1e-12 before its ceiling is taken, so that a product such as
+     * 0.7 * 10 = 7.000000000000001 gives 7 and not 8.
+     */
+    static constexpr uint64_t minCountFor(double theta, uint64_t numKmers) {
+        double x = theta * static_cast<double>(numKmers);
+        x -= x * 1e-12;
+        if (x <= 1) return 1;
+        auto c = static_cast<uint64_t>(x);
+        return static_cast<double>(c) < x ? c + 1 : c;
+    }
+
+private:
+    void prune();
+
+    uint64_t numSamples;
+    uint64_t minCount;
+    uint64_t remaining;
+    uint64_t numUndecided;
+    std::vector<uint64_t> counts;
+    std::vector<uint64_t> undecidedBits;
+    std::vector<uint64_t> acceptedBits;
+};
+
+/**
+ * A 95% confidence interval [low, high] of the fraction of the k-mers of a query that a sample
+ * contains, when it contains hits of sampled k-mers drawn out of total: the Wilson score interval,
+ * narrowed by the finite population correction, so it closes on hits / sampled when every k-mer
+ * was sampled.
+ */
+void containmentBounds(uint64_t hits, uint64_t sampled, uint64_t total, double &low, double &high);
+
+struct SampleBounds;
+
+/** the containment bounds of every sample, counts[s] being the hits of sample s */
+void containmentBounds(const std::vector<uint64_t> &counts, uint64_t sampled, uint64_t total,
+                       SampleBounds &bounds);
+
+#endif //MANTIS_SAMPLECOUNTER_H
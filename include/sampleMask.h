@@ -0,0 +1,65 @@
+//
+// Restricts queries to a subset of the samples of an index.
+//
+
+#ifndef MANTIS_SAMPLEMASK_H
+#define MANTIS_SAMPLEMASK_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+#include "colorBitset.h"
+
+/**
+ * The samples a query is restricted to, as a bitset over all the samples of the index.
+ * It also keeps the range of words and of sample ids the subset spans, so that colors
+ * only need to be extracted, decoded and counted inside of it.
+ */
+class SampleMask {
+public:
+    /**
+     * reads the sample names in file, one per line. A name is either the name of a sample in
+     * the index (as written in query outputs) or the file name part of it.
+     * Exits if a name doesn't match exactly one sample.
+     */
+    static SampleMask load(const std::string &file, const std::vector<std::string> &sampleNames,
+                           spdlog::logger *logger);
+
+    explicit SampleMask(uint64_t numSamples) : bits(numSamples) {}
+
+    void add(uint64_t sampleId);
+
+    /** keeps only the samples of the mask in row (one bit per sample of the index) */
+    void apply(uint64_t *row) const;
+
+    /** whether row has a sample of the mask, assuming apply was called on it */
+    bool intersects(const uint64_t *row) const;
+
+    bool contains(uint64_t sampleId) const { return bits.test(sampleId); }
+
+    bool wordUsed(uint64_t w) const { return bits.data()[w] != 0; }
+
+    const uint64_t *data() const { return bits.data(); }
+
+    uint64_t count() const { return bits.count(); }
+
+    uint64_t firstWord() const { return minSample >> 6; }
+
+    uint64_t endWord() const { return empty() ? 0 : (maxSample >> 6) + 1; }
+
+    /** the smallest and largest sample ids in the mask */
+    uint64_t first() const { return minSample; }
+
+    uint64_t last() const { return maxSample; }
+
+    bool empty() const { return minSample > maxSample; }
+
+private:
+    ColorBitset bits;
+    uint64_t minSample{UINT64_MAX};
+    uint64_t maxSample{0};
+};
+
+#endif //MANTIS_SAMPLEMASK_H
@@ -0,0 +1,117 @@
+//
+// Streaming reader of query sequences: FASTA, FASTQ or bare sequences, plain or gzipped.
+//
+
+#ifndef MANTIS_SEQUENCEREADER_H
+#define MANTIS_SEQUENCEREADER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+/** a query sequence; name is empty for bare sequences */
+struct SequenceRecord {
+    std::string name;
+    std::string seq;
+};
+
+/**
+ * Reads the records of a sequence file through large block reads. zlib reads plain files
+ * as they are, so gzipped and plain inputs go through the same path.
+ * The format is taken from the first character of the file: '>' is FASTA (sequences may
+ * span several lines), '@' is FASTQ, and anything else is bare sequences separated by
+ * whitespace, which is what mantis query has always read.
+ * The name of a FASTA or FASTQ record is its header up to the first whitespace.
+ */
+class SequenceReader {
+public:
+    static constexpr uint64_t BLOCK_SIZE{1ULL << 22};
+
+    ~SequenceReader();
+
+    /** @return false if the file can't be opened */
+    bool open(const std::string &file);
+
+    /**
+     * reads the next record
+     * @return false at the end of the file or on an error; check error() then
+     */
+    bool next(SequenceRecord &record);
+
+    /** what went wrong, empty if the file was read to the end */
+    const std::string &error() const { return err; }
+
+private:
+    enum class Format {
+        unknown, fasta, fastq, bare
+    };
+
+    /** the next line without its end of line, false at the end of the file */
+    bool readLine(std::string &line);
+
+    /** the first non-empty line (or token for bare sequences), without consuming it */
+    bool peekLine(std::string &line);
+
+    bool fill();
+
+    bool nextFasta(SequenceRecord &record);
+
+    bool nextFastq(SequenceRecord &record);
+
+    bool nextBare(SequenceRecord &record);
+
+    gzFile in{nullptr};
+    std::string fileName;
+    std::vector<char> block;
+    uint64_t pos{0}, end{0};
+    bool eof{false};
+    Format format{Format::unknown};
+    std::string pending;
+    bool hasPending{false};
+    std::vector<std::string> tokens; // bare sequences of the current line, last first
+    std::string err;
+};
+
+/**
+ * Reads batches of records of a file on a background thread, one or two batches ahead
+ * of the caller, so that decompressing and parsing the input overlaps with querying.
+ */
+class SequenceBatchReader {
+public:
+    static constexpr uint64_t BATCH_RECORDS{4096};
+    static constexpr uint64_t BATCH_BASES{1ULL << 24};
+    static constexpr uint64_t MAX_READY{2};
+
+    ~SequenceBatchReader();
+
+    /** opens file and starts reading it, false if it can't be opened */
+    bool open(const std::string &file);
+
+    /**
+     * replaces batch with the next batch of records
+     * @return false once every record was returned or on an error; check error() then
+     */
+    bool next(std::vector<SequenceRecord> &batch);
+
+    const std::string &error() const { return err; }
+
+private:
+    void produce();
+
+    SequenceReader reader;
+    std::thread producer;
+    std::mutex mtx;
+    std::condition_variable readyCv, spaceCv;
+    std::deque<std::vector<SequenceRecord>> ready;
+    bool done{false};
+    bool stopping{false};
+    std::string err;
+};
+
+#endif //MANTIS_SEQUENCEREADER_H
@@ -10,7 +10,6 @@
 #include <queue>
 
 #include "gqf_cpp.h"
-#include "lru/lru.hpp"
 #include "canonicalKmer.h"
 #include "mstQuery.h"
 #include "gqf/hashutil.h"
@@ -53,10 +52,10 @@ public:
     }
     Stat(CQF<KeyObject>& cqfIn, MSTQuery* mstQueryIn, uint64_t num_samples,
          spdlog::logger *logger): cqf(cqfIn), mstQuery(mstQueryIn), it(cqf.begin()) {
-        cache_lru = new LRUCacheMap(100000);
+        cache = new ColorCache(num_samples, mantis::DEFAULT_COLOR_CACHE_MB << 20);
         k = cqf.keybits()/2;
         oneCnt.resize((num_samples*(num_samples+1))/2);
-        std::cout << "Total Eqs: " << mstQuery->parentbv.size() << "\n";
+        std::cout << "Total Eqs: " << mstQuery->numColorClasses() + 1 << "\n";
         sdsl::util::assign(visited, sdsl::bit_vector(cqf.numslots(),0));
     }
     std::vector<uint64_t> oneCnt;
@@ -79,7 +78,7 @@ private:
     CQF<KeyObject>::Iterator it;
     uint64_t num_samples;
     uint64_t kmerCntr = 0;
-    LRUCacheMap* cache_lru;
+    ColorCache* cache;
     nonstd::optional<uint64_t> toDecode{nonstd::nullopt};
     QueryStats queryStats;
     std::set<workItem> neighbors(workItem n);
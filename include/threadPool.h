@@ -0,0 +1,137 @@
+//
+// A pool of threads that outlives the tasks it runs, for phases made of many uneven tasks.
+//
+
+#ifndef MANTIS_THREADPOOL_H
+#define MANTIS_THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mantis {
+    /**
+     * Runs tasks on a fixed set of threads. Each thread has its own queue: tasks are handed out
+     * to the queues in turn, a thread takes its newest task first, and a thread whose queue is
+     * empty steals the oldest task of another one, so a few long tasks don't hold up the rest.
+     * A task is given the id of the thread running it, in [0, size()), to index per-thread state.
+     */
+    class ThreadPool {
+    public:
+        typedef std::function<void(uint32_t)> Task;
+
+        explicit ThreadPool(uint32_t numThreads) : queues(std::max<uint32_t>(numThreads, 1)) {
+            for (auto &q : queues) {
+                q.reset(new Queue);
+            }
+            for (uint32_t t = 0; t < queues.size(); t++) {
+                threads.emplace_back(&ThreadPool::work, this, t);
+            }
+        }
+
+        /** waits for the tasks left, then stops the threads */
+        ~ThreadPool() {
+            wait();
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            taskReady.notify_all();
+            for (auto &t : threads) {
+                t.join();
+            }
+        }
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        uint32_t size() const { return static_cast<uint32_t>(queues.size()); }
+
+        /** thread-safe, also from a task */
+        void submit(Task task) {
+            auto &q = *queues[nextQueue++ % queues.size()];
+            {
+                std::lock_guard<std::mutex> lock(q.mtx);
+                q.tasks.push_back(std::move(task));
+            }
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                queued++;
+                pending++;
+            }
+            taskReady.notify_one();
+        }
+
+        /** blocks until at most maxPending submitted tasks are not done */
+        void waitBelow(uint64_t maxPending) {
+            std::unique_lock<std::mutex> lock(mtx);
+            taskDone.wait(lock, [&] { return pending <= maxPending; });
+        }
+
+        /** blocks until every submitted task is done */
+        void wait() { waitBelow(0); }
+
+    private:
+        struct Queue {
+            std::mutex mtx;
+            std::deque<Task> tasks;
+        };
+
+        /** takes the newest task of thread t or else steals the oldest of another thread */
+        bool take(uint32_t t, Task &task) {
+            for (uint32_t i = 0; i < queues.size(); i++) {
+                auto &q = *queues[(t + i) % queues.size()];
+                std::lock_guard<std::mutex> lock(q.mtx);
+                if (q.tasks.empty()) continue;
+                if (i == 0) {
+                    task = std::move(q.tasks.back());
+                    q.tasks.pop_back();
+                } else {
+                    task = std::move(q.tasks.front());
+                    q.tasks.pop_front();
+                }
+                return true;
+            }
+            return false;
+        }
+
+        void work(uint32_t t) {
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    taskReady.wait(lock, [&] { return queued > 0 or stopping; });
+                    if (!queued) return;
+                    // a task counted in queued is in a queue, and only the threads that
+                    // counted it off take it, so the loop below finds one
+                    queued--;
+                }
+                Task task;
+                while (!take(t, task)) {}
+                task(t);
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    pending--;
+                }
+                taskDone.notify_all();
+            }
+        }
+
+        std::vector<std::unique_ptr<Queue>> queues;
+        std::vector<std::thread> threads;
+        std::atomic<uint64_t> nextQueue{0};
+        std::mutex mtx;
+        std::condition_variable taskReady, taskDone;
+        uint64_t queued{0}; // in a queue and not taken yet
+        uint64_t pending{0}; // submitted and not done
+        bool stopping{false};
+    };
+}
+
+#endif //MANTIS_THREADPOOL_H
@@ -0,0 +1,189 @@
+//
+// Compacted unitigs of the colored dBG, stored next to the index, so a query can follow
+// a read along a unitig instead of looking every k-mer up in the CQF.
+//
+
+#ifndef MANTIS_UNITIGTABLE_H
+#define MANTIS_UNITIGTABLE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+
+#include "spdlog/spdlog.h"
+#include "gqf_cpp.h"
+#include "kmerExtractor.h"
+
+/**
+ * The maximal non-branching paths (unitigs) of the dBG of an index, with the color class
+ * of every k-mer stored as runs along each unitig, and a table from every k-mer to its
+ * unitig and offset.
+ *
+ * The file starts with a Header, followed by
+ *   uint64 unitigStart[numUnitigs + 1]: the position of the first base of every unitig,
+ *   uint64 runStart[numUnitigs + 1]: the first Run of every unitig,
+ *   Run runs[numRuns]: color classes of consecutive k-mers of a unitig,
+ *   uint64 buckets[2^bucketBits + 1]: the first Entry of every bucket,
+ *   Entry entries[numKmers]: sorted by bucket, then k-mer,
+ *   uint64 bases[(numBases + 31) / 32]: the unitigs one after the other, 2 bits per base.
+ * It is mapped into memory as is.
+ *
+ * A read is matched by looking its first k-mer up in the table and then, while the next
+ * base of the read is the next base of the unitig, moving along the unitig, which is a
+ * sequential comparison instead of a random CQF probe. The table covers every k-mer of
+ * the CQF it was built from, so a k-mer missing from it isn't in the index.
+ */
+class UnitigTable {
+public:
+    static constexpr uint64_t MAGIC{0x4d414e5449535554ULL}; // "MANTISUT"
+    static constexpr uint32_t VERSION{2};
+    static constexpr uint64_t NOT_FOUND{std::numeric_limits<uint64_t>::max()};
+
+    struct Header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t k;
+        uint64_t numKmers;
+        uint64_t numUnitigs;
+        uint64_t numRuns;
+        uint64_t numBases;
+        uint64_t bucketBits;
+        uint64_t cqfFingerprint; // see fingerprint()
+    };
+
+    /** k-mers [previous run's end, end) of a unitig, by offset in the unitig, are in class eqid */
+    struct Run {
+        uint64_t eqid;
+        uint64_t end;
+    };
+
+    struct Entry {
+        uint64_t kmer; // canonical
+        uint64_t pos; // of the first base of the k-mer
+        uint64_t unitig; // the top bit is set if the k-mer is canonical as it reads on the unitig
+    };
+
+    UnitigTable() = default;
+    UnitigTable(const UnitigTable &) = delete;
+    UnitigTable &operator=(const UnitigTable &) = delete;
+    ~UnitigTable();
+
+    /**
+     * maps file into memory
+     * @return false if the file is missing or wasn't built from cqf
+     */
+    bool load(const std::string &file, const CQF<KeyObject> &cqf, spdlog::logger *logger);
+
+    /** writes the unitigs of the dBG in cqf to file */
+    static bool build(CQF<KeyObject> &cqf, const std::string &file, spdlog::logger *logger);
+
+    /**
+     * a hash of the size and counters of cqf and of words sampled across its slots, which
+     * hold the color classes, so a table built from another CQF with as many k-mers is refused
+     */
+    static uint64_t fingerprint(const CQF<KeyObject> &cqf);
+
+    uint32_t kmerSize() const { return k; }
+
+    uint64_t numUnitigs() const { return header ? header->numUnitigs : 0; }
+
+    /**
+     * calls f(kmer, eqid) for the canonical k-mers of seq, in order, with eqid the color
+     * class of the k-mer (counting from 0) or NOT_FOUND if it isn't in the index
+     * @return the number of k-mers looked up in the table, the others were found by
+     * following a unitig
+     */
+    template <typename F>
+    uint64_t forEach(const std::string &seq, F f) const {
+        Cursor cur;
+        uint64_t lookups{0};
+        uint64_t run{0}; // number of bases since the last break
+        mantis::RollingKmer kmer(k);
+        mantis::forEachBase(seq.data(), seq.size(), [&](uint8_t code) {
+            kmer.push(code);
+            if (++run < k) return;
+            if (!cur.valid or !step(cur, code)) {
+                lookups++;
+                seed(kmer.forward(), kmer.canonical(), cur);
+            }
+            f(kmer.canonical(), cur.valid ? runs[cur.run].eqid : NOT_FOUND);
+        }, [&]() {
+            run = 0;
+            cur.valid = false;
+        });
+        return lookups;
+    }
+
+private:
+    static constexpr uint64_t CANONICAL_FLAG{1ULL << 63};
+
+    /** where the last k-mer of a read is on its unitig */
+    struct Cursor {
+        bool valid{false};
+        bool forward{true}; // whether the read goes the way of the unitig
+        uint64_t unitig{0};
+        uint64_t pos{0};
+        uint64_t run{0};
+    };
+
+    static uint64_t bucketOf(uint64_t kmer, uint64_t bucketBits) {
+        return bucketBits ? mantis::mixKmer(kmer) >> (64 - bucketBits) : 0;
+    }
+
+    uint8_t base(uint64_t pos) const { return (bases[pos >> 5] >> ((pos & 31) << 1)) & 3; }
+
+    /** points cur to the k-mer fwd (canonical form kmer), or invalidates it if it isn't in the table */
+    void seed(uint64_t fwd, uint64_t kmer, Cursor &cur) const {
+        cur.valid = false;
+        uint64_t b = bucketOf(kmer, header->bucketBits);
+        const Entry *end = entries + buckets[b + 1];
+        for (const Entry *e = entries + buckets[b]; e != end and e->kmer <= kmer; e++) {
+            if (e->kmer != kmer) continue;
+            cur.valid = true;
+            cur.unitig = e->unitig & ~CANONICAL_FLAG;
+            cur.pos = e->pos;
+            cur.forward = ((e->unitig & CANONICAL_FLAG) != 0) == (fwd == kmer);
+            uint64_t offset = cur.pos - unitigStart[cur.unitig];
+            const Run *first = runs + runStart[cur.unitig], *last = runs + runStart[cur.unitig + 1];
+            cur.run = std::upper_bound(first, last, offset,
+                                       [](uint64_t o, const Run &r) { return o < r.end; }) - runs;
+            return;
+        }
+    }
+
+    /** moves cur to the next k-mer of the read, which ends with code, if it is next on the unitig */
+    bool step(Cursor &cur, uint8_t code) const {
+        if (cur.forward) {
+            if (cur.pos + k >= unitigStart[cur.unitig + 1] or base(cur.pos + k) != code) {
+                return cur.valid = false;
+            }
+            cur.pos++;
+            if (cur.pos - unitigStart[cur.unitig] >= runs[cur.run].end) cur.run++;
+        } else {
+            // the read goes against the unitig, so its next base is the complement of the previous one
+            if (cur.pos == unitigStart[cur.unitig] or base(cur.pos - 1) != 3 - code) {
+                return cur.valid = false;
+            }
+            cur.pos--;
+            if (cur.run > runStart[cur.unitig] and
+                cur.pos - unitigStart[cur.unitig] < runs[cur.run - 1].end) {
+                cur.run--;
+            }
+        }
+        return true;
+    }
+
+    void *mapped{nullptr};
+    size_t mappedSize{0};
+    uint32_t k{0};
+    const Header *header{nullptr};
+    const uint64_t *unitigStart{nullptr};
+    const uint64_t *runStart{nullptr};
+    const Run *runs{nullptr};
+    const uint64_t *buckets{nullptr};
+    const Entry *entries{nullptr};
+    const uint64_t *bases{nullptr};
+};
+
+#endif //MANTIS_UNITIGTABLE_H
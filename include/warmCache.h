@@ -0,0 +1,94 @@
+//
+// Read-only table of pre-decoded color classes stored next to the MST index.
+//
+
+#ifndef MANTIS_WARMCACHE_H
+#define MANTIS_WARMCACHE_H
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+#include "colorCache.h"
+
+/**
+ * The file starts with a Header, followed by numColors Records sorted by color id
+ * and the encoded colors (see ColorCache::encode) as 64-bit words.
+ * It is mapped into memory as is, so a query can answer the colors in it
+ * without any MST decoding from the first read on.
+ */
+class WarmColorCache {
+public:
+    static constexpr uint64_t MAGIC{0x4d414e5449535743ULL}; // "MANTISWC"
+    static constexpr uint32_t VERSION{2};
+
+    struct Header {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t numSamples;
+        uint64_t numColors;
+        uint64_t cqfFingerprint; // of the index, see UnitigTable::fingerprint
+    };
+
+    struct Record {
+        uint64_t eqid;
+        uint64_t offset; // in words, from the start of the payload
+        uint32_t card;
+        uint32_t enc;
+    };
+
+    WarmColorCache() = default;
+    WarmColorCache(const WarmColorCache &) = delete;
+    WarmColorCache &operator=(const WarmColorCache &) = delete;
+    ~WarmColorCache();
+
+    /**
+     * maps file into memory
+     * @param cqfFingerprint the fingerprint of the CQF of the index (see UnitigTable::fingerprint)
+     * @return false if the file is missing, truncated or was written for another index
+     */
+    bool load(const std::string &file, uint64_t numSamplesIn, uint64_t cqfFingerprint,
+              spdlog::logger *logger);
+
+    bool get(uint64_t eqid, std::vector<uint64_t> &setbits) const;
+
+    /** XORs the color of eqid into the bitset dst, see ColorCache::xorInto */
+    bool xorInto(uint64_t eqid, uint64_t *dst) const;
+
+    bool contains(uint64_t eqid) const { return find(eqid) != nullptr; }
+
+    uint64_t size() const { return numColors; }
+
+    /** calls f(eqid, setbits) for every color in the table */
+    template <typename F>
+    void forEach(F f) const {
+        std::vector<uint64_t> setbits;
+        for (uint64_t i = 0; i < numColors; i++) {
+            if (get(records[i].eqid, setbits)) f(records[i].eqid, setbits);
+        }
+    }
+
+    /** writes colors (pairs of color id and sorted sample ids) to file in the format above */
+    static bool write(const std::string &file, uint64_t numSamples, uint64_t cqfFingerprint,
+                      std::vector<std::pair<uint64_t, std::vector<uint64_t>>> &colors);
+
+private:
+    const Record *find(uint64_t eqid) const;
+
+    /** the encoded color of r and its length in words, nullptr if it isn't within the file */
+    const uint64_t *colorOf(const Record &r, uint32_t &len) const;
+
+    void *mapped{nullptr};
+    size_t mappedSize{0};
+    uint64_t numSamples{0};
+    uint64_t numWrds{0};
+    uint64_t numColors{0};
+    const Record *records{nullptr};
+    const uint64_t *payload{nullptr};
+    uint64_t payloadWords{0};
+};
+
+#endif //MANTIS_WARMCACHE_H
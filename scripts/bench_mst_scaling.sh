@@ -0,0 +1,76 @@
+#!/bin/bash
+
+# Times `mantis mst` on a copy of an index for each number of threads and checks that
+# every run finds an MST of the same weight. For example, from the root of <mantis_dir>:
+# bash scripts/bench_mst_scaling.sh build/src/mantis <mantis index> 1 2 4 8 16
+#
+# With -c, every thread takes part in every weight of the color graph (--bucket-edges 1),
+# so that the parallel MST runs even on a small index, and each MST is checked against the
+# color classes with mantis validatemst.
+
+CHECK=0
+if [ "$1" == "-c" ]
+then
+    CHECK=1
+    shift
+fi
+
+if [ $# -lt 2 ]
+then
+    echo "USAGE:"
+    echo " $0 [-c] <mantis binary> <index_dir> [<num_threads> ...]"
+    exit 1
+fi
+
+MANTIS=$1
+INDEX=$2
+shift 2
+THREADS=${@:-1 2 4 8}
+MST_FLAGS=""
+if [ $CHECK -eq 1 ]; then
+    MST_FLAGS="--bucket-edges 1"
+    NUM_SAMPLES=`wc -l < $INDEX/sampleid.lst`
+fi
+
+WORKDIR=`mktemp -d -t mst_bench.XXXXXX`
+if [ $? -ne 0 ]; then
+    echo "Failed to create a working directory"
+    exit 1
+fi
+trap "rm -rf $WORKDIR" EXIT
+
+printf "%8s %12s %12s %14s\n" threads total_s msf_s weight_sum
+WEIGHT=""
+for T in $THREADS; do
+    # mst writes its files into the index, so each run gets a fresh copy of the RRR index
+    rm -rf $WORKDIR/idx
+    mkdir $WORKDIR/idx
+    cp $INDEX/dbg_cqf.ser $INDEX/sampleid.lst $INDEX/*eqclass_rrr.cls $WORKDIR/idx/ || exit 1
+
+    START=`date +%s.%N`
+    $MANTIS mst -p $WORKDIR/idx/ -t $T $MST_FLAGS -k > $WORKDIR/mst.log 2>&1
+    if [ $? -ne 0 ]; then
+        echo "mantis mst failed with $T threads, see the log below"
+        cat $WORKDIR/mst.log
+        exit 1
+    fi
+    END=`date +%s.%N`
+
+    MSF=`grep -o "MST Construction finished in [0-9.]*" $WORKDIR/mst.log | awk '{print $5}'`
+    SUM=`grep -o "mst weight sum: [0-9]*" $WORKDIR/mst.log | awk '{print $4}'`
+    printf "%8s %12.3f %12s %14s\n" $T `awk "BEGIN {print $END - $START}"` $MSF $SUM
+    if [ -n "$WEIGHT" ] && [ "$WEIGHT" != "$SUM" ]; then
+        echo "The MST weight changed from $WEIGHT to $SUM with $T threads"
+        exit 1
+    fi
+    WEIGHT=$SUM
+
+    if [ $CHECK -eq 1 ]; then
+        $MANTIS validatemst -p $WORKDIR/idx/ -n $NUM_SAMPLES -t $T > $WORKDIR/validate.log 2>&1
+        if [ $? -ne 0 ]; then
+            echo "The MST built with $T threads doesn't decode the color classes, see the log below"
+            cat $WORKDIR/validate.log
+            exit 1
+        fi
+    fi
+done
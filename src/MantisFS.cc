@@ -26,6 +26,14 @@ namespace mantis {
 			return true;
 		}
 
+		uint64_t FileSize(const char* path) {
+			struct stat fileStat;
+			if (stat(path, &fileStat) or !S_ISREG(fileStat.st_mode)) {
+				return 0;
+			}
+			return fileStat.st_size;
+		}
+
 		// Taken from
 		// http://stackoverflow.com/questions/12774207/fastest-way-to-check-if-a-file-exist-using-standard-c-c11-c
 		bool DirExists(const char* path) {
@@ -5,6 +5,7 @@
 #include <assert.h>
 
 #include "canonicalKmer.h"
+#include "kmerExtractor.h"
 
 #define BITMASK(nbits) ((nbits) == 64 ? 0xffffffffffffffff : (1ULL << (nbits)) - 1ULL)
 
@@ -68,25 +69,7 @@ namespace dna {
 
     // Return the reverse complement of k
     kmer operator-(kmer k) {
-        uint64_t val = k.val;
-        val =
-                (val >> 32) |
-                (val << 32);
-        val =
-                ((val >> 16) & 0x0000ffff0000ffff) |
-                ((val << 16) & 0xffff0000ffff0000);
-        val =
-                ((val >> 8) & 0x00ff00ff00ff00ff) |
-                ((val << 8) & 0xff00ff00ff00ff00);
-        val =
-                ((val >> 4) & 0x0f0f0f0f0f0f0f0f) |
-                ((val << 4) & 0xf0f0f0f0f0f0f0f0);
-        val =
-                ((val >> 2) & 0x3333333333333333) |
-                ((val << 2) & 0xcccccccccccccccc);
-        val = ~val;
-        val >>= 64 - 2 * k.len;
-        return kmer(k.len, val);
+        return kmer(k.len, mantis::reverseComplement(k.val, k.len));
     }
 
     // backwards from standard definition to match kmer.h definition
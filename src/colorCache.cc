@@ -0,0 +1,321 @@
+//
+// Concurrent cache of decoded color classes shared by the query workers.
+//
+
+#include <algorithm>
+#include <cmath>
+
+#include "colorCache.h"
+
+namespace {
+    // splitmix64 finalizer, spreads consecutive color ids over shards and sketch rows
+    inline uint64_t mix64(uint64_t x) {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    inline uint32_t roundUpPow2(uint64_t x) {
+        uint32_t p = 1;
+        while (p < x) p <<= 1;
+        return p;
+    }
+}
+
+void ColorCache::FrequencySketch::init(uint64_t expectedEntries) {
+    // 16 4-bit counters per word, 4 counters (one per row) touched per color
+    uint64_t words = roundUpPow2(std::max<uint64_t>(64, expectedEntries / 4));
+    table.assign(words, 0);
+    mask = words - 1;
+    additions = 0;
+    resetAt = 10 * std::max<uint64_t>(64, expectedEntries);
+}
+
+void ColorCache::FrequencySketch::record(uint64_t h) {
+    for (uint32_t row = 0; row < 4; row++) {
+        uint64_t rh = mix64(h + row);
+        auto &wrd = table[rh & mask];
+        uint32_t shift = ((rh >> 32) & 0x0F) << 2;
+        if (((wrd >> shift) & 0x0F) != 0x0F) {
+            wrd += (1ULL << shift);
+        }
+    }
+    if (++additions == resetAt) {
+        // age the counters so that the sketch follows the recent access pattern
+        for (auto &wrd : table) {
+            wrd = (wrd >> 1) & 0x7777777777777777ULL;
+        }
+        additions /= 2;
+    }
+}
+
+uint32_t ColorCache::FrequencySketch::frequency(uint64_t h) const {
+    uint32_t freq = 0x0F;
+    for (uint32_t row = 0; row < 4; row++) {
+        uint64_t rh = mix64(h + row);
+        uint32_t shift = ((rh >> 32) & 0x0F) << 2;
+        freq = std::min(freq, static_cast<uint32_t>((table[rh & mask] >> shift) & 0x0F));
+    }
+    return freq;
+}
+
+ColorCache::ColorCache(uint64_t numSamplesIn, uint64_t budgetBytesIn, uint32_t numShardsIn) :
+        numSamples(numSamplesIn),
+        numWrds((numSamplesIn + 63) / 64),
+        budgetBytes(budgetBytesIn),
+        numShards(roundUpPow2(std::max<uint32_t>(1, numShardsIn))),
+        shards(roundUpPow2(std::max<uint32_t>(1, numShardsIn))) {
+    shardBudget = budgetBytes / numShards;
+    // a dense color is the worst case, use it to size the sketch
+    uint64_t expectedEntries = shardBudget / entryBytes(static_cast<uint32_t>(std::max<uint64_t>(1, numWrds)));
+    for (auto &shard : shards) {
+        shard.sketch.init(expectedEntries);
+    }
+}
+
+bool ColorCache::contains(uint64_t eqid) {
+    auto h = mix64(eqid);
+    auto &shard = shardOf(h);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    return shard.slotOf.find(eqid) != shard.slotOf.end();
+}
+
+bool ColorCache::get(uint64_t eqid, std::vector<uint64_t> &setbits) {
+    auto h = mix64(eqid);
+    auto &shard = shardOf(h);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    shard.sketch.record(h);
+    auto it = shard.slotOf.find(eqid);
+    if (it == shard.slotOf.end()) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    auto &e = shard.slots[it->second];
+    e.referenced = true;
+    decode(shard.arena.data() + e.offset, e.len, e.card, e.enc, setbits);
+    hits.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool ColorCache::xorInto(uint64_t eqid, uint64_t *dst) {
+    auto h = mix64(eqid);
+    auto &shard = shardOf(h);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    shard.sketch.record(h);
+    auto it = shard.slotOf.find(eqid);
+    if (it == shard.slotOf.end()) {
+        misses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    auto &e = shard.slots[it->second];
+    e.referenced = true;
+    xorDecoded(shard.arena.data() + e.offset, e.len, e.card, e.enc, dst);
+    hits.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool ColorCache::xorAncestorInto(uint64_t eqid, uint64_t *dst) {
+    ancestorProbes.fetch_add(1, std::memory_order_relaxed);
+    auto &shard = shardOf(mix64(eqid));
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    auto it = shard.slotOf.find(eqid);
+    if (it == shard.slotOf.end()) {
+        return false;
+    }
+    auto &e = shard.slots[it->second];
+    e.referenced = true;
+    xorDecoded(shard.arena.data() + e.offset, e.len, e.card, e.enc, dst);
+    ancestorHits.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+void ColorCache::put(uint64_t eqid, const std::vector<uint64_t> &setbits) {
+    auto h = mix64(eqid);
+    auto &shard = shardOf(h);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    Encoding enc;
+    uint64_t *dst = admit(shard, h, eqid, static_cast<uint32_t>(setbits.size()), enc);
+    if (dst) {
+        encode(setbits, enc, dst);
+    }
+}
+
+void ColorCache::putBitset(uint64_t eqid, const uint64_t *row) {
+    uint32_t card{0};
+    for (uint64_t w = 0; w < numWrds; w++) {
+        card += __builtin_popcountll(row[w]);
+    }
+    auto h = mix64(eqid);
+    auto &shard = shardOf(h);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    Encoding enc;
+    uint64_t *dst = admit(shard, h, eqid, card, enc);
+    if (!dst) return;
+    if (enc == BITSET) {
+        std::copy(row, row + numWrds, dst);
+        return;
+    }
+    uint64_t i{0};
+    for (uint64_t w = 0; w < numWrds; w++) {
+        for (uint64_t wrd = row[w]; wrd; wrd &= wrd - 1, i++) {
+            dst[i >> 1] |= ((w << 6) + __builtin_ctzll(wrd)) << ((i & 1) << 5);
+        }
+    }
+}
+
+uint64_t *ColorCache::admit(Shard &shard, uint64_t h, uint64_t eqid, uint32_t card, Encoding &enc) {
+    uint32_t words = encodedWords(card, numWrds, enc);
+    uint64_t need = entryBytes(words);
+    if (need > shardBudget) {
+        rejections.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    if (shard.slotOf.find(eqid) != shard.slotOf.end()) {
+        return nullptr;
+    }
+    // make room, but only let the newcomer in if it's requested more often than the victim
+    uint32_t candFreq = shard.sketch.frequency(h);
+    while (shard.bytes + need > shardBudget) {
+        uint32_t victim = nextVictim(shard);
+        if (shard.sketch.frequency(mix64(shard.slots[victim].eqid)) >= candFreq) {
+            rejections.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        evict(shard, victim);
+    }
+    if (shard.deadWords > 1024 and shard.deadWords > shard.arena.size() / 2) {
+        compact(shard);
+    }
+
+    Entry e;
+    e.eqid = eqid;
+    e.offset = shard.arena.size();
+    e.len = words;
+    e.card = card;
+    e.enc = enc;
+    e.used = true;
+    shard.arena.resize(shard.arena.size() + words, 0);
+
+    uint32_t slot;
+    if (!shard.freeSlots.empty()) {
+        slot = shard.freeSlots.back();
+        shard.freeSlots.pop_back();
+        shard.slots[slot] = e;
+    } else {
+        slot = static_cast<uint32_t>(shard.slots.size());
+        shard.slots.push_back(e);
+    }
+    shard.slotOf[eqid] = slot;
+    shard.bytes += need;
+    insertions.fetch_add(1, std::memory_order_relaxed);
+    return shard.arena.data() + e.offset;
+}
+
+uint32_t ColorCache::encodedWords(uint64_t card, uint64_t numWrds, Encoding &enc) {
+    uint64_t listWords = (card + 1) / 2;
+    enc = listWords < numWrds ? IDLIST : BITSET;
+    return static_cast<uint32_t>(enc == IDLIST ? listWords : numWrds);
+}
+
+void ColorCache::encode(const std::vector<uint64_t> &setbits, Encoding enc, uint64_t *dst) {
+    if (enc == BITSET) {
+        for (auto s : setbits) {
+            dst[s >> 6] |= (1ULL << (s & 63));
+        }
+    } else {
+        for (uint64_t i = 0; i < setbits.size(); i++) {
+            dst[i >> 1] |= (setbits[i] << ((i & 1) << 5));
+        }
+    }
+}
+
+void ColorCache::decode(const uint64_t *src, uint32_t len, uint32_t card, Encoding enc,
+                        std::vector<uint64_t> &setbits) {
+    setbits.clear();
+    setbits.reserve(card);
+    if (enc == BITSET) {
+        for (uint32_t w = 0; w < len; w++) {
+            uint64_t wrd = src[w];
+            while (wrd) {
+                setbits.push_back((static_cast<uint64_t>(w) << 6) + __builtin_ctzll(wrd));
+                wrd &= wrd - 1;
+            }
+        }
+    } else {
+        for (uint32_t i = 0; i < card; i++) {
+            setbits.push_back((src[i >> 1] >> ((i & 1) << 5)) & 0xFFFFFFFFULL);
+        }
+    }
+}
+
+void ColorCache::xorDecoded(const uint64_t *src, uint32_t len, uint32_t card, Encoding enc,
+                            uint64_t *dst) {
+    if (enc == BITSET) {
+        for (uint32_t w = 0; w < len; w++) {
+            dst[w] ^= src[w];
+        }
+    } else {
+        for (uint32_t i = 0; i < card; i++) {
+            uint64_t s = (src[i >> 1] >> ((i & 1) << 5)) & 0xFFFFFFFFULL;
+            dst[s >> 6] ^= (1ULL << (s & 63));
+        }
+    }
+}
+
+uint32_t ColorCache::nextVictim(Shard &shard) {
+    // the caller guarantees there is at least one live entry
+    while (true) {
+        if (shard.hand >= shard.slots.size()) shard.hand = 0;
+        auto &e = shard.slots[shard.hand];
+        if (e.used) {
+            if (!e.referenced) {
+                return static_cast<uint32_t>(shard.hand);
+            }
+            e.referenced = false;
+        }
+        shard.hand++;
+    }
+}
+
+void ColorCache::evict(Shard &shard, uint32_t slot) {
+    auto &e = shard.slots[slot];
+    shard.slotOf.erase(e.eqid);
+    shard.deadWords += e.len;
+    shard.bytes -= entryBytes(e.len);
+    e.used = false;
+    shard.freeSlots.push_back(slot);
+    evictions.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ColorCache::compact(Shard &shard) {
+    std::vector<uint64_t> arena;
+    arena.reserve(shard.arena.size() - shard.deadWords);
+    for (auto &e : shard.slots) {
+        if (!e.used) continue;
+        uint64_t offset = arena.size();
+        arena.insert(arena.end(), shard.arena.begin() + e.offset, shard.arena.begin() + e.offset + e.len);
+        e.offset = offset;
+    }
+    shard.arena.swap(arena);
+    shard.deadWords = 0;
+}
+
+ColorCacheStats ColorCache::stats() const {
+    ColorCacheStats s;
+    s.hits = hits.load(std::memory_order_relaxed);
+    s.misses = misses.load(std::memory_order_relaxed);
+    s.insertions = insertions.load(std::memory_order_relaxed);
+    s.evictions = evictions.load(std::memory_order_relaxed);
+    s.rejections = rejections.load(std::memory_order_relaxed);
+    s.ancestorProbes = ancestorProbes.load(std::memory_order_relaxed);
+    s.ancestorHits = ancestorHits.load(std::memory_order_relaxed);
+    for (auto &shard : shards) {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        s.entries += shard.slotOf.size();
+        s.bytes += shard.bytes;
+    }
+    return s;
+}
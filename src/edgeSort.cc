@@ -0,0 +1,161 @@
+//
+// Out-of-memory sort of the edges of the color graph for the MST construction.
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <queue>
+
+#include "edgeSort.h"
+
+namespace mantis {
+    void radixSort(std::vector<uint64_t> &keys, std::vector<uint64_t> &tmp) {
+        constexpr uint32_t DIGITS{8};
+        std::vector<uint64_t> counts(DIGITS * 256, 0);
+        for (auto key : keys) {
+            for (uint32_t d = 0; d < DIGITS; d++) {
+                counts[d * 256 + ((key >> (8 * d)) & 0xff)]++;
+            }
+        }
+        tmp.resize(keys.size());
+        for (uint32_t d = 0; d < DIGITS; d++) {
+            uint64_t *count = &counts[d * 256];
+            // all the keys share this digit
+            if (std::find(count, count + 256, keys.size()) != count + 256) continue;
+            uint64_t offset{0};
+            for (uint32_t v = 0; v < 256; v++) {
+                uint64_t c = count[v];
+                count[v] = offset;
+                offset += c;
+            }
+            for (auto key : keys) {
+                tmp[count[(key >> (8 * d)) & 0xff]++] = key;
+            }
+            keys.swap(tmp);
+        }
+    }
+}
+
+EdgeSorter::EdgeSorter(std::string tmpDirIn, uint64_t numBuffersIn, uint64_t bufferWidthIn, uint64_t memoryBytes,
+                       uint32_t numProducers, spdlog::logger *loggerIn) :
+        tmpDir(std::move(tmpDirIn)), numBuffers(numBuffersIn), bufferWidth(bufferWidthIn), memory(memoryBytes),
+        logger(loggerIn) {
+    if (tmpDir.empty() or tmpDir.back() != '/') {
+        tmpDir.push_back('/');
+    }
+    // an edge takes 8 bytes in the buffer and 8 more as scratch space of the sort
+    bufferSize = std::max<uint64_t>(memory / (16 * std::max<uint32_t>(numProducers, 1)), 1 << 16);
+}
+
+EdgeSorter::~EdgeSorter() {
+    for (auto &run : runs) {
+        std::remove(run.file.c_str());
+    }
+}
+
+void EdgeSorter::writeRun(std::vector<uint64_t> &edges, std::vector<uint64_t> &tmp) {
+    if (edges.empty()) return;
+    mantis::radixSort(edges, tmp);
+    edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+    // a stable counting pass by bucket keeps each bucket sorted
+    uint64_t numBuckets = numBuffers * numBuffers;
+    std::vector<uint64_t> bucketCnts(numBuckets, 0);
+    for (auto edge : edges) {
+        bucketCnts[bucketOf(edge)]++;
+    }
+    Run run;
+    run.starts.resize(numBuckets + 1, 0);
+    for (uint64_t b = 0; b < numBuckets; b++) {
+        run.starts[b + 1] = run.starts[b] + bucketCnts[b];
+        bucketCnts[b] = run.starts[b];
+    }
+    tmp.resize(edges.size());
+    for (auto edge : edges) {
+        tmp[bucketCnts[bucketOf(edge)]++] = edge;
+    }
+
+    run.file = tmpDir + "mst_edges_" + std::to_string(nextRun++) + ".tmp";
+    FILE *fp = fopen(run.file.c_str(), "wb");
+    if (fp == nullptr) {
+        logger->error("Could not create the edge file {}.", run.file);
+        std::exit(1);
+    }
+    if (fwrite(tmp.data(), sizeof(uint64_t), tmp.size(), fp) != tmp.size() or fclose(fp) != 0) {
+        logger->error("Could not write the edge file {}.", run.file);
+        std::exit(1);
+    }
+    written += edges.size();
+    edges.clear();
+    std::lock_guard<std::mutex> lock(runsMtx);
+    runs.push_back(std::move(run));
+}
+
+void EdgeSorter::mergeBucket(uint64_t b, const std::function<void(const uint64_t *, uint64_t)> &f) {
+    // the part of each run that holds the bucket, read a window at a time. A file is only
+    // open while a window is read, as there can be more runs than open files allowed
+    struct Source {
+        const Run *run;
+        uint64_t next;
+        uint64_t left;
+        std::vector<uint64_t> window;
+        uint64_t pos{0};
+    };
+    std::vector<Source> sources;
+    for (auto &run : runs) {
+        uint64_t cnt = run.starts[b + 1] - run.starts[b];
+        if (cnt) {
+            sources.push_back(Source{&run, run.starts[b], cnt, {}});
+        }
+    }
+    if (sources.empty()) return;
+
+    // the budget is split between the windows of the runs and the output batch
+    uint64_t windowSize = std::max<uint64_t>(memory / (8 * (sources.size() + 1)), 1 << 12);
+    auto refill = [&](Source &s) {
+        uint64_t n = std::min(s.left, windowSize);
+        s.window.resize(n);
+        s.pos = 0;
+        if (!n) return false;
+        FILE *fp = fopen(s.run->file.c_str(), "rb");
+        if (fp == nullptr or fseeko(fp, static_cast<off_t>(s.next * sizeof(uint64_t)), SEEK_SET) != 0 or
+            fread(s.window.data(), sizeof(uint64_t), n, fp) != n) {
+            logger->error("Could not read the edge file {}.", s.run->file);
+            std::exit(1);
+        }
+        fclose(fp);
+        s.next += n;
+        s.left -= n;
+        return true;
+    };
+
+    typedef std::pair<uint64_t, uint64_t> HeapItem; // edge, source
+    std::priority_queue<HeapItem, std::vector<HeapItem>, std::greater<HeapItem>> heap;
+    for (uint64_t i = 0; i < sources.size(); i++) {
+        refill(sources[i]);
+        heap.emplace(sources[i].window[0], i);
+    }
+    std::vector<uint64_t> batch;
+    batch.reserve(windowSize);
+    bool first{true};
+    uint64_t last{0};
+    while (!heap.empty()) {
+        auto top = heap.top();
+        heap.pop();
+        // runs are deduplicated, so an edge repeats only across runs
+        if (first or top.first != last) {
+            first = false;
+            last = top.first;
+            batch.push_back(top.first);
+            if (batch.size() == windowSize) {
+                f(batch.data(), batch.size());
+                batch.clear();
+            }
+        }
+        auto &s = sources[top.second];
+        if (++s.pos < s.window.size() or refill(s)) {
+            heap.emplace(s.window[s.pos], top.second);
+        }
+    }
+    if (!batch.empty()) f(batch.data(), batch.size());
+}
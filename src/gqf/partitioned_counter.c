@@ -71,7 +71,9 @@ void pc_sync(pc_t *pc) {
 	for (uint32_t i = 0; i < pc->num_counters; i++) {
 		int64_t c = __atomic_exchange_n(&pc->local_counters[i].counter, 0,
 																		__ATOMIC_SEQ_CST);
-		__atomic_fetch_add(pc->global_counter, c, __ATOMIC_SEQ_CST);
+		/* a CQF mapped read-only has nothing to sync and its global counters can't be written */
+		if (c)
+			__atomic_fetch_add(pc->global_counter, c, __ATOMIC_SEQ_CST);
 	}
 }
 
@@ -0,0 +1,63 @@
+//
+// K-mer extraction shared by the query, validate and stats commands: 2-bit encoding of
+// blocks of bases, splitting on non-ACGT bases in place, and rolling canonical k-mers.
+//
+
+#include "kmerExtractor.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace mantis {
+    namespace {
+        constexpr std::array<uint8_t, 256> makeBaseCodes() {
+            std::array<uint8_t, 256> codes{};
+            for (uint32_t c = 0; c < 256; c++) codes[c] = INVALID_BASE;
+            codes['C'] = codes['c'] = 0;
+            codes['A'] = codes['a'] = 1;
+            codes['T'] = codes['t'] = 2;
+            codes['G'] = codes['g'] = 3;
+            return codes;
+        }
+
+#ifdef __SSE2__
+        /**
+         * encodes 16 bases. Once the case bit is cleared, bits 1-2 of the ASCII codes of
+         * A (0x41), C (0x43), T (0x54) and G (0x47) give the code with the low bit flipped
+         * for A and C, which are the ones with bit 2 clear.
+         * @return a mask with bit i set if base i isn't one of ACGT
+         */
+        uint64_t encode16(const char *seq, uint8_t *codes) {
+            __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i *>(seq));
+            __m128i upper = _mm_and_si128(chars, _mm_set1_epi8(static_cast<char>(0xDF)));
+            __m128i valid = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(upper, _mm_set1_epi8('A')), _mm_cmpeq_epi8(upper, _mm_set1_epi8('C'))),
+                    _mm_or_si128(_mm_cmpeq_epi8(upper, _mm_set1_epi8('G')), _mm_cmpeq_epi8(upper, _mm_set1_epi8('T'))));
+            __m128i high = _mm_and_si128(_mm_srli_epi16(upper, 1), _mm_set1_epi8(3));
+            __m128i flip = _mm_and_si128(_mm_srli_epi16(_mm_andnot_si128(upper, _mm_set1_epi8(4)), 2),
+                                         _mm_set1_epi8(1));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(codes), _mm_xor_si128(high, flip));
+            return ~static_cast<uint64_t>(_mm_movemask_epi8(valid)) & 0xFFFF;
+        }
+#endif
+    }
+
+    const std::array<uint8_t, 256> BASE_CODE = makeBaseCodes();
+
+    uint64_t encodeBases(const char *seq, uint64_t n, uint8_t *codes) {
+        uint64_t invalid{0};
+        uint64_t i{0};
+#ifdef __SSE2__
+        for (; i + 16 <= n; i += 16) {
+            invalid |= encode16(seq + i, codes + i) << i;
+        }
+#endif
+        for (; i < n; i++) {
+            uint8_t code = BASE_CODE[static_cast<uint8_t>(seq[i])];
+            codes[i] = code & 3;
+            invalid |= static_cast<uint64_t>(code >> 2) << i;
+        }
+        return invalid;
+    }
+}
@@ -17,6 +17,7 @@
 #include "mantisconfig.hpp"
 #include "mst.h"
 #include "mstQuery.h"
+#include "resultWriter.h"
 
 template <typename T>
 void explore_options_verbose(T& res) {
@@ -50,6 +51,10 @@ int mst_query_main(QueryOpts &opt);
 int query_main (QueryOpts& opt);
 int validate_mst_main(MSTValidateOpts &opt);
 int stats_main(StatsOpts& statsOpts);
+int warm_cache_main(WarmCacheOpts &opt);
+int serve_main(ServeOpts &opt);
+int results_main(ResultsOpts &opt);
+int unitigs_main(UnitigOpts &opt);
 
 /*
  * ===  FUNCTION  =============================================================
@@ -59,7 +64,7 @@ int stats_main(StatsOpts& statsOpts);
  */
 int main ( int argc, char *argv[] ) {
   using namespace clipp;
-  enum class mode {build, build_mst, validate_mst, query, validate, stats, help};
+  enum class mode {build, build_mst, validate_mst, query, validate, stats, warm_cache, serve, results, unitigs, help};
   mode selected = mode::help;
 
   auto console = spdlog::stdout_color_mt("mantis_console");
@@ -69,11 +74,19 @@ int main ( int argc, char *argv[] ) {
   ValidateOpts vopt;
   MSTValidateOpts mvopt;
   StatsOpts sopt;
+  WarmCacheOpts wopt;
+  ServeOpts seopt;
+  ResultsOpts ropt;
+  UnitigOpts uopt;
   bopt.console = console;
   qopt.console = console;
   vopt.console = console;
   mvopt.console = console;
   sopt.console = console;
+  wopt.console = console;
+  seopt.console = console;
+  ropt.console = console;
+  uopt.console = console;
 
   auto ensure_file_exists = [](const std::string& s) -> bool {
     bool exists = mantis::fs::FileExists(s.c_str());
@@ -105,6 +118,11 @@ int main ( int argc, char *argv[] ) {
           command("mst").set(selected, mode::build_mst),
                   required("-p", "--index-prefix") & value(ensure_dir_exists, "index_prefix", qopt.prefix) % "The directory where the index is stored.",
                   option("-t", "--threads") & value("num_threads", qopt.numThreads) % "number of threads",
+                  option("-m", "--max-depth") & value("max_depth", qopt.max_mst_depth) % "Store full colors at some nodes so decoding any color class reads at most this many delta lists (default: 0, unbounded).",
+                  option("--tmp-dir") & value(ensure_dir_exists, "tmp_dir", qopt.mst_tmp_dir) % "Directory for the sorted edges of the color graph (default: the index directory).",
+                  option("--memory-mb") & value("memory_mb", qopt.mst_memory_mb) % "Memory in MB for sorting the edges of the color graph (default: 512).",
+                  option("--color-memory-mb") & value("color_memory_mb", qopt.mst_color_memory_mb) % "Memory in MB for the color class files kept loaded while weighing the edges (default: 0, two at a time).",
+                  option("--bucket-edges") & value("bucket_edges", qopt.mst_bucket_edges) % "Edges of one weight a thread needs to take part in finding the MST (default: 65536). 1 uses every thread on every weight.",
                   (
                           required("-k", "--keep-RRR").set(qopt.keep_colorclasses) % "Keep the previous color class RRR representation."
                           |
@@ -115,16 +133,33 @@ int main ( int argc, char *argv[] ) {
   auto validate_mst_mode = (
                   command("validatemst").set(selected, mode::validate_mst),
                   required("-p", "--index-prefix") & value(ensure_dir_exists, "index_prefix", mvopt.prefix) % "The directory where the index is stored.",
-                  required("-n", "--num-experiments") & value("num_experiments", mvopt.numSamples) % "Number of experiments."
+                  required("-n", "--num-experiments") & value("num_experiments", mvopt.numSamples) % "Number of experiments.",
+                  option("-t", "--threads") & value("num_threads", mvopt.numThreads) % "Number of threads decoding the color classes (default: 1).",
+                  option("-c", "--cache-mb") & value("cache_mb", mvopt.cache_budget_mb) % "Memory budget in MB for caches of decoded color classes (default: 0, every color class is decoded up to the root).",
+                  option("--stats-json") & value("stats_file", mvopt.stats_file) % "Write a JSON summary of the decode latencies, depths and delta list lengths to this file."
   );
 
   auto query_mode = (
                      command("query").set(selected, mode::query),
-                     //option("-b", "--bulk").set(qopt.process_in_bulk) % "Process the whole input query file as a bulk.",
+                     option("-b", "--bulk").set(qopt.process_in_bulk) % "Process the whole input query file as a bulk: each distinct k-mer and color class is looked up once.",
+                     option("-t", "--threads") & value("num_threads", qopt.numThreads) % "Number of threads used in bulk mode (default: 1).",
                      option("-1", "--use-colorclasses").set(qopt.use_colorclasses)
                      % "Use color classes as the color info representation instead of MST",
-                     option("-j", "--json").set(qopt.use_json) % "Write the output in JSON format",
+                     option("-j", "--json").set(qopt.use_json) % "Write the output in JSON format (same as --format json)",
+                     option("-f", "--format") & value("format", qopt.format) % "Output format: tsv, json or binary (default: tsv).",
+                     option("-c", "--cache-mb") & value("cache_mb", qopt.cache_budget_mb) % "Memory budget in MB for the cache of decoded color classes (default: 512).",
+                     option("--max-memory") & value("max_mb", qopt.max_memory_mb) % "Memory budget in MB for the index: the parts that don't fit are mapped or loaded on demand (default: no limit).",
+                     option("--lazy").set(qopt.lazy_colors) % "Map (MST) or load on first use (color classes) the color information instead of reading it all at startup.",
+                     option("--load-cache").set(qopt.load_cache) % "Start with the decoded color classes saved in the index directory (see warmcache).",
+                     option("--save-cache").set(qopt.save_cache) % "Save the decoded color classes to the index directory when done.",
+                     option("--unitigs").set(qopt.use_unitigs) % "Follow reads along the unitigs saved in the index directory (see unitigs) instead of looking each k-mer up.",
                      option("-k", "--kmer") & value("kmer", qopt.k) % "size of k for kmer.",
+                     option("--theta") & value("theta", qopt.theta) % "Only report the samples containing at least this fraction (0, 1] of the k-mers of a query.",
+                     option("--sample-rate") & value("rate", qopt.sample_rate) % "Screen: only query the k-mers whose hash falls in this fraction (0, 1] of the hash space. Counts are then over those k-mers.",
+                     option("--minimizers") & value("w", qopt.minimizer_window) % "Screen: only query the k-mer of smallest hash in every w consecutive k-mers. Counts are then over those k-mers.",
+                     option("--refine").set(qopt.refine) % "With --theta and a screen, decide the samples whose estimated containment is too close to theta over all the k-mers.",
+                     option("--samples") & value(ensure_file_exists, "subset_file", qopt.samples_file) % "Only search the samples listed in this file, one name per line.",
+                     option("--stats-json") & value("stats_file", qopt.stats_file) % "Write a JSON summary of the query latencies, phases and caches to this file.",
                      required("-p", "--input-prefix") & value(ensure_dir_exists, "query_prefix", qopt.prefix) % "Prefix of input files.",
                      option("-o", "--output") & value("output_file", qopt.output) % "Where to write query output.",
                      value(ensure_file_exists, "query", qopt.query_file) % "Prefix of input files."
@@ -134,7 +169,11 @@ int main ( int argc, char *argv[] ) {
                      command("validate").set(selected, mode::validate),
                      required("-i", "--input-list") & value(ensure_file_exists, "input_list", vopt.inlist) % "file containing list of input filters",
                      required("-p", "--input-prefix") & value(ensure_dir_exists, "dbg_prefix", vopt.prefix) % "Directory containing the mantis dbg.",
-                     value(ensure_file_exists, "query", vopt.query_file) % "Query file."
+                     option("-t", "--threads") & value("num_threads", vopt.numThreads) % "Number of threads used to check the k-mers of the inputs (default: 1).",
+                     option("--sample-rate") & value("rate", vopt.sample_rate) % "Only check the k-mers whose hash falls in this fraction (0, 1] of the hash space (default: 1, all of them).",
+                     option("--seed") & value("seed", vopt.seed) % "Seed of the k-mer sample, to check a different one (default: 0).",
+                     option("--report") & value("report_file", vopt.report_file) % "Write the mismatching k-mers to this file.",
+                     opt_value(ensure_file_exists, "query", vopt.query_file) % "Query file. Without it, the k-mers of every input are checked against the index instead."
                      );
     auto stats_mode = (
             command("stats").set(selected, mode::stats),
@@ -144,8 +183,39 @@ int main ( int argc, char *argv[] ) {
                     option("-j", "--jmer-length") & value("size-of-jmer", sopt.j) % "value of j for constituent jmers of a kmer (default: 23)."
     );
 
+  auto warm_cache_mode = (
+          command("warmcache").set(selected, mode::warm_cache),
+                  required("-p", "--index-prefix") & value(ensure_dir_exists, "index_prefix", wopt.prefix) % "The directory where the index is stored.",
+                  option("-n", "--num-colors") & value("num_colors", wopt.num_colors) % "Number of most abundant color classes to decode (default: 1000000).",
+                  option("-t", "--threads") & value("num_threads", wopt.numThreads) % "number of threads"
+  );
+
+  auto unitigs_mode = (
+          command("unitigs").set(selected, mode::unitigs),
+                  required("-p", "--index-prefix") & value(ensure_dir_exists, "index_prefix", uopt.prefix) % "The directory where the index is stored."
+  );
+
+  auto serve_mode = (
+          command("serve").set(selected, mode::serve),
+                  required("-p", "--index-prefix") & value(ensure_dir_exists, "index_prefix", seopt.prefix) % "The directory where the index is stored.",
+                  required("-s", "--socket") & value("socket", seopt.socket) % "Path of the UNIX domain socket to listen on.",
+                  option("-t", "--threads") & value("num_threads", seopt.numThreads) % "Number of requests served concurrently (default: 1).",
+                  option("-c", "--cache-mb") & value("cache_mb", seopt.cache_budget_mb) % "Memory budget in MB for the cache of decoded color classes (default: 512).",
+                  option("--max-memory") & value("max_mb", seopt.max_memory_mb) % "Memory budget in MB for the index: the parts that don't fit are mapped (default: no limit).",
+                  option("--lazy").set(seopt.lazy_colors) % "Map the color information instead of reading it all at startup.",
+                  option("--load-cache").set(seopt.load_cache) % "Start with the decoded color classes saved in the index directory (see warmcache).",
+                  option("-k", "--kmer") & value("kmer", seopt.k) % "size of k for kmer."
+  );
+
+  auto results_mode = (
+          command("results").set(selected, mode::results),
+                  required("-i", "--input") & value(ensure_file_exists, "binary_results", ropt.input) % "Output of mantis query --format binary.",
+                  required("-o", "--output") & value("output_file", ropt.output) % "Where to write the results as text.",
+                  option("-j", "--json").set(ropt.use_json) % "Write the results in JSON instead of TSV."
+  );
+
   auto cli = (
-              (build_mode | build_mst_mode | validate_mst_mode | query_mode | validate_mode | stats_mode | command("help").set(selected,mode::help) |
+              (build_mode | build_mst_mode | validate_mst_mode | query_mode | validate_mode | stats_mode | warm_cache_mode | unitigs_mode | serve_mode | results_mode | command("help").set(selected,mode::help) |
                option("-v", "--version").call([]{std::cout << "mantis " << mantis::version << '\n'; std::exit(0);}).doc("show version")
               )
              );
@@ -156,6 +226,10 @@ int main ( int argc, char *argv[] ) {
   assert(build_mst_mode.flags_are_prefix_free());
   assert(validate_mst_mode.flags_are_prefix_free());
   assert(stats_mode.flags_are_prefix_free());
+  assert(warm_cache_mode.flags_are_prefix_free());
+  assert(unitigs_mode.flags_are_prefix_free());
+  assert(serve_mode.flags_are_prefix_free());
+  assert(results_mode.flags_are_prefix_free());
 
   decltype(parse(argc, argv, cli)) res;
   try {
@@ -173,10 +247,62 @@ int main ( int argc, char *argv[] ) {
     switch(selected) {
     case mode::build: build_main(bopt);  break;
     case mode::build_mst: build_mst_main(qopt); break;
-    case mode::validate_mst: validate_mst_main(mvopt); break;
-    case mode::query: qopt.use_colorclasses? query_main(qopt):mst_query_main(qopt);  break;
-    case mode::validate: validate_main(vopt);  break;
+    case mode::validate_mst: return validate_mst_main(mvopt);
+    case mode::query:
+      if (qopt.theta < 0 or qopt.theta > 1) {
+        console->error("--theta must be in (0, 1].");
+        return 1;
+      }
+      if (qopt.theta > 0 and qopt.process_in_bulk) {
+        console->error("--theta can't be used with --bulk, threshold queries are answered one query at a time.");
+        return 1;
+      }
+      if (qopt.use_json) {
+        qopt.format = "json";
+      }
+      {
+        ResultFormat format;
+        if (!parseResultFormat(qopt.format, format)) {
+          console->error("Unknown output format {}, use tsv, json or binary.", qopt.format);
+          return 1;
+        }
+      }
+      if (!qopt.samples_file.empty() and qopt.save_cache) {
+        console->error("--save-cache can't be used with --samples, the colors decoded are restricted to the samples.");
+        return 1;
+      }
+      if (qopt.sample_rate <= 0 or qopt.sample_rate > 1) {
+        console->error("--sample-rate must be in (0, 1].");
+        return 1;
+      }
+      if (qopt.sample_rate < 1 and qopt.minimizer_window > 1) {
+        console->error("--sample-rate and --minimizers can't be used together.");
+        return 1;
+      }
+      if ((qopt.sample_rate < 1 or qopt.minimizer_window > 1) and qopt.use_colorclasses) {
+        console->error("Screening queries needs the MST representation of the colors.");
+        return 1;
+      }
+      if (qopt.refine and (qopt.theta == 0 or (qopt.sample_rate == 1 and qopt.minimizer_window <= 1))) {
+        console->error("--refine needs --theta and either --sample-rate or --minimizers.");
+        return 1;
+      }
+      if (qopt.use_unitigs and qopt.use_colorclasses) {
+        console->error("--unitigs needs the MST representation of the colors.");
+        return 1;
+      }
+      qopt.use_colorclasses? query_main(qopt):mst_query_main(qopt);  break;
+    case mode::validate:
+      if (vopt.sample_rate <= 0 or vopt.sample_rate > 1) {
+        console->error("--sample-rate must be in (0, 1].");
+        return 1;
+      }
+      return validate_main(vopt);
     case mode::stats: stats_main(sopt);  break;
+    case mode::warm_cache: warm_cache_main(wopt);  break;
+    case mode::unitigs: unitigs_main(uopt);  break;
+    case mode::serve: serve_main(seopt);  break;
+    case mode::results: results_main(ropt);  break;
     case mode::help: std::cout << make_man_page(cli, "mantis"); break;
     }
   } else {
@@ -195,6 +321,14 @@ int main ( int argc, char *argv[] ) {
         std::cout << make_man_page(validate_mode, "mantis");
       } else if (b->arg() == "stats") {
         std::cout << make_man_page(stats_mode, "mantis");
+      } else if (b->arg() == "warmcache") {
+        std::cout << make_man_page(warm_cache_mode, "mantis");
+      } else if (b->arg() == "unitigs") {
+        std::cout << make_man_page(unitigs_mode, "mantis");
+      } else if (b->arg() == "serve") {
+        std::cout << make_man_page(serve_mode, "mantis");
+      } else if (b->arg() == "results") {
+        std::cout << make_man_page(results_mode, "mantis");
       } else {
         std::cout << "There is no command \"" << b->arg() << "\"\n";
         std::cout << usage_lines(cli, "mantis") << '\n';
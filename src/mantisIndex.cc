@@ -0,0 +1,252 @@
+//
+// Embeddable query API: an index loaded once and queried from any number of threads.
+//
+
+#include <mutex>
+
+#include "spdlog/sinks/null_sink.h"
+#include "mantisIndex.h"
+#include "MantisFS.h"
+#include "bulkQuery.h"
+#include "coloreddbg.h"
+#include "memoryPlan.h"
+#include "mstQuery.h"
+#include "sampleCounter.h"
+
+namespace mantis {
+    namespace {
+        using RRRDbg = ColoredDbg<SampleObject<CQF<KeyObject> *>, KeyObject>;
+
+        /** the query state of one call at a time */
+        struct Worker {
+            std::string read;
+            // MST index
+            std::unique_ptr<MSTQuery> mstQuery;
+            QueryStats queryStats;
+            RankScores rs{1};
+            // RRR index
+            QuerySet kmers;
+            tsl::hopscotch_map<uint64_t, uint64_t> classCnt;
+            std::vector<uint64_t> row;
+            std::unique_ptr<SampleCounter> counter;
+        };
+
+        /** keeps the non-zero counts */
+        void compactCounts(const std::vector<uint64_t> &counts, QueryHits &hits) {
+            for (uint64_t s = 0; s < counts.size(); s++) {
+                if (!counts[s]) continue;
+                hits.samples.push_back(s);
+                hits.counts.push_back(counts[s]);
+            }
+        }
+    }
+
+    struct Index::Impl {
+        IndexOptions opt;
+        std::shared_ptr<spdlog::logger> nullLogger; // set if the caller passed no logger
+        spdlog::logger *logger{nullptr};
+        std::vector<std::string> sampleNames;
+        uint32_t k{0};
+        std::unique_ptr<ColorCache> cache;
+        // MST index
+        std::unique_ptr<CQF<KeyObject>> cqf;
+        std::shared_ptr<const MSTIndex> mstIndex;
+        WarmColorCache warmCache;
+        bool useWarmCache{false};
+        UnitigTable unitigs;
+        bool useUnitigs{false};
+        // RRR index
+        std::unique_ptr<RRRDbg> cdbg;
+
+        std::mutex poolMtx;
+        std::vector<std::unique_ptr<Worker>> idle;
+
+        std::unique_ptr<Worker> acquire();
+
+        void release(std::unique_ptr<Worker> worker);
+
+        /** a worker borrowed from the pool and given back when it goes out of scope, also on an exception */
+        class Lease {
+        public:
+            explicit Lease(Impl &implIn) : impl(implIn), worker(implIn.acquire()) {}
+
+            ~Lease() { impl.release(std::move(worker)); }
+
+            Lease(const Lease &) = delete;
+            Lease &operator=(const Lease &) = delete;
+
+            Worker &operator*() const { return *worker; }
+
+        private:
+            Impl &impl;
+            std::unique_ptr<Worker> worker;
+        };
+
+        void queryMST(Worker &w, std::string_view seq, QueryHits &hits);
+
+        void queryRRR(Worker &w, std::string_view seq, QueryHits &hits);
+    };
+
+    std::unique_ptr<Worker> Index::Impl::acquire() {
+        {
+            std::lock_guard<std::mutex> lock(poolMtx);
+            if (!idle.empty()) {
+                auto w = std::move(idle.back());
+                idle.pop_back();
+                return w;
+            }
+        }
+        std::unique_ptr<Worker> w(new Worker);
+        if (mstIndex) {
+            w->mstQuery.reset(new MSTQuery(mstIndex, k, k, sampleNames.size(), logger));
+            if (useWarmCache) w->mstQuery->setWarmCache(&warmCache);
+            if (useUnitigs) w->mstQuery->setUnitigs(&unitigs);
+            w->queryStats.numSamples = sampleNames.size();
+        } else {
+            w->row.resize((sampleNames.size() + 63) / 64);
+            w->counter.reset(new SampleCounter(sampleNames.size()));
+        }
+        return w;
+    }
+
+    void Index::Impl::release(std::unique_ptr<Worker> worker) {
+        std::lock_guard<std::mutex> lock(poolMtx);
+        idle.push_back(std::move(worker));
+    }
+
+    void Index::Impl::queryMST(Worker &w, std::string_view seq, QueryHits &hits) {
+        w.read.assign(seq.data(), seq.size());
+        auto &mstQuery = *w.mstQuery;
+        mstQuery.reset();
+        mstQuery.parseKmers(w.read, k);
+        mstQuery.findSamples(*cqf, *cache, &w.rs, w.queryStats);
+        hits.numKmers = mstQuery.getNumOfDistinctKmers();
+        compactCounts(mstQuery.getResultList(), hits);
+    }
+
+    void Index::Impl::queryRRR(Worker &w, std::string_view seq, QueryHits &hits) {
+        clearTable(w.kmers);
+        clearTable(w.classCnt);
+        KmerExtractor(k).forEach(seq.data(), seq.size(), [&w](uint64_t kmer) { w.kmers.insert(kmer); });
+        for (auto kmer : w.kmers) {
+            uint64_t eqclass = cdbg->get_eqclass(kmer);
+            if (eqclass) w.classCnt[eqclass] += 1;
+        }
+        w.counter->reset();
+        for (auto &kv : w.classCnt) {
+            cdbg->get_color_row(kv.first, w.row.data());
+            w.counter->add(w.row.data(), kv.second);
+        }
+        hits.numKmers = w.kmers.size();
+        compactCounts(w.counter->counts(), hits);
+    }
+
+    std::unique_ptr<Index> Index::open(const std::string &prefixIn, const IndexOptions &opt,
+                                       spdlog::logger *logger) {
+        std::unique_ptr<Impl> impl(new Impl);
+        impl->opt = opt;
+        if (!logger) {
+            impl->nullLogger = std::make_shared<spdlog::logger>(
+                    "mantis_index", std::make_shared<spdlog::sinks::null_sink_mt>());
+            logger = impl->nullLogger.get();
+        }
+        impl->logger = logger;
+        std::string prefix = prefixIn;
+        if (prefix.empty() or prefix.back() != '/') {
+            prefix.push_back('/');
+        }
+
+        std::vector<std::string> required{prefix + CQF_FILE, prefix + SAMPLEID_FILE};
+        if (opt.encoding == IndexEncoding::mst) {
+            required.insert(required.end(), {prefix + PARENTBV_FILE, prefix + DELTABV_FILE,
+                                             prefix + BOUNDARYBV_FILE});
+        }
+        for (auto &file : required) {
+            if (!fs::FileExists(file.c_str())) {
+                logger->error("Index file {} is missing.", file);
+                return nullptr;
+            }
+        }
+        std::string dbg_file(prefix + CQF_FILE);
+        std::string sample_file(prefix + SAMPLEID_FILE);
+        bool mst = opt.encoding == IndexEncoding::mst;
+        MemoryPlan plan = MemoryPlan::choose(prefix, mst, opt.maxMemoryMb << 20, opt.lazyColors,
+                                             opt.cacheBudgetMb << 20, logger);
+
+        if (!mst) {
+            std::vector<std::string> eqclass_files = fs::GetFilesExt(prefix.c_str(), EQCLASS_FILE);
+            if (eqclass_files.empty()) {
+                logger->error("No color class files ({}) in {}.", EQCLASS_FILE, prefix);
+                return nullptr;
+            }
+            impl->cdbg.reset(new RRRDbg(dbg_file, eqclass_files, sample_file,
+                                        plan.mapCqf ? MANTIS_DBG_ON_DISK : MANTIS_DBG_IN_MEMORY,
+                                        plan.lazyColors, plan.colorBudget));
+            impl->cdbg->set_console(logger);
+            impl->k = impl->cdbg->get_cqf()->keybits() / 2;
+            impl->sampleNames.resize(impl->cdbg->get_num_samples());
+            for (uint64_t i = 0; i < impl->sampleNames.size(); i++) {
+                impl->sampleNames[i] = impl->cdbg->get_sample(i);
+            }
+            impl->cache.reset(new ColorCache(impl->sampleNames.size(), plan.cacheBudget));
+            impl->cdbg->set_color_cache(impl->cache.get());
+            logger->info("Loaded an RRR index of {} k-mers, {} color classes and {} samples",
+                         impl->cdbg->get_cqf()->dist_elts(), impl->cdbg->get_num_bitvectors(),
+                         impl->sampleNames.size());
+            return std::unique_ptr<Index>(new Index(std::move(impl)));
+        }
+
+        impl->sampleNames = loadSampleFile(sample_file);
+        impl->cqf.reset(new CQF<KeyObject>(dbg_file, plan.mapCqf ? CQF_MMAP : CQF_FREAD));
+        impl->k = impl->cqf->keybits() / 2;
+        impl->mstIndex = std::make_shared<const MSTIndex>(prefix, logger, plan.lazyColors);
+        impl->cache.reset(new ColorCache(impl->sampleNames.size(), plan.cacheBudget));
+        if (opt.loadWarmCache) {
+            impl->useWarmCache = impl->warmCache.load(prefix + WARMCACHE_FILE, impl->sampleNames.size(),
+                                                      UnitigTable::fingerprint(*impl->cqf), logger);
+        }
+        if (opt.useUnitigs) {
+            impl->useUnitigs = impl->unitigs.load(prefix + UNITIG_FILE, *impl->cqf, logger);
+        }
+        logger->info("Loaded an MST index of {} k-mers, {} color classes and {} samples",
+                     impl->cqf->dist_elts(), impl->mstIndex->numColorClasses(), impl->sampleNames.size());
+        return std::unique_ptr<Index>(new Index(std::move(impl)));
+    }
+
+    Index::Index(std::unique_ptr<Impl> implIn) : impl(std::move(implIn)) {}
+
+    Index::~Index() = default;
+
+    QueryHits Index::query(std::string_view seq) const {
+        QueryHits hits;
+        // a query starts by clearing the state of its worker, so one that threw can be reused
+        Impl::Lease w(*impl);
+        if (impl->mstIndex) {
+            impl->queryMST(*w, seq, hits);
+        } else {
+            impl->queryRRR(*w, seq, hits);
+        }
+        return hits;
+    }
+
+    std::vector<QueryHits> Index::query_batch(const std::vector<std::string_view> &seqs,
+                                              uint32_t numThreads) const {
+        std::vector<QueryHits> results(seqs.size());
+        // queries differ a lot in length, so they are handed out one at a time
+        parallel_for(seqs.size(), numThreads, [&](uint64_t i, uint32_t) { results[i] = query(seqs[i]); }, 1);
+        return results;
+    }
+
+    std::vector<QueryHits> Index::query_batch(const std::vector<std::string> &seqs,
+                                              uint32_t numThreads) const {
+        return query_batch(std::vector<std::string_view>(seqs.begin(), seqs.end()), numThreads);
+    }
+
+    uint32_t Index::kmerSize() const { return impl->k; }
+
+    uint64_t Index::numSamples() const { return impl->sampleNames.size(); }
+
+    const std::vector<std::string> &Index::sampleNames() const { return impl->sampleNames; }
+
+    IndexEncoding Index::encoding() const { return impl->mstIndex ? IndexEncoding::mst : IndexEncoding::rrr; }
+}
@@ -0,0 +1,53 @@
+//
+// Choosing which structures of an index a query reads into memory and which it maps.
+//
+
+#include <algorithm>
+
+#include "memoryPlan.h"
+#include "mantisconfig.hpp"
+#include "MantisFS.h"
+
+MemoryPlan MemoryPlan::choose(const std::string &prefix, bool mst, uint64_t maxMemory, bool lazy,
+                              uint64_t cacheBudgetIn, spdlog::logger *logger) {
+    MemoryPlan plan;
+    plan.cacheBudget = cacheBudgetIn;
+    uint64_t cqfBytes = mantis::fs::FileSize((prefix + mantis::CQF_FILE).c_str());
+    uint64_t colorBytes{0};
+    if (mst) {
+        for (auto file : {mantis::PARENTBV_FILE, mantis::DELTABV_FILE, mantis::BOUNDARYBV_FILE}) {
+            colorBytes += mantis::fs::FileSize((prefix + file).c_str());
+        }
+    } else {
+        for (auto &file : mantis::fs::GetFilesExt(prefix.c_str(), mantis::EQCLASS_FILE)) {
+            colorBytes += mantis::fs::FileSize(file.c_str());
+        }
+    }
+
+    if (!maxMemory) {
+        plan.lazyColors = lazy;
+    } else if (!lazy and cqfBytes + colorBytes <= maxMemory) {
+        plan.cacheBudget = std::min(plan.cacheBudget, maxMemory - cqfBytes - colorBytes);
+    } else {
+        plan.lazyColors = true;
+        plan.mapCqf = cqfBytes > maxMemory / 2;
+        uint64_t left = plan.mapCqf ? maxMemory : maxMemory - cqfBytes;
+        if (mst) {
+            plan.cacheBudget = std::min(plan.cacheBudget, left);
+        } else {
+            // decoded rows are worth less than the blocks they come from, so they get at most half
+            plan.cacheBudget = std::min(plan.cacheBudget, left / 2);
+            // a block is loaded when needed even if it alone is over the budget
+            plan.colorBudget = std::max<uint64_t>(left - plan.cacheBudget, 1);
+        }
+    }
+    std::string budget;
+    if (plan.colorBudget) {
+        budget = ", up to " + std::to_string(plan.colorBudget >> 20) + " MB of them";
+    }
+    budget += ", " + std::to_string(plan.cacheBudget >> 20) + " MB of color cache";
+    logger->info("Index of {} MB (CQF) + {} MB (colors): {} the CQF, {} the colors{}",
+                 cqfBytes >> 20, colorBytes >> 20, plan.mapCqf ? "mapping" : "reading",
+                 !plan.lazyColors ? "reading" : mst ? "mapping" : "loading on demand", budget);
+    return plan;
+}
@@ -5,17 +5,24 @@
 //
 #include <string>
 #include <sstream>
+#include <chrono>
 #include <cstdio>
 #include <stdio.h>
 
 #include "MantisFS.h"
 #include "mst.h"
 #include "ProgOpts.h"
+#include "threadPool.h"
 
-#define MAX_ALLOWED_TMP_EDGES 31250000
+// edges weighed by one task of calculateWeights
+constexpr uint64_t WEIGHT_TASK_EDGES{1ULL << 14};
 
-MST::MST(std::string prefixIn, std::shared_ptr<spdlog::logger> loggerIn, uint32_t numThreads) :
-        prefix(std::move(prefixIn)), lru_cache(10000), nThreads(numThreads) {
+MST::MST(std::string prefixIn, std::shared_ptr<spdlog::logger> loggerIn, uint32_t numThreads,
+         uint32_t maxDepthIn, std::string tmpDirIn, uint64_t edgeMemoryIn, uint64_t colorMemoryIn,
+         uint64_t bucketEdgesIn) :
+        prefix(std::move(prefixIn)), tmpDir(std::move(tmpDirIn)), edgeMemory(edgeMemoryIn),
+        colorMemory(colorMemoryIn), bucketEdges(std::max<uint64_t>(bucketEdgesIn, 1)), nThreads(numThreads),
+        maxDepth(maxDepthIn) {
     logger = loggerIn.get();
 
     // Make sure the prefix is a full folder
@@ -27,6 +34,12 @@ MST::MST(std::string prefixIn, std::shared_ptr<spdlog::logger> loggerIn, uint32_
         logger->error("Index parent directory {} does not exist", prefix);
         std::exit(1);
     }
+    if (tmpDir.empty()) {
+        tmpDir = prefix;
+    } else if (!mantis::fs::DirExists(tmpDir.c_str())) {
+        logger->error("Temporary directory {} does not exist", tmpDir);
+        std::exit(1);
+    }
 
     eqclass_files =
             mantis::fs::GetFilesExt(prefix.c_str(), mantis::EQCLASS_FILE);
@@ -59,9 +72,9 @@ MST::MST(std::string prefixIn, std::shared_ptr<spdlog::logger> loggerIn, uint32_
 /**
  * Builds an MST consists of 3 main steps:
  * 1. construct the color graph for all the colorIds derived from dbg
- *      This phase just requires loading the CQF
+ *      This phase just requires loading the CQF, the edges are sorted out of memory
  * 2. calculate the weights of edges in the color graph
- *      This phase requires at most two buffers of color classes
+ *      This phase loads as many buffers of color classes as colorMemory allows and merges the sorted edges
  * 3. find MST of the weighted color graph
  */
 void MST::buildMST() {
@@ -74,12 +87,12 @@ void MST::buildMST() {
 /**
  * iterates over all elements of CQF,
  * find all the existing neighbors, and build a color graph based on that
+ * the edges are written to tmpDir as sorted runs
  * @return true if the color graph build was successful
  */
 bool MST::buildEdgeSets() {
-    std::vector<spp::sparse_hash_set<Edge, edge_hash>> edgesetList;
-    edgeBucketList.resize(num_of_ccBuffers * num_of_ccBuffers);
-    edgesetList.resize(num_of_ccBuffers * num_of_ccBuffers);
+    edgeSorter.reset(new EdgeSorter(tmpDir, num_of_ccBuffers, mantis::NUM_BV_BUFFER, edgeMemory, nThreads,
+                                    logger));
 
     logger->info("Reading colored dbg from disk.");
     std::string cqf_file(prefix + mantis::CQF_FILE);
@@ -87,20 +100,19 @@ bool MST::buildEdgeSets() {
     k = cqf.keybits() / 2;
     logger->info("Done loading cdbg. k is {}", k);
     logger->info("Iterating over cqf & building edgeSet ...");
-    // max possible value and divisible by 64
-    sdsl::bit_vector nodes((1 + (num_of_ccBuffers * mantis::NUM_BV_BUFFER) / 64) * 64, 0);
     uint64_t maxId{0}, numOfKmers{0};
 
     // build color class edges in a multi-threaded manner
     std::vector<std::thread> threads;
     for (uint32_t i = 0; i < nThreads; ++i) {
         threads.emplace_back(std::thread(&MST::buildPairedColorIdEdgesInParallel, this, i,
-                                         std::ref(cqf), std::ref(edgesetList),
-                                         std::ref(nodes), std::ref(maxId), std::ref(numOfKmers)));
+                                         std::ref(cqf), std::ref(maxId), std::ref(numOfKmers)));
     }
     for (auto &t : threads) { t.join(); }
     cqf.free();
     logger->info("Total number of kmers observed: {}", numOfKmers);
+    logger->info("Wrote {} sorted edges in {} runs to {}", edgeSorter->numWritten(), edgeSorter->numRuns(),
+                 tmpDir);
 //    logger->info("Total number of edges observed: {}", num_edges);
 
 
@@ -116,55 +128,9 @@ bool MST::buildEdgeSets() {
     if (lastbits != maxId - maxIdDivisibleBy64)
         logger->error("Didn't see one of the color classes in the CQF between {} & {}", i, maxId);*/
     num_colorClasses = maxId + 1;
-    logger->info("Put edges in each bucket in a sorted list.");
-    for (uint32_t i = 0; i < nThreads; ++i) {
-        std::string filename = "tmp"+std::to_string(i);
-        std::ifstream tmp;
-        tmp.open(filename, std::ios::in | std::ios::binary);
-        uint64_t cnt;
-        tmp.read(reinterpret_cast<char *>(&cnt), sizeof(cnt));
-        std::vector<Edge> edgeList;
-        edgeList.resize(cnt);
-        tmp.read(reinterpret_cast<char *>(edgeList.data()), sizeof(Edge)*cnt);
-        tmp.close();
-        std::remove(filename.c_str());
-        std::sort(edgeList.begin(), edgeList.end(),
-                  [](Edge &e1, Edge &e2) {
-                      return e1.n1 == e2.n1 ? e1.n2 < e2.n2 : e1.n1 < e2.n1;
-                  });
-        edgeList.erase(std::unique(edgeList.begin(), edgeList.end(),
-                [](Edge &e1, Edge &e2) {
-                    return e1.n1 == e2.n1 and e1.n2 == e2.n2;
-                }), edgeList.end());
-        for (auto &edge: edgeList) {
-            edgeBucketList[getBucketId(edge.n1, edge.n2)].push_back(edge);
-        }
-    }
-    for (auto &bucket: edgeBucketList) {
-        std::cerr << "before uniqifying: " << bucket.size() << " ";
-        std::sort(bucket.begin(), bucket.end(),
-                  [](Edge &e1, Edge &e2) {
-                      return e1.n1 == e2.n1 ? e1.n2 < e2.n2 : e1.n1 < e2.n1;
-                  });
-        bucket.erase(std::unique(bucket.begin(), bucket.end(),
-                                   [](Edge &e1, Edge &e2) {
-                                       return e1.n1 == e2.n1 and e1.n2 == e2.n2;
-                                   }), bucket.end());
-        std::cerr << "after: " << bucket.size() << "\n";
-    }
-    logger->info("Done sorting the edges.");
-
-    // Add an edge between each color class ID and node zero
-    logger->info("Adding edges from dummy node zero to each color class Id for {} color classes",
-                 num_colorClasses);
+
+    // The edges between each color class ID and node zero are added when the weights are computed
     zero = static_cast<colorIdType>(num_colorClasses);
-    for (colorIdType colorId = 0; colorId < num_colorClasses; colorId++) {
-        /*if (edgeBucketList[getBucketId(colorId, zero)].find(Edge(colorId, zero)) != edgeBucketList[getBucketId(colorId, zero)].end()) {
-            logger->error("already existed: {}, {}", colorId, zero);
-            std::exit(1);
-        }*/
-        edgeBucketList[getBucketId(colorId, zero)].push_back(Edge(colorId, zero));
-    }
     num_colorClasses++; // zero is now a dummy color class with ID equal to actual num of color classes
 
     return true;
@@ -172,38 +138,31 @@ bool MST::buildEdgeSets() {
 
 void MST::buildPairedColorIdEdgesInParallel(uint32_t threadId,
                                             CQF<KeyObject> &cqf,
-                                            std::vector<spp::sparse_hash_set<Edge, edge_hash>> &edgesetList,
-                                            sdsl::bit_vector &nodes,
                                             uint64_t &maxId, uint64_t &numOfKmers) {
     //std::cout << "THREAD ..... " << threadId << " " << cqf.range() << "\n";
     uint64_t kmerCntr{0}, localMaxId{0};
     __uint128_t startPoint = threadId * (cqf.range() / (__uint128_t) nThreads);
     __uint128_t endPoint =
             threadId + 1 == nThreads ? cqf.range() + 1 : (threadId + 1) * (cqf.range() / (__uint128_t) nThreads);
-        /*std::cerr << threadId << ": s" << (uint64_t) (startPoint/(__uint128_t)0xFFFFFFFFFFFFFFFF) << " "
-                  << "sr" << (uint64_t) (startPoint%(__uint128_t)0xFFFFFFFFFFFFFFFF) << " "
-                << "e" << (uint64_t) (endPoint/(__uint128_t)0xFFFFFFFFFFFFFFFF) << " "
-                << "er" << (uint64_t) (endPoint%(__uint128_t)0xFFFFFFFFFFFFFFFF) << "\n";*/
-    auto tmpEdgeListSize = MAX_ALLOWED_TMP_EDGES / nThreads;
-    std::vector<Edge> edgeList;
-    edgeList.reserve(tmpEdgeListSize);
+    /*std::cerr << threadId << ": s" << (uint64_t) (startPoint/(__uint128_t)0xFFFFFFFFFFFFFFFF) << " "
+              << "sr" << (uint64_t) (startPoint%(__uint128_t)0xFFFFFFFFFFFFFFFF) << " "
+            << "e" << (uint64_t) (endPoint/(__uint128_t)0xFFFFFFFFFFFFFFFF) << " "
+            << "er" << (uint64_t) (endPoint%(__uint128_t)0xFFFFFFFFFFFFFFFF) << "\n";*/
+    auto tmpEdgeListSize = edgeSorter->bufferEdges();
+    std::vector<uint64_t> edgeList, sortSpace;
+    // a k-mer adds at most 8 edges
+    edgeList.reserve(tmpEdgeListSize + 8);
     auto it = cqf.setIteratorLimits(startPoint, endPoint);
-    std::string filename("tmp"+std::to_string(threadId));
     uint64_t cnt = 0;
-    std::ofstream tmpfile;
-    tmpfile.open(filename, std::ios::out | std::ios::binary);
-    tmpfile.write(reinterpret_cast<const char *>(&cnt), sizeof(cnt));
     while (!it.reachedHashLimit()) {
         KeyObject keyObject = *it;
         uint64_t curEqId = keyObject.count - 1;
-        //nodes[curEqId] = 1; // set the seen color class id bit
         localMaxId = curEqId > localMaxId ? curEqId : localMaxId;
         // Add an edge between the color class and each of its neighbors' colors in dbg
         findNeighborEdges(cqf, keyObject, edgeList);
-        if (edgeList.size() >= tmpEdgeListSize/* and colorMutex.try_lock()*/) {
-            tmpfile.write(reinterpret_cast<const char *>(edgeList.data()), sizeof(Edge)*edgeList.size());
-            cnt+=edgeList.size();
-            edgeList.clear();
+        if (edgeList.size() >= tmpEdgeListSize) {
+            cnt += edgeList.size();
+            edgeSorter->writeRun(edgeList, sortSpace);
         }
         ++it;
         kmerCntr++;
@@ -211,161 +170,252 @@ void MST::buildPairedColorIdEdgesInParallel(uint32_t threadId,
             std::cerr << "\rthread " << threadId << ": Observed " << (numOfKmers + kmerCntr) / 1000000 << "M kmers and " << cnt << " edges";
         }
     }
-    tmpfile.write(reinterpret_cast<const char *>(edgeList.data()), sizeof(Edge)*edgeList.size());
-    cnt+=edgeList.size();
+    cnt += edgeList.size();
+    edgeSorter->writeRun(edgeList, sortSpace);
     colorMutex.lock();
     maxId = localMaxId > maxId ? localMaxId : maxId;
     numOfKmers += kmerCntr;
     std::cerr << "\r";
     logger->info("Thread {}: Observed {} kmers and {} edges", threadId, numOfKmers, cnt/*num_edges*/);
     colorMutex.unlock();
-    //}
-    tmpfile.seekp(0);
-    tmpfile.write(reinterpret_cast<const char *>(&cnt), sizeof(cnt));
-    tmpfile.close();
 }
 
 /**
  * loads the color class table in parts
  * calculate the hamming distance between the color bitvectors fetched from color class table
- * for each pair of color IDs
+ * for each pair of color IDs, merging the sorted edges of each pair of buffers loaded
  * having w buckets where w is the maximum possible weight (number of experiments)
  * put the pair in its corresponding bucket based on the hamming distance value (weight)
+ *
+ * The buffers are taken in blocks of as many as fit in colorMemory next to one more buffer.
+ * The pairs within a block are weighed first, then the buffers after the block are loaded one
+ * at a time, from the last one down, so the one loaded last is the first of the next block.
+ * The edges of a pair are weighed in chunks on one pool of threads, so a pair with few edges
+ * takes one thread and the others go on with the next pairs.
  * @return true if successful
  */
 bool MST::calculateWeights() {
 
     logger->info("Going over all the edges and calculating the weights.");
-    uint64_t numEdges = 0;
     weightBuckets.resize(numSamples);
-    for (auto i = 0; i < eqclass_files.size(); i++) {
-        BitVectorRRR bv1;
-        sdsl::load_from_file(bv1, eqclass_files[i]);
-        bvp1 = &bv1;
-        for (auto j = i; j < eqclass_files.size(); j++) {
-            BitVectorRRR bv2;
-            auto &edgeBucket = edgeBucketList[i * num_of_ccBuffers + j];
-            if (i == j) {
-                bvp2 = bvp1;
-            } else {
-                sdsl::load_from_file(bv2, eqclass_files[j]);
-                bvp2 = &bv2;
+    uint64_t numBuffers = eqclass_files.size();
+    std::vector<uint64_t> bufferBytes(numBuffers), largestFrom(numBuffers + 1, 0);
+    for (uint64_t i = 0; i < numBuffers; i++) {
+        bufferBytes[i] = mantis::fs::FileSize(eqclass_files[i].c_str());
+    }
+    for (uint64_t i = numBuffers; i-- > 0;) {
+        largestFrom[i] = std::max(largestFrom[i + 1], bufferBytes[i]);
+    }
+
+    mantis::ThreadPool pool(nThreads);
+    std::vector<std::vector<std::vector<Edge>>> threadWeightBuckets(
+            pool.size(), std::vector<std::vector<Edge>>(numSamples));
+    std::vector<std::unique_ptr<BitVectorRRR>> buffers(numBuffers);
+    uint64_t numLoads{0};
+    auto load = [&](uint64_t i) {
+        if (buffers[i]) return;
+        buffers[i].reset(new BitVectorRRR);
+        sdsl::load_from_file(*buffers[i], eqclass_files[i]);
+        numLoads++;
+    };
+    auto submit = [&](std::shared_ptr<std::vector<uint64_t>> edges, const BitVectorRRR *bv1,
+                      const BitVectorRRR *bv2) {
+        pool.submit([this, edges, bv1, bv2, &threadWeightBuckets](uint32_t t) {
+            weighEdges(edges->data(), edges->size(), bv1, bv2, threadWeightBuckets[t]);
+        });
+        // bounds the chunks in memory
+        pool.waitBelow(4 * pool.size());
+    };
+    auto weighPair = [&](uint64_t i, uint64_t j) {
+        const BitVectorRRR *bv1 = buffers[i].get(), *bv2 = buffers[j].get();
+        uint64_t edgeCnt{0};
+        edgeSorter->mergeBucket(i * num_of_ccBuffers + j, [&](const uint64_t *edges, uint64_t n) {
+            for (uint64_t s = 0; s < n; s += WEIGHT_TASK_EDGES) {
+                submit(std::make_shared<std::vector<uint64_t>>(edges + s, edges + std::min(n, s + WEIGHT_TASK_EDGES)),
+                       bv1, bv2);
             }
-            std::cerr << "\rEq classes " << i << " and " << j << " -> edgeset size: " << edgeBucket.size();
-            std::vector<std::thread> threads;
-            for (uint32_t t = 0; t < nThreads; ++t) {
-                threads.emplace_back(std::thread(&MST::calcHammingDistInParallel, this, t,
-                                                 std::ref(edgeBucket)));
+            edgeCnt += n;
+        });
+        if (i == j) {
+            // the edges from the color classes of the buffer to node zero
+            uint64_t end = std::min<uint64_t>((i + 1) * mantis::NUM_BV_BUFFER, zero);
+            for (uint64_t colorId = i * mantis::NUM_BV_BUFFER; colorId < end;) {
+                auto zeroEdges = std::make_shared<std::vector<uint64_t>>();
+                for (; colorId < end and zeroEdges->size() < WEIGHT_TASK_EDGES; colorId++) {
+                    zeroEdges->push_back(mantis::packEdge(colorId, zero));
+                }
+                edgeCnt += zeroEdges->size();
+                submit(zeroEdges, bv1, bv2);
             }
-            for (auto &t : threads) { t.join(); }
-            edgeBucket.clear();
         }
+        std::cerr << "\rEq classes " << i << " and " << j << " -> edgeset size: " << edgeCnt;
+    };
+
+    for (uint64_t a = 0; a < numBuffers;) {
+        uint64_t blockEnd = a + 1, blockBytes = bufferBytes[a];
+        while (blockEnd < numBuffers and
+               blockBytes + bufferBytes[blockEnd] + largestFrom[blockEnd + 1] <= colorMemory) {
+            blockBytes += bufferBytes[blockEnd++];
+        }
+        pool.wait();
+        for (uint64_t i = 0; i < numBuffers; i++) {
+            if (i < a or i >= blockEnd) buffers[i].reset();
+        }
+        for (uint64_t i = a; i < blockEnd; i++) {
+            load(i);
+        }
+        for (uint64_t i = a; i < blockEnd; i++) {
+            for (uint64_t j = i; j < blockEnd; j++) {
+                weighPair(i, j);
+            }
+        }
+        for (uint64_t j = numBuffers; j-- > blockEnd;) {
+            load(j);
+            for (uint64_t i = a; i < blockEnd; i++) {
+                weighPair(i, j);
+            }
+            if (j != blockEnd) {
+                pool.wait();
+                buffers[j].reset();
+            }
+        }
+        a = blockEnd;
     }
+    pool.wait();
     std::cerr << "\r";
-    /*if (bvp1 == nullptr)
-        return false;
-    if (bvp1 == bvp2) {
-        delete bvp1;
-    } else {
-        delete bvp1;
-        delete bvp2;
-    }*/
-    edgeBucketList.clear();
+    buffers.clear();
+    edgeSorter.reset();
+    logger->info("Loaded color class buffers {} times for {} buffers", numLoads, numBuffers);
+
+    for (uint64_t w = 0; w < numSamples; w++) {
+        pool.submit([this, w, &threadWeightBuckets](uint32_t) {
+            for (auto &buckets : threadWeightBuckets) {
+                weightBuckets[w].insert(weightBuckets[w].end(), buckets[w].begin(), buckets[w].end());
+                std::vector<Edge>().swap(buckets[w]);
+            }
+        });
+    }
+    pool.wait();
     logger->info("Calculated the weight for the edges");
     return true;
 }
 
-void MST::calcHammingDistInParallel(uint32_t i, std::vector<Edge> &edgeList) {
+/**
+ * puts each edge in the weight bucket of the hamming distance of the colors of its ends
+ * @param bv1 the buffer of the sources of the edges
+ * @param bv2 the buffer of their targets
+ */
+void MST::weighEdges(const uint64_t *edges, uint64_t numEdges, const BitVectorRRR *bv1, const BitVectorRRR *bv2,
+                     std::vector<std::vector<Edge>> &localWeightBucket) {
     uint64_t srcId = (uint64_t)-1;
     std::vector<uint64_t> srcBV;
-    std::vector<std::vector<Edge>> localWeightBucket;
-    localWeightBucket.resize(numSamples);
-    uint64_t s = 0, e = edgeList.size();
-    // If the list contains less than a hundred edges, don't bother with multi-threading and
-    // just run the first thread
-   if (edgeList.size() < 100) {
-        if (i == 0) {
-            e = edgeList.size();
-        } else {
-            e = 0;
-        }
-    } else {
-        s = edgeList.size() * i / nThreads;
-        e = edgeList.size() * (i + 1) / nThreads;
-    }
-    auto itrStart = edgeList.begin() + s;
-    auto itrEnd = e >= edgeList.size() ? edgeList.end() : edgeList.begin() + e;
-    //logger->info("Thread {}: {} to {} out of {}", i, s, e, edgeList.size());
-    for (auto edge = itrStart; edge != itrEnd; edge++) {
-        auto w = hammingDist(edge->n1, edge->n2,
-                             srcId, srcBV); // hammingDist uses bvp1 and bvp2
+    for (uint64_t edge = 0; edge < numEdges; edge++) {
+        Edge cur(mantis::edgeSource(edges[edge]), mantis::edgeTarget(edges[edge]));
+        auto w = hammingDist(cur.n1, cur.n2, srcId, srcBV, bv1, bv2);
         if (w == 0) {
-            logger->error("Hamming distance of 0 between edges {} & {}", edge->n1, edge->n2);
+            logger->error("Hamming distance of 0 between edges {} & {}", cur.n1, cur.n2);
             std::exit(1);
         }
-        localWeightBucket[w - 1].push_back(*edge);
-    }
-    colorMutex.lock();
-    for (uint64_t j = 0; j < numSamples; j++) {
-        weightBuckets[j].insert(weightBuckets[j].end(), localWeightBucket[j].begin(), localWeightBucket[j].end());
+        localWeightBucket[w - 1].push_back(cur);
     }
-    colorMutex.unlock();
 }
 
 /**
  * Finds Minimum Spanning Forest of color graph using Kruskal Algorithm
  *
- * The algorithm's basic implementation taken from
- * https://www.geeksforgeeks.org/kruskals-minimum-spanning-tree-using-stl-in-c/
- * @return List of connected components in the Minimum Spanning Forest
+ * The edges are already bucketed by weight, so instead of sorting them the buckets are taken
+ * in increasing weight. Any spanning forest of the edges of one weight that extends the forest
+ * of the lighter ones gives a minimum spanning forest, so the edges of a bucket are split
+ * across the threads, which merge their ends concurrently in a lock-free union-find.
+ * Which edges are picked in a bucket depends on the threads, the total weight does not.
  */
-DisjointSets MST::kruskalMSF() {
+void MST::kruskalMSF() {
+    auto start = std::chrono::steady_clock::now();
     uint32_t bucketCnt = numSamples;
     mst.resize(num_colorClasses);
     // Create disjoint sets
-    DisjointSets ds(num_colorClasses);
+    ConcurrentDisjointSets ds(num_colorClasses);
+    std::vector<std::vector<std::pair<Edge, uint32_t>>> selected(nThreads);
 
     uint64_t edgeCntr{0}, selectedEdgeCntr{0};
-    uint32_t w{0};
 
-    // Iterate through all sorted edges
+    // Iterate through all buckets of edges in increasing weight
     for (uint32_t bucketCntr = 0; bucketCntr < bucketCnt; bucketCntr++) {
-        uint32_t edgeIdxInBucket = 0;
-        w = bucketCntr + 1;
-        for (auto &it : weightBuckets[bucketCntr]) {
-            colorIdType u = it.n1;
-            colorIdType v = it.n2;
-            colorIdType root_of_u = ds.find(u);
-            colorIdType root_of_v = ds.find(v);
-
-            // Check if the selected edge is causing a cycle or not
-            // (A cycle is induced if u and v belong to the same set)
-            if (root_of_u != root_of_v) {
-                // Merge two sets
-                ds.merge(root_of_u, root_of_v, w);
-                // Current edge will be in the MST
-                mst[u].emplace_back(v, w);
-                mst[v].emplace_back(u, w);
-                mstTotalWeight += w;
-                selectedEdgeCntr++;
-            }
-            edgeCntr++;
-            if (edgeCntr % 1000000 == 0) {
-                std::cerr << "\r" << edgeCntr << " edges processed and "
-                          << selectedEdgeCntr << " were selected";
+        auto &bucket = weightBuckets[bucketCntr];
+        uint32_t w = bucketCntr + 1;
+        // threads only pay off on large buckets
+        uint32_t numWorkers = static_cast<uint32_t>(
+                std::max<uint64_t>(1, std::min<uint64_t>(nThreads, bucket.size() / bucketEdges)));
+        if (numWorkers == 1) {
+            kruskalBucketInParallel(0, 1, w, bucket, ds, selected[0]);
+        } else {
+            std::vector<std::thread> threads;
+            for (uint32_t t = 0; t < numWorkers; ++t) {
+                threads.emplace_back(std::thread(&MST::kruskalBucketInParallel, this, t, numWorkers, w,
+                                                 std::cref(bucket), std::ref(ds), std::ref(selected[t])));
             }
-            edgeIdxInBucket++;
+            for (auto &t : threads) { t.join(); }
         }
-        weightBuckets[bucketCntr].clear();
+        if ((edgeCntr + bucket.size()) / 1000000 != edgeCntr / 1000000) {
+            uint64_t selectedNow{0};
+            for (auto &s : selected) selectedNow += s.size();
+            std::cerr << "\r" << edgeCntr + bucket.size() << " edges processed and "
+                      << selectedNow << " were selected";
+        }
+        edgeCntr += bucket.size();
+        std::vector<Edge>().swap(bucket);
     }
     std::cerr << "\r";
+
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < nThreads; ++t) {
+        threads.emplace_back(std::thread(&MST::fillMSTInParallel, this, t, std::cref(selected)));
+    }
+    for (auto &t : threads) { t.join(); }
+    for (auto &s : selected) {
+        selectedEdgeCntr += s.size();
+        for (auto &e : s) {
+            mstTotalWeight += e.second;
+        }
+    }
     mstTotalWeight++;//1 empty slot for root (zero)
-    logger->info("MST Construction finished:"
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    logger->info("MST Construction finished in {:.3f} s with {} threads:"
                  "\n\t# of graph edges: {}"
                  "\n\t# of merges (mst edges): {}"
                  "\n\tmst weight sum: {}",
-                 edgeCntr, selectedEdgeCntr, mstTotalWeight);
-    return ds;
+                 elapsed.count(), nThreads, edgeCntr, selectedEdgeCntr, mstTotalWeight);
+}
+
+void MST::kruskalBucketInParallel(uint32_t threadId, uint32_t numWorkers, uint32_t w,
+                                  const std::vector<Edge> &edges, ConcurrentDisjointSets &ds,
+                                  std::vector<std::pair<Edge, uint32_t>> &selected) {
+    uint64_t s = edges.size() * threadId / numWorkers;
+    uint64_t e = edges.size() * (threadId + 1) / numWorkers;
+    for (uint64_t i = s; i < e; i++) {
+        // The edge is in the MST unless it would make a cycle
+        // (A cycle is induced if its ends already belong to the same set)
+        if (ds.unite(edges[i].n1, edges[i].n2)) {
+            selected.emplace_back(edges[i], w);
+        }
+    }
+}
+
+/**
+ * adds the selected edges to the adjacency lists of their ends that fall in the range of
+ * color classes of the thread, so no two threads touch the same list
+ */
+void MST::fillMSTInParallel(uint32_t threadId,
+                            const std::vector<std::vector<std::pair<Edge, uint32_t>>> &selected) {
+    colorIdType s = static_cast<colorIdType>(num_colorClasses * threadId / nThreads);
+    colorIdType e = static_cast<colorIdType>(num_colorClasses * (threadId + 1) / nThreads);
+    for (auto &list : selected) {
+        for (auto &edge : list) {
+            colorIdType u = edge.first.n1, v = edge.first.n2;
+            if (u >= s and u < e) mst[u].emplace_back(v, edge.second);
+            if (v >= s and v < e) mst[v].emplace_back(u, edge.second);
+        }
+    }
 }
 
 /**
@@ -383,10 +433,12 @@ bool MST::encodeColorClassUsingMST() {
     logger->info("Filling ParentBV...");
     sdsl::int_vector<> parentbv(num_colorClasses, 0, ceil(log2(num_colorClasses)));
     // create and fill the deltabv and boundarybv data structures
-    sdsl::bit_vector bbv(mstTotalWeight, 0);
+    sdsl::bit_vector bbv;
     {// putting weightbv inside the scope so its memory is freed after we're done with it
-        sdsl::int_vector<> weightbv(num_colorClasses, 0, ceil(log2(numSamples)));
+        // a re-rooted color can weigh as much as numSamples
+        sdsl::int_vector<> weightbv(num_colorClasses, 0, ceil(log2(numSamples + 1)));
         sdsl::bit_vector visited(num_colorClasses, 0);
+        std::vector<colorIdType> bfsOrder; // only kept if the decode depth is bounded
         bool check = false;
         std::queue<colorIdType> q;
         q.push(zero); // Root of the tree is zero
@@ -395,6 +447,9 @@ bool MST::encodeColorClassUsingMST() {
         while (!q.empty()) {
             colorIdType parent = q.front();
             q.pop();
+            if (maxDepth) {
+                bfsOrder.push_back(parent);
+            }
             for (auto &neighbor :mst[parent]) {
                 if (!visited[neighbor.first]) {
                     parentbv[neighbor.first] = parent;
@@ -410,9 +465,13 @@ bool MST::encodeColorClassUsingMST() {
         }
 
         std::cerr << "\r";
+        if (maxDepth) {
+            boundDecodeDepth(parentbv, weightbv, bfsOrder);
+        }
         // filling bbv
-        // resize bbv
+        // size bbv now that the final weights are known
         logger->info("Filling BBV...");
+        sdsl::util::assign(bbv, sdsl::bit_vector(mstTotalWeight, 0));
         uint64_t deltaOffset{0};
         for (uint64_t i = 0; i < num_colorClasses; i++) {
             deltaOffset += static_cast<uint64_t>(weightbv[i]);
@@ -468,6 +527,65 @@ bool MST::encodeColorClassUsingMST() {
     return true;
 }
 
+/**
+ * bounds the number of delta lists a query reads to decode any color class by d = maxDepth.
+ * Some nodes are re-rooted on the dummy node zero, so their delta list becomes
+ * their full color and a decode walk stops there.
+ * Going bottom-up, a node is re-rooted as soon as the chain of nodes that would be decoded
+ * through it (itself included) reaches d; re-rooting as high as possible keeps the
+ * number of materialized colors minimal.
+ * @param parentbv parent of each node, updated for re-rooted nodes
+ * @param weightbv length of the delta list of each node, updated for re-rooted nodes
+ * @param bfsOrder all the nodes, parents before children
+ */
+void MST::boundDecodeDepth(sdsl::int_vector<> &parentbv, sdsl::int_vector<> &weightbv,
+                           std::vector<colorIdType> &bfsOrder) {
+    logger->info("Bounding the decode depth to {}...", maxDepth);
+    // longest chain of not re-rooted nodes hanging below each node
+    sdsl::int_vector<> below(num_colorClasses, 0, ceil(log2(maxDepth + 1)));
+    sdsl::bit_vector rerooted(num_colorClasses, 0);
+    std::vector<uint64_t> rerootedPerBuffer(num_of_ccBuffers, 0);
+    for (auto it = bfsOrder.rbegin(); it != bfsOrder.rend(); ++it) {
+        colorIdType c = *it;
+        colorIdType p = parentbv[c];
+        if (c == zero or p == zero) continue;
+        uint64_t chain = below[c] + 1;
+        if (chain >= maxDepth) {
+            rerooted[c] = 1;
+            rerootedPerBuffer[c / mantis::NUM_BV_BUFFER]++;
+        } else if (chain > below[p]) {
+            below[p] = chain;
+        }
+    }
+
+    // the new weight of a re-rooted node is the number of samples in its color
+    uint64_t rerootCnt{0}, oldWeight{0}, newWeight{0};
+    std::vector<uint64_t> eq(((numSamples - 1) / 64) + 1, 0);
+    for (uint64_t i = 0; i < eqclass_files.size(); i++) {
+        if (rerootedPerBuffer[i] == 0) continue;
+        BitVectorRRR bv;
+        sdsl::load_from_file(bv, eqclass_files[i]);
+        uint64_t s = i * mantis::NUM_BV_BUFFER;
+        uint64_t e = std::min(s + mantis::NUM_BV_BUFFER, static_cast<uint64_t>(zero));
+        for (uint64_t c = s; c < e; c++) {
+            if (!rerooted[c]) continue;
+            buildColor(eq, c, &bv);
+            uint64_t w{0};
+            for (auto wrd : eq) {
+                w += sdsl::bits::cnt(wrd);
+            }
+            oldWeight += weightbv[c];
+            newWeight += w;
+            weightbv[c] = w;
+            parentbv[c] = zero;
+            rerootCnt++;
+        }
+    }
+    mstTotalWeight = mstTotalWeight + newWeight - oldWeight;
+    logger->info("Re-rooted {} color classes, the deltas grew from {} to {} for them.",
+                 rerootCnt, oldWeight, newWeight);
+}
+
 void MST::calcDeltasInParallel(uint32_t threadID, uint64_t cbvID1, uint64_t cbvID2,
                                sdsl::int_vector<> &parentbv, sdsl::int_vector<> &deltabv,
                                sdsl::bit_vector::select_1_type &sbbv ) {
@@ -506,15 +624,14 @@ void MST::calcDeltasInParallel(uint32_t threadID, uint64_t cbvID1, uint64_t cbvI
  * @param cqf (required to query for existence of neighbors)
  * @param it iterator to the elements of cqf
  */
-void MST::findNeighborEdges(CQF<KeyObject> &cqf, KeyObject &keyobj, std::vector<Edge> &edgeList) {
+void MST::findNeighborEdges(CQF<KeyObject> &cqf, KeyObject &keyobj, std::vector<uint64_t> &edgeList) {
     dna::canonical_kmer curr_node(static_cast<int>(k), keyobj.key);
     workItem cur = {curr_node, static_cast<colorIdType>(keyobj.count - 1)};
     uint64_t neighborCnt{0};
     for (auto &nei : neighbors(cqf, cur)) {
         neighborCnt++;
         if (cur.colorId < nei.colorId) {
-            Edge e(static_cast<colorIdType>(cur.colorId), static_cast<colorIdType>(nei.colorId));
-            edgeList.push_back(e);
+            edgeList.push_back(mantis::packEdge(cur.colorId, nei.colorId));
         }
     }
 }
@@ -566,14 +683,15 @@ bool MST::exists(CQF<KeyObject> &cqf, dna::canonical_kmer e, uint64_t &eqid) {
  * @return
  */
 uint64_t MST::hammingDist(uint64_t eqid1, uint64_t eqid2,
-                          uint64_t &srcId, std::vector<uint64_t> &srcEq) {
+                          uint64_t &srcId, std::vector<uint64_t> &srcEq,
+                          const BitVectorRRR *bv1, const BitVectorRRR *bv2) {
     uint64_t dist{0};
     std::vector<uint64_t> eq1(((numSamples - 1) / 64) + 1, 0), eq2(((numSamples - 1) / 64) + 1, 0);
     // cache the source color ID and BV
     if (eqid1 == srcId) {
         eq1 = srcEq;
     } else {
-        buildColor(eq1, eqid1, bvp1);
+        buildColor(eq1, eqid1, bv1);
         srcEq.clear();
         for (auto &eq: eq1) {
             srcEq.push_back(eq);
@@ -581,7 +699,7 @@ uint64_t MST::hammingDist(uint64_t eqid1, uint64_t eqid2,
         srcId = eqid1;
     }
     // fetch the second color ID's BV
-    buildColor(eq2, eqid2, bvp2);
+    buildColor(eq2, eqid2, bv2);
 
     for (uint64_t i = 0; i < eq1.size(); i++) {
         if (eq1[i] != eq2[i])
@@ -624,16 +742,8 @@ std::vector<uint32_t> MST::getDeltaList(uint64_t eqid1, uint64_t eqid2) {
  * @param eqid color id
  * @param bv the large bv collapsing all eq ids color bv in a bucket
  */
-void MST::buildColor(std::vector<uint64_t> &eq, uint64_t eqid, BitVectorRRR *bv) {
+void MST::buildColor(std::vector<uint64_t> &eq, uint64_t eqid, const BitVectorRRR *bv) {
     if (eqid == zero) return;
-    /* colorMutex.lock();
-     if (lru_cache.contains(eqid)) {
-         eq = lru_cache[eqid];
-         gcntr++;
-         colorMutex.unlock();
-         return;
-     }
-     colorMutex.unlock();*/
     uint64_t i{0}, bitcnt{0}, wrdcnt{0};
     uint64_t offset = eqid % mantis::NUM_BV_BUFFER;
     while (i < numSamples) {
@@ -642,9 +752,6 @@ void MST::buildColor(std::vector<uint64_t> &eq, uint64_t eqid, BitVectorRRR *bv)
         eq[wrdcnt++] = wrd;
         i += bitcnt;
     }
-//    colorMutex.lock();
-//    lru_cache.emplace(eqid, eq);
-//    colorMutex.unlock();
 }
 
 /**
@@ -669,7 +776,8 @@ inline uint64_t MST::getBucketId(uint64_t c1, uint64_t c2) {
  * main function to call Color graph and MST construction and color class encoding and serializing
  */
 int build_mst_main(QueryOpts &opt) {
-    MST mst(opt.prefix, opt.console, opt.numThreads);
+    MST mst(opt.prefix, opt.console, opt.numThreads, opt.max_mst_depth, opt.mst_tmp_dir,
+            opt.mst_memory_mb << 20, opt.mst_color_memory_mb << 20, opt.mst_bucket_edges);
     mst.buildMST();
     if (opt.remove_colorClasses && !opt.keep_colorclasses) {
         for (auto &f : mantis::fs::GetFilesExt(opt.prefix.c_str(), mantis::EQCLASS_FILE)) {
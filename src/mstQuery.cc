@@ -2,7 +2,12 @@
 // Created by Fatemeh Almodaresi on 2018-10-15.
 //
 #include <fstream>
+#include <sstream>
 #include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <CLI/Timer.hpp>
 #include <canonicalKmer.h>
 #include <sparsepp/spp.h>
@@ -10,46 +15,166 @@
 #include "ProgOpts.h"
 #include "kmer.h"
 #include "mstQuery.h"
-
-void MSTQuery::loadIdx(std::string indexDir) {
-    sdsl::load_from_file(parentbv, indexDir + mantis::PARENTBV_FILE);
-    sdsl::load_from_file(deltabv, indexDir + mantis::DELTABV_FILE);
-    sdsl::load_from_file(bbv, indexDir + mantis::BOUNDARYBV_FILE);
-    sbbv = sdsl::bit_vector::select_1_type(&bbv);
+#include "sampleCounter.h"
+#include "bulkQuery.h"
+#include "sequenceReader.h"
+#include "kmerExtractor.h"
+#include "memoryPlan.h"
+
+MSTIndex::MSTIndex(const std::string &indexDir, spdlog::logger *logger, bool mapped) {
+    if (mapped) {
+        parentbv = mapVector(indexDir + mantis::PARENTBV_FILE, 0, logger);
+        deltabv = mapVector(indexDir + mantis::DELTABV_FILE, 0, logger);
+        bbv = mapVector(indexDir + mantis::BOUNDARYBV_FILE, 1, logger);
+        // one pass over the boundaries, which take a bit per delta
+        for (uint64_t pos = 0, seen = 0; pos < bbv.size(); pos += 64) {
+            uint64_t wrd = bbv.get_int(pos, std::min<uint64_t>(64, bbv.size() - pos));
+            for (; wrd; wrd &= wrd - 1, seen++) {
+                if (seen % SELECT_SAMPLE == 0) {
+                    selectSamples.push_back(pos + __builtin_ctzll(wrd));
+                }
+            }
+        }
+    } else {
+        sdsl::load_from_file(parents, indexDir + mantis::PARENTBV_FILE);
+        sdsl::load_from_file(deltas, indexDir + mantis::DELTABV_FILE);
+        sdsl::load_from_file(boundaries, indexDir + mantis::BOUNDARYBV_FILE);
+        sbbv = sdsl::bit_vector::select_1_type(&boundaries);
+        parentbv = PackedView(parents.data(), parents.size(), parents.width());
+        deltabv = PackedView(deltas.data(), deltas.size(), deltas.width());
+        bbv = PackedView(boundaries.data(), boundaries.size(), 1);
+    }
     zero = parentbv.size() - 1; // maximum color id which
-    logger->info("Loaded the new color class index");
+    logger->info(mapped ? "Mapped the new color class index" : "Loaded the new color class index");
     logger->info("\t--> parent size: {}", parentbv.size());
     logger->info("\t--> delta size: {}", deltabv.size());
     logger->info("\t--> boundary size: {}", bbv.size());
 }
 
-std::vector<uint64_t> MSTQuery::buildColor(uint64_t eqid, QueryStats &queryStats,
-                                           LRUCacheMap *lru_cache,
-                                           RankScores *rs,
-                                           nonstd::optional<uint64_t> &toDecode) {
+MSTIndex::~MSTIndex() {
+    for (auto &m : mappings) {
+        munmap(m.first, m.second);
+    }
+}
+
+PackedView MSTIndex::mapVector(const std::string &file, uint8_t fixedWidth, spdlog::logger *logger) {
+    int fd = open(file.c_str(), O_RDONLY);
+    struct stat sb;
+    if (fd < 0 or fstat(fd, &sb) < 0 or static_cast<size_t>(sb.st_size) < sizeof(uint64_t)) {
+        logger->error("Couldn't open the color class file {}.", file);
+        std::exit(1);
+    }
+    void *mapped = mmap(nullptr, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        logger->error("Couldn't mmap the color class file {}.", file);
+        std::exit(1);
+    }
+    mappings.emplace_back(mapped, sb.st_size);
+    // parents and deltas are read at random places, so readahead would only fill the memory
+    madvise(mapped, sb.st_size, MADV_RANDOM);
+    const uint64_t *words = static_cast<const uint64_t *>(mapped);
+    uint64_t bits = words[0] & ((1ULL << 56) - 1);
+    uint8_t width = fixedWidth ? fixedWidth : static_cast<uint8_t>(words[0] >> 56);
+    if (width == 0 or sizeof(uint64_t) * (1 + (bits + 63) / 64) > static_cast<size_t>(sb.st_size)) {
+        logger->error("The color class file {} is truncated.", file);
+        std::exit(1);
+    }
+    return PackedView(words + 1, bits / width, width);
+}
+
+uint64_t MSTIndex::sampledSelect(uint64_t i) const {
+    uint64_t pos = selectSamples[(i - 1) / SELECT_SAMPLE];
+    uint64_t left = (i - 1) % SELECT_SAMPLE; // set bits to skip after pos
+    while (left) {
+        pos++;
+        uint64_t len = std::min<uint64_t>(64, bbv.size() - pos);
+        uint64_t wrd = bbv.get_int(pos, len);
+        uint64_t cnt = __builtin_popcountll(wrd);
+        if (cnt < left) {
+            left -= cnt;
+            pos += len - 1;
+            continue;
+        }
+        for (; left > 1; left--) wrd &= wrd - 1;
+        return pos + __builtin_ctzll(wrd);
+    }
+    return pos;
+}
+
+/**
+ * XORs the delta list that starts at position from of deltabv into color.
+ * The end of the list is the next set bit of bbv, found a word at a time,
+ * and the packed deltas are then read sequentially straight from the words of deltabv.
+ * A delta list is sorted, so with a sample mask only the part spanned by the mask is read.
+ */
+void MSTQuery::xorDeltas(uint64_t from, ColorBitset &color) const {
+    const auto &bbv = index->bbv;
+    const auto &deltabv = index->deltabv;
+    uint64_t to = from;
+    while (true) {
+        uint64_t len = std::min<uint64_t>(64, bbv.size() - to);
+        uint64_t wrd = bbv.get_int(to, len);
+        if (wrd) {
+            to += __builtin_ctzll(wrd);
+            break;
+        }
+        to += len;
+    }
+
+    const uint64_t *deltas = deltabv.data();
+    uint64_t width = deltabv.width();
+    uint64_t mask = width == 64 ? ~0ULL : ((1ULL << width) - 1);
+    auto deltaAt = [deltas, width, mask](uint64_t idx) {
+        uint64_t pos = idx * width, w = pos >> 6, offset = pos & 63;
+        uint64_t delta = deltas[w] >> offset;
+        if (offset + width > 64) {
+            delta |= deltas[w + 1] << (64 - offset);
+        }
+        return delta & mask;
+    };
+    uint64_t end = to + 1;
+    if (sampleMask) {
+        auto lowerBound = [&deltaAt](uint64_t lo, uint64_t hi, uint64_t sample) {
+            while (lo < hi) {
+                uint64_t mid = lo + (hi - lo) / 2;
+                if (deltaAt(mid) < sample) lo = mid + 1; else hi = mid;
+            }
+            return lo;
+        };
+        from = lowerBound(from, end, sampleMask->first());
+        end = lowerBound(from, end, sampleMask->last() + 1);
+    }
+    uint64_t *dst = color.data();
+    for (uint64_t idx = from; idx < end; idx++) {
+        uint64_t delta = deltaAt(idx);
+        dst[delta >> 6] ^= (1ULL << (delta & 63));
+    }
+}
+
+void MSTQuery::buildColor(uint64_t eqid, QueryStats &queryStats,
+                          ColorCache *cache,
+                          RankScores *rs,
+                          nonstd::optional<uint64_t> &toDecode,
+                          ColorBitset &color) {
     (void) rs;
-    std::vector<uint32_t> flips(numSamples);
-    std::vector<uint32_t> xorflips(numSamples, 0);
-    uint64_t i{eqid}, from{0}, to{0};
+    const auto &parentbv = index->parentbv;
+    // the deltas on the path to the root (or to a cached ancestor) are XORed in the order they're met
+    color.reset(numSamples);
+    uint64_t i{eqid};
     int64_t height{0};
-    auto &froms = queryStats.buffer;
-    froms.clear();
     queryStats.totEqcls++;
     bool foundCache = false;
     uint32_t iparent = parentbv[i];
     while (iparent != i) {
-        //std::cerr << i << " " << iparent << "\n";
-        if (lru_cache and lru_cache->contains(i)) {
-            const auto &vs = (*lru_cache)[i];
-            for (auto v : vs) {
-                xorflips[v] = 1;
-            }
+        // the caller has already looked eqid itself up in the cache
+        if ((warmCache and warmCache->xorInto(i, color.data())) or
+            (cache and i != eqid and cache->xorAncestorInto(i, color.data()))) {
             queryStats.cacheCntr++;
             foundCache = true;
             break;
         }
-        from = (i > 0) ? (sbbv(i) + 1) : 0;
-        froms.push_back(from);
+        xorDeltas(index->deltaStart(i), color);
 
         if (queryStats.trySample) {
             auto &occ = queryStats.numOcc[iparent];
@@ -57,8 +182,9 @@ std::vector<uint64_t> MSTQuery::buildColor(uint64_t eqid, QueryStats &queryStats
             if ((!toDecode) and
                 (occ > 10) and
                 (height > 10) and
-                (lru_cache and
-                 !lru_cache->contains(iparent))) {
+                (cache and
+                 !cache->contains(iparent)) and
+                (!warmCache or !warmCache->contains(iparent))) {
                 toDecode = iparent;
             }
         }
@@ -67,393 +193,449 @@ std::vector<uint64_t> MSTQuery::buildColor(uint64_t eqid, QueryStats &queryStats
         ++queryStats.totSel;
         ++height;
     }
-    if (!foundCache and i != zero) {
-        from = (i > 0) ? (sbbv(i) + 1) : 0;
-        froms.push_back(from);
+    if (!foundCache and i != index->zero) {
+        xorDeltas(index->deltaStart(i), color);
         ++queryStats.totSel;
         queryStats.rootedNonZero++;
         ++height;
     }
-    uint64_t pctr{0};
-    //std::cerr << "\n\nnext step:\n";
-    for (auto f : froms) {
-        bool found = false;
-        uint64_t wrd{0};
-        uint64_t offset{0};
-        auto start = f;
-        //std::cerr << "\n" << start << ": ";
-        do {
-            wrd = bbv.get_int(start, 64);
-            for (uint64_t j = 0; j < 64; j++) {
-                //std::cerr << deltabv[start + j] << " ";
-                flips[deltabv[start + j]] ^= 0x01;
-                if ((wrd >> j) & 0x01) {
-                    found = true;
-                    break;
-                }
-            }
-            start += 64;
-        } while (!found);
+    queryStats.profile.recordDepth(height);
+    if (sampleMask) {
+        // drops what came in unmasked from the warm cache or from deltas next to the mask's samples
+        sampleMask->apply(color.data());
     }
+}
 
+std::vector<uint64_t> MSTQuery::buildColor(uint64_t eqid, QueryStats &queryStats,
+                                           ColorCache *cache,
+                                           RankScores *rs,
+                                           nonstd::optional<uint64_t> &toDecode) {
+    buildColor(eqid, queryStats, cache, rs, toDecode, queryStats.color);
     std::vector<uint64_t> eq;
-    eq.reserve(numWrds);
-    uint64_t one = 1;
-    for (i = 0; i < numSamples; i++) {
-        if (flips[i] ^ xorflips[i]) {
-            eq.push_back(i);
-        }
-    }
+    eq.reserve(queryStats.color.count());
+    queryStats.color.toList(eq);
     return eq;
 }
 
-void MSTQuery::findSamples(CQF<KeyObject> &dbg,
-                           LRUCacheMap &lru_cache,
-                           RankScores *rs,
-                           QueryStats &queryStats) {
-    mantis::EqMap query_eqclass_map;
-    std::unordered_set<uint64_t> query_eqclass_set;
-//    std::cerr << "\n\nkmer2cidMap size: " << kmer2cidMap.size() << "\n\n";
-    for (auto &kv : kmer2cidMap) {
-        KeyObject key(kv.first, 0, 0);
-//        std::cerr << std::string(dna::canonical_kmer(dbg.keybits()/2, key.key)) << "\n";
-        uint64_t eqclass = dbg.query(key, 0);
-        if (eqclass) {
-            kv.second = eqclass - 1;
-            query_eqclass_set.insert(eqclass - 1);
+void MSTQuery::lookupKmers(CQF<KeyObject> &dbg) {
+    for (auto it = kmer2cidMap.begin(); it != kmer2cidMap.end(); ++it) {
+        if (it->second == NOT_LOOKED_UP) {
+            KeyObject key(it->first, 0, 0);
+            uint64_t eqclass = dbg.query(key, 0);
+            it.value() = eqclass ? eqclass - 1 : ABSENT;
+        }
+        if (it->second != ABSENT) {
+            classCnt[it->second]++;
         }
     }
+}
 
-    mantis::QueryResult sample_map(queryStats.numSamples, 0);
+/**
+ * writes the color of eqclass_id to color, from the warm cache, the color cache or the MST,
+ * and offers colors decoded from the MST to the cache
+ */
+void MSTQuery::decodeClass(uint64_t eqclass_id, ColorBitset &color, ColorCache &cache,
+                           RankScores *rs, QueryStats &queryStats) {
     nonstd::optional<uint64_t> toDecode{nonstd::nullopt};
     nonstd::optional<uint64_t> dummy{nonstd::nullopt};
-
-    for (auto &it : query_eqclass_set) {
-        uint64_t eqclass_id = it;
-
-        std::vector<uint64_t> setbits;
-        if (lru_cache.contains(eqclass_id)) {
-            setbits = lru_cache[eqclass_id];//.get(eqclass_id);
-            queryStats.cacheCntr++;
-        } else {
-            queryStats.noCacheCntr++;
-            toDecode.reset();
-            dummy.reset();
-            queryStats.trySample = (queryStats.noCacheCntr % 10 == 0);
-            setbits = buildColor(eqclass_id, queryStats, &lru_cache, rs, toDecode);
-            lru_cache.emplace(eqclass_id, setbits);
-            if ((queryStats.trySample) and toDecode) {
-                auto s = buildColor(*toDecode, queryStats, nullptr, nullptr, dummy);
-                lru_cache.emplace(*toDecode, s);
-            }
-        }
-        cid2expMap[eqclass_id] = setbits;
-        /*for (auto sb : setbits) {
-            sample_map[sb] += count;
+    auto &setbits = queryStats.buffer;
+
+    color.reset(numSamples);
+    if (warmCache and warmCache->xorInto(eqclass_id, color.data())) {
+        queryStats.warmCntr++;
+        if (sampleMask) sampleMask->apply(color.data());
+    } else if (cache.xorInto(eqclass_id, color.data())) {
+        queryStats.cacheCntr++;
+    } else {
+        queryStats.noCacheCntr++;
+        queryStats.trySample = (queryStats.noCacheCntr % 10 == 0);
+        buildColor(eqclass_id, queryStats, &cache, rs, toDecode, color);
+        color.toList(setbits);
+        cache.put(eqclass_id, setbits);
+        if ((queryStats.trySample) and toDecode) {
+            buildColor(*toDecode, queryStats, nullptr, nullptr, dummy, queryStats.color);
+            queryStats.color.toList(setbits);
+            cache.put(*toDecode, setbits);
         }
+    }
+}
 
-        ++queryStats.globalQueryNum;*/
+void MSTQuery::findSamples(CQF<KeyObject> &dbg,
+                           ColorCache &cache,
+                           RankScores *rs,
+                           QueryStats &queryStats) {
+    {
+        PhaseTimer timer(queryStats.profile, QueryPhase::lookup);
+        lookupKmers(dbg);
+    }
+    PhaseTimer timer(queryStats.profile, QueryPhase::decode);
+    cid2slot.reserve(cid2slot.size() + classCnt.size());
+    for (auto &kv : classCnt) {
+        if (cid2slot.find(kv.first) != cid2slot.end()) continue;
+        decodeClass(kv.first, decoded, cache, rs, queryStats);
+        uint64_t slot = colors.add();
+        std::copy(decoded.data(), decoded.data() + numWrds, colors.color(slot));
+        cid2slot[kv.first] = slot;
     }
 }
 
+std::vector<uint64_t> MSTQuery::findSamplesAboveThreshold(CQF<KeyObject> &dbg,
+                                                          ColorCache &cache,
+                                                          RankScores *rs,
+                                                          QueryStats &queryStats,
+                                                          double theta,
+                                                          const uint64_t *candidates) {
+    {
+        PhaseTimer timer(queryStats.profile, QueryPhase::lookup);
+        lookupKmers(dbg);
+    }
+    // the most frequent colors decide most samples, so they go first
+    std::vector<std::pair<uint64_t, uint64_t>> classes(classCnt.begin(), classCnt.end());
+    std::sort(classes.begin(), classes.end(),
+              [](const std::pair<uint64_t, uint64_t> &c1, const std::pair<uint64_t, uint64_t> &c2) {
+                  return c1.second > c2.second;
+              });
+    uint64_t foundKmers{0};
+    for (auto &c : classes) {
+        foundKmers += c.second;
+    }
 
-void MSTQuery::parseKmers(std::string read, uint64_t kmer_size) {
-    //CLI::AutoTimer timer{"First round going over the file ", CLI::Timer::Big};
-    bool done = false;
-    while (!done and read.length() >= kmer_size) {
-        uint64_t first = 0;
-        uint64_t first_rev = 0;
-        uint64_t item = 0;
-        bool allNuclValid = true;
-        for (uint32_t i = 0; i < kmer_size; i++) { //First kmer
-            uint8_t curr = Kmer::map_base(read[i]);
-            if (curr > DNA_MAP::G) { // 'N' is encountered
-                if (i + 1 < read.length())
-                    read = read.substr(i + 1);
-                else
-                    done = true; // you've reached the end of a sequence (last nucl. is N)
-                allNuclValid = false;
-                break;
-            }
-            first = first | curr;
-            first = first << 2;
+    if (!candidates and sampleMask) {
+        candidates = sampleMask->data();
+    }
+    ThresholdFilter filter(numSamples, kmer2cidMap.size(), theta, foundKmers, candidates);
+    for (auto &c : classes) {
+        if (filter.done()) {
+            queryStats.skippedClasses++;
+            continue;
         }
-        if (allNuclValid) {
-            first = first >> 2;
-            first_rev = static_cast<uint64_t >(Kmer::reverse_complement(first, kmer_size));
-
-            //cout << "kmer: "; cout << int_to_str(first);
-            //cout << " reverse-comp: "; cout << int_to_str(first_rev) << endl;
-
-            if (Kmer::compare_kmers(first, first_rev))
-                item = first;
-            else
-                item = first_rev;
-            kmer2cidMap[item] = std::numeric_limits<uint64_t>::max();
-
-            uint64_t next = (first << 2) & BITMASK(2 * kmer_size);
-            uint64_t next_rev = first_rev >> 2;
-            uint64_t i = 0;
-            for (i = kmer_size; i < read.length(); i++) { //next kmers
-                //cout << "K: " << read.substr(i-K+1,K) << endl;
-                uint8_t curr = Kmer::map_base(read[i]);
-                if (curr > DNA_MAP::G) { // 'N' is encountered
-                    if (i + 1 < read.length())
-                        read = read.substr(i + 1);
-                    else
-                        done = true;
-                    break;
-                }
-                next |= curr;
-                auto tmp = static_cast<uint64_t>(Kmer::reverse_complement_base(curr));
-                tmp <<= (kmer_size * 2 - 2);
-                next_rev = next_rev | tmp;
-                if (Kmer::compare_kmers(next, next_rev))
-                    item = next;
-                else
-                    item = next_rev;
-                kmer2cidMap[item] = std::numeric_limits<uint64_t>::max();
-                next = (next << 2) & BITMASK(2 * kmer_size);
-                next_rev = next_rev >> 2;
-            }
-            if (i == read.length()) done = true;
+        {
+            PhaseTimer timer(queryStats.profile, QueryPhase::decode);
+            decodeClass(c.first, decoded, cache, rs, queryStats);
         }
+        PhaseTimer timer(queryStats.profile, QueryPhase::count);
+        filter.add(decoded.data(), c.second);
     }
+    return filter.accepted();
 }
 
-mantis::QueryResult MSTQuery::convertIndexK2QueryK(std::string &read) {
-    mantis::QueryResult res(numSamples, 0);
-    spp::sparse_hash_set<uint64_t> readkmers;
-    auto requiredCnt = static_cast<uint8_t>(queryK - indexK + 1);
-    uint16_t queryIndxKDiff = static_cast<uint16_t>(queryK - indexK + 1);
-    bool done = false;
-    while (!done and read.length() >= queryK) {
-        uint64_t idx2replace = 0;
-        std::vector<uint8_t> samples(numSamples, 0);
-        std::vector<std::vector<bool>> pastKmers(queryIndxKDiff);
-        for (auto &v : pastKmers) {
-            v.resize(numSamples, false);
-        }
-        uint64_t first = 0;
-        uint64_t first_rev = 0;
-        uint64_t item = 0;
-        bool allNuclValid = true;
-        for (uint32_t i = 0; i < indexK; i++) { //First kmer
-            uint8_t curr = Kmer::map_base(read[i]);
-            if (curr > DNA_MAP::G) { // 'N' is encountered
-                if (i + 1 < read.length())
-                    read = read.substr(i + 1);
-                else
-                    done = true; // you've reached the end of a sequence (last nucl. is N)
-                allNuclValid = false;
-                break;
-            }
-            first = first | curr;
-            first = first << 2;
-        }
-        if (allNuclValid) {
-            first = first >> 2;
-            first_rev = static_cast<uint64_t >(Kmer::reverse_complement(first, indexK));
-            item = Kmer::compare_kmers(first, first_rev) ? first : first_rev;
-            pastKmers[idx2replace].assign(pastKmers[idx2replace].size(), false);
-            if (kmer2cidMap[item] != std::numeric_limits<uint64_t>::max()) {
-                for (auto &c : cid2expMap[kmer2cidMap[item]]) {
-                    samples[c]++;
-                    pastKmers[idx2replace][c] = true;
-                }
-            }
-            uint64_t next = (first << 2) & BITMASK(2 * indexK);
-            uint64_t next_rev = first_rev >> 2;
-
-            for (uint64_t i = indexK; i < queryK; i++) { //next kmers
-                idx2replace = ++idx2replace % queryIndxKDiff;
-                uint8_t curr = Kmer::map_base(read[i]);
-                if (curr > DNA_MAP::G) { // 'N' is encountered
-                    if (i + 1 < read.length())
-                        read = read.substr(i + 1);
-                    else
-                        done = true;
-                    allNuclValid = false;
-                    break;
-                }
-                first = first << 2;
-                first |= curr;
-
-                next |= curr;
-                auto tmp = static_cast<uint64_t>(Kmer::reverse_complement_base(curr));
-                tmp <<= (indexK * 2 - 2);
-                next_rev = next_rev | tmp;
-                item = Kmer::compare_kmers(next, next_rev) ? next : next_rev;
-                if (kmer2cidMap[item] != std::numeric_limits<uint64_t>::max()) {
-                    for (auto &c : cid2expMap[kmer2cidMap[item]]) {
-                        samples[c]++;
-                        pastKmers[idx2replace][c] = true;
-                    }
-                }
-                next = (next << 2) & BITMASK(2 * indexK);
-                next_rev = next_rev >> 2;
-            }
-            if (allNuclValid) {
-                idx2replace = 0;
-                uint64_t i = 0;
-                uint64_t queryKmer = first, queryKmer_rev, queryItem; // to keep count of **unique** kmers
-                for (i = queryK; i < read.length(); i++) { //next kmers
-                    queryKmer_rev = static_cast<uint64_t >(Kmer::reverse_complement(queryKmer, queryK));
-                    queryItem = Kmer::compare_kmers(queryKmer, queryKmer_rev) ? queryKmer : queryKmer_rev;
-                    bool kmerNotFound = readkmers.find(queryItem) == readkmers.end();
-                    for (auto c = 0; c < samples.size(); c++) {
-                        if (kmerNotFound and samples[c] == requiredCnt) {
-                            res[c]++;
-                        }
-                        if (pastKmers[idx2replace][c]) {
-                            samples[c]--;
-                        }
-                        pastKmers[idx2replace][c] = false;
-                    }
-                    readkmers.insert(queryItem);
-                    uint8_t curr = Kmer::map_base(read[i]);
-                    if (curr > DNA_MAP::G) { // 'N' is encountered
-                        if (i + 1 < read.length())
-                            read = read.substr(i + 1);
-                        else
-                            done = true;
-                        break;
-                    }
-                    queryKmer <<= 2;
-                    queryKmer |= curr;
-                    queryKmer &= BITMASK(2 * queryK);
-
-                    next |= curr;
-                    auto tmp = static_cast<uint64_t>(Kmer::reverse_complement_base(curr));
-                    tmp <<= (indexK * 2 - 2);
-                    next_rev = next_rev | tmp;
-                    item = Kmer::compare_kmers(next, next_rev) ? next : next_rev;
-                    if (kmer2cidMap[item] != std::numeric_limits<uint64_t>::max()) {
-                        for (auto &c : cid2expMap[kmer2cidMap[item]]) {
-                            samples[c]++;
-                            pastKmers[idx2replace][c] = true;
-                        }
-                    }
-                    idx2replace = ++idx2replace % queryIndxKDiff;
-                    next = (next << 2) & BITMASK(2 * indexK);
-                    next_rev = next_rev >> 2;
-                }
-                if (i == read.length()) {
-                    queryKmer_rev = static_cast<uint64_t >(Kmer::reverse_complement(queryKmer, queryK));
-                    queryItem = Kmer::compare_kmers(queryKmer, queryKmer_rev) ? queryKmer : queryKmer_rev;
-                    bool kmerNotFound = readkmers.find(queryItem) == readkmers.end();
-                    for (auto c = 0; c < samples.size(); c++) {
-                        if (kmerNotFound and samples[c] == requiredCnt) {
-                            res[c]++;
-                        }
-                    }
-                    readkmers.insert(queryItem);
-                    done = true;
-                }
-            }
+/** the number of distinct k-mers of read, which a screened query draws its k-mers from */
+static uint64_t numDistinctKmers(const std::string &read, uint64_t k) {
+    tsl::hopscotch_set<uint64_t> readKmers;
+    mantis::KmerExtractor(k).forEach(read, [&readKmers](uint64_t kmer) { readKmers.insert(kmer); });
+    return readKmers.size();
+}
+
+std::vector<uint64_t> MSTQuery::screenAboveThreshold(const std::string &read,
+                                                     CQF<KeyObject> &dbg,
+                                                     ColorCache &cache,
+                                                     RankScores *rs,
+                                                     QueryStats &queryStats,
+                                                     double theta,
+                                                     bool refine,
+                                                     SampleBounds &bounds) {
+    findSamples(dbg, cache, rs, queryStats);
+    mantis::QueryResult counts;
+    {
+        PhaseTimer timer(queryStats.profile, QueryPhase::count);
+        counts = getResultList();
+    }
+    // both sides count distinct k-mers, as the estimate is over the distinct k-mers of the read
+    uint64_t sampled = kmer2cidMap.size();
+    containmentBounds(counts, sampled, numDistinctKmers(read, indexK), bounds);
+
+    std::vector<uint64_t> accepted;
+    std::vector<uint64_t> uncertain(numWrds, 0);
+    uint64_t numUncertain{0};
+    uint64_t minCount = ThresholdFilter::minCountFor(theta, sampled);
+    for (uint64_t s = 0; s < numSamples; s++) {
+        if (sampleMask and !sampleMask->contains(s)) continue;
+        if (!refine) {
+            if (counts[s] >= minCount) accepted.push_back(s);
+        } else if (bounds.low[s] >= theta) {
+            accepted.push_back(s);
+        } else if (bounds.high[s] >= theta) {
+            uncertain[s / 64] |= 1ULL << (s % 64);
+            numUncertain++;
         }
     }
-//    std::cerr << "\n";
-    return res;
+    if (!numUncertain) {
+        return accepted;
+    }
+    queryStats.refinedQueries++;
+    queryStats.refinedSamples += numUncertain;
+    reset();
+    {
+        PhaseTimer timer(queryStats.profile, QueryPhase::parse);
+        parseAllKmers(read, indexK);
+    }
+    auto exact = findSamplesAboveThreshold(dbg, cache, rs, queryStats, theta, uncertain.data());
+    accepted.insert(accepted.end(), exact.begin(), exact.end());
+    std::sort(accepted.begin(), accepted.end());
+    return accepted;
 }
 
-void MSTQuery::reset() {
-    kmer2cidMap.clear();
-    cid2expMap.clear();
+
+void MSTQuery::parseKmers(const std::string &read, uint64_t kmer_size) {
+    if (sampler.enabled()) {
+        sampler.forEach(read, [this](uint64_t kmer) {
+            kmer2cidMap[kmer] = NOT_LOOKED_UP;
+        });
+        return;
+    }
+    parseAllKmers(read, kmer_size);
 }
 
-mantis::QueryResult MSTQuery::getResultList() {
-    mantis::QueryResult res(numSamples, 0);
-    for (auto& kv : kmer2cidMap) {
-        if (kv.second != std::numeric_limits<uint64_t>::max()) {
-            for (auto &c : cid2expMap[kv.second]) {
-                res[c]++;
-            }
-        }
+void MSTQuery::parseAllKmers(const std::string &read, uint64_t kmer_size) {
+    if (unitigs and kmer_size == unitigs->kmerSize()) {
+        // the color classes are known once parsed, so lookupKmers only counts them
+        unitigLookups += unitigs->forEach(read, [this](uint64_t kmer, uint64_t eqid) {
+            kmer2cidMap[kmer] = eqid == UnitigTable::NOT_FOUND ? ABSENT : eqid;
+            unitigKmers++;
+        });
+        return;
     }
-    return res;
+    mantis::KmerExtractor(kmer_size).forEach(read, [this](uint64_t kmer) {
+        kmer2cidMap[kmer] = NOT_LOOKED_UP;
+    });
 }
 
-void output_results(MSTQuery &mstQuery,
-                    std::ofstream &opfile,
-                    std::vector<std::string> &sampleNames,
-                    QueryStats &queryStats) {
-    //CLI::AutoTimer timer{"Second round going over the file + query time ", CLI::Timer::Big};
-    opfile << "seq" << queryStats.cnt++ << '\t' << mstQuery.getNumOfDistinctKmers() << '\n';
-    mantis::QueryResult result = mstQuery.getResultList();
-    for (uint64_t i = 0; i < result.size(); i++) {
-        if (result[i] > 0) {
-            opfile << sampleNames[i] << '\t' << result[i] << '\n';
+/**
+ * ANDs the colors of a window of index k-mers into acc, over words [begin, end)
+ * @return false if no sample has all the k-mers of the window
+ */
+static bool andWindow(const std::vector<const uint64_t *> &window, uint64_t begin, uint64_t end,
+                      ColorBitset &acc) {
+    for (auto color : window) {
+        if (!color) return false;
+    }
+    uint64_t *dst = acc.data();
+    std::copy(window[0] + begin, window[0] + end, dst + begin);
+    for (uint64_t j = 1; j < window.size(); j++) {
+        const uint64_t *src = window[j];
+        uint64_t any{0};
+        // plain word loop, so the compiler vectorizes it
+        for (uint64_t w = begin; w < end; w++) {
+            dst[w] &= src[w];
+            any |= dst[w];
         }
+        if (!any) return false;
     }
+    return true;
 }
 
-void output_results_json(MSTQuery &mstQuery,
-                         std::ofstream &opfile,
-                         std::vector<std::string> &sampleNames,
-                         QueryStats &queryStats,
-                         uint64_t nquery) {
-    uint64_t qctr{0};
-    //CLI::AutoTimer timer{"Query time ", CLI::Timer::Big};
-    opfile << "{ \"qnum\": " << queryStats.cnt++ << ",  \"num_kmers\": "
-           << mstQuery.getNumOfDistinctKmers() << ", \"res\": {\n";
-    mantis::QueryResult result = mstQuery.getResultList();
-    uint64_t kmerCntr = 0;
-    for (auto it = result.begin(); it != result.end(); ++it) {
-        if (*it > 0)
-            opfile << " \"" << sampleNames[kmerCntr] << "\": " << *it;
-        if (std::next(it) != result.end()) {
-            opfile << ",\n";
+/**
+ * counts, for each sample, the distinct query k-mers of read all of whose index k-mers are in the sample.
+ * The colors of the last queryK - indexK + 1 index k-mers are kept in a ring of pointers into colors,
+ * and a query k-mer is in the samples of the AND of all of them.
+ */
+mantis::QueryResult MSTQuery::convertIndexK2QueryK(const std::string &read) {
+    uint64_t windowSize = queryK - indexK + 1;
+    std::vector<const uint64_t *> window(windowSize, nullptr);
+    uint64_t begin{0}, end{numWrds};
+    SampleCounter counter(numSamples);
+    if (sampleMask) {
+        begin = sampleMask->firstWord();
+        end = sampleMask->endWord();
+        counter.restrictTo(begin, end);
+    }
+    ColorBitset acc(numSamples);
+    tsl::hopscotch_set<uint64_t> readKmers;
+    auto colorOf = [this](uint64_t kmer) -> const uint64_t * {
+        auto it = kmer2cidMap.find(kmer);
+        if (it == kmer2cidMap.end() or it->second == NOT_LOOKED_UP or it->second == ABSENT) {
+            return nullptr;
+        }
+        auto cit = cid2slot.find(it->second);
+        return cit == cid2slot.end() ? nullptr : colors.color(cit->second);
+    };
+
+    uint64_t run{0}; // number of valid bases since the last 'N'
+    mantis::RollingKmer indexKmer(indexK), queryKmer(queryK);
+    mantis::forEachBase(read.data(), read.size(), [&](uint8_t code) {
+        run++;
+        indexKmer.push(code);
+        queryKmer.push(code);
+        if (run < indexK) return;
+        window[(run - indexK) % windowSize] = colorOf(indexKmer.canonical());
+        // count each distinct query k-mer once
+        if (run < queryK or !readKmers.insert(queryKmer.canonical()).second) return;
+        if (andWindow(window, begin, end, acc)) {
+            counter.add(acc.data(), 1);
         }
-        kmerCntr++;
+    }, [&run]() { run = 0; });
+    return std::move(counter.counts());
+}
+
+void MSTQuery::reset() {
+    mantis::clearTable(kmer2cidMap);
+    mantis::clearTable(classCnt);
+    mantis::clearTable(cid2slot);
+    colors.clear();
+}
+
+mantis::QueryResult MSTQuery::getResultList() {
+    // classCnt holds the k-mers of each color class, so each color is added once
+    SampleCounter counter(numSamples);
+    if (sampleMask) {
+        counter.restrictTo(sampleMask->firstWord(), sampleMask->endWord());
     }
-    opfile << "}}";
-    if (qctr < nquery - 1) {
-        opfile << ",";
+    for (auto &kv : classCnt) {
+        auto it = cid2slot.find(kv.first);
+        if (it == cid2slot.end()) continue;
+        const uint64_t *color = colors.color(it->second);
+        if (!sampleMask or sampleMask->intersects(color)) {
+            counter.add(color, kv.second);
+        }
     }
-    opfile << "\n";
-    ++qctr;
+    return std::move(counter.counts());
 }
-void output_results(std::string &read,
-                    MSTQuery &mstQuery,
-                    std::ofstream &opfile,
-                    std::vector<std::string> &sampleNames,
-                    QueryStats &queryStats) {
-    opfile << "seq" << queryStats.cnt++ << '\t' << read.length() << '\n';
-    mantis::QueryResult result = mstQuery.convertIndexK2QueryK(read);
-    for (uint64_t i = 0; i < result.size(); i++) {
-        if (result[i] > 0) {
-            opfile << sampleNames[i] << '\t' << result[i] << '\n';
+
+/**
+ * answers one query sequence and writes its result with writer
+ * @param theta if not 0, only the samples containing this fraction of the k-mers are written
+ * @param refine with a sampler set on mstQuery, decide the samples too close to theta over all the k-mers
+ * With a sampler set, the containment bounds of the samples reported are written too.
+ */
+void query_read(std::string &read,
+                const std::string &name,
+                MSTQuery &mstQuery,
+                CQF<KeyObject> &cqf,
+                ColorCache &cache,
+                RankScores &rs,
+                ResultWriter &writer,
+                QueryStats &queryStats,
+                double theta,
+                bool refine) {
+    auto &profile = queryStats.profile;
+    profile.beginQuery();
+    {
+        PhaseTimer timer(profile, QueryPhase::parse);
+        mstQuery.reset();
+        mstQuery.parseKmers(read, mstQuery.indexK);
+    }
+    bool screening = mstQuery.getSampler().enabled();
+    if (screening) {
+        queryStats.sampledKmers += mstQuery.getNumOfDistinctKmers();
+    }
+    SampleBounds bounds;
+    if (theta > 0) {
+        // refining parses the read again, so the number of k-mers reported is taken first
+        uint64_t numKmers = mstQuery.getNumOfDistinctKmers();
+        auto samples = screening ?
+                       mstQuery.screenAboveThreshold(read, cqf, cache, &rs, queryStats, theta, refine, bounds) :
+                       mstQuery.findSamplesAboveThreshold(cqf, cache, &rs, queryStats, theta);
+        {
+            PhaseTimer timer(profile, QueryPhase::output);
+            writer.writeSamples(queryStats.cnt++, name, numKmers, samples, screening ? &bounds : nullptr);
+        }
+        profile.endQuery();
+        return;
+    }
+    mstQuery.findSamples(cqf, cache, &rs, queryStats);
+    mantis::QueryResult result;
+    uint64_t numKmers;
+    {
+        PhaseTimer timer(profile, QueryPhase::count);
+        if (mstQuery.indexK == mstQuery.queryK) {
+            result = mstQuery.getResultList();
+            numKmers = mstQuery.getNumOfDistinctKmers();
+        } else {
+            result = mstQuery.convertIndexK2QueryK(read);
+            numKmers = read.length();
+        }
+        if (screening) {
+            containmentBounds(result, numKmers, numDistinctKmers(read, mstQuery.indexK), bounds);
         }
     }
+    {
+        PhaseTimer timer(profile, QueryPhase::output);
+        writer.writeCounts(queryStats.cnt++, name, numKmers, result, screening ? &bounds : nullptr);
+    }
+    profile.endQuery();
 }
 
-void output_results_json(std::string &read,
+/**
+ * answers all the queries of reads at once: the distinct k-mers of all of them are looked up
+ * once and every distinct color class is decoded once, using numThreads threads
+ */
+void output_bulk_results(std::vector<std::string> &reads,
+                         const std::vector<std::string> &names,
                          MSTQuery &mstQuery,
-                         std::ofstream &opfile,
+                         CQF<KeyObject> &cqf,
+                         ColorCache &cache,
+                         ResultWriter &writer,
                          std::vector<std::string> &sampleNames,
                          QueryStats &queryStats,
-                         uint64_t nquery) {
-    uint64_t qctr{0};
-    //CLI::AutoTimer timer{"Query time ", CLI::Timer::Big};
-    opfile << "{ \"qnum\": " << queryStats.cnt++ << ",  \"num_kmers\": "
-           << read.length() << ", \"res\": {\n";
-    mantis::QueryResult result = mstQuery.convertIndexK2QueryK(read);
-    uint64_t kmerCntr = 0;
-    for (auto it = result.begin(); it != result.end(); ++it) {
-        if (*it > 0)
-            opfile << " \"" << sampleNames[kmerCntr] << "\": " << *it;
-        if (std::next(it) != result.end()) {
-            opfile << ",\n";
-        }
-        kmerCntr++;
+                         uint32_t numThreads,
+                         const SampleMask *mask,
+                         spdlog::logger *logger) {
+    numThreads = std::max<uint32_t>(1, numThreads);
+    // bulk mode answers no query on its own, so each phase is timed as a whole
+    auto &profile = queryStats.profile;
+    PhaseTimer parseTimer(profile, QueryPhase::parse);
+    mantis::QuerySets queries(reads.size());
+    // screened queries report the containment of the samples out of all their k-mers
+    bool screening = mstQuery.getSampler().enabled();
+    std::vector<uint64_t> totals(screening ? reads.size() : 0);
+    std::vector<std::unique_ptr<MSTQuery>> parsers;
+    for (uint32_t t = 0; t < numThreads; t++) {
+        // only parse, so they don't need the warm cache or the mask
+        parsers.emplace_back(new MSTQuery(mstQuery.getIndex(), mstQuery.indexK, mstQuery.queryK,
+                                          sampleNames.size(), logger));
+        parsers.back()->setSampler(mstQuery.getSampler());
     }
-    opfile << "}}";
-    if (qctr < nquery - 1) {
-        opfile << ",";
+    mantis::parallel_for(reads.size(), numThreads, [&](uint64_t i, uint32_t t) {
+        parsers[t]->reset();
+        parsers[t]->parseKmers(reads[i], mstQuery.indexK);
+        parsers[t]->collectKmers(queries[i]);
+        if (screening) totals[i] = numDistinctKmers(reads[i], mstQuery.indexK);
+    }, 16);
+    parsers.clear();
+    BulkKmerTable table(queries, numThreads);
+    parseTimer.stop();
+
+    std::vector<uint64_t> classes;
+    {
+        PhaseTimer timer(profile, QueryPhase::lookup);
+        table.assignClasses([&cqf](mantis::KmerHash k) { return cqf.query(KeyObject(k, 0, 0), 0); });
+        classes = table.classes();
     }
-    opfile << "\n";
-    ++qctr;
+    logger->info("{} distinct k-mers in {} distinct color classes", table.size(), classes.size());
+
+    // classes hold the CQF counts, which are the color class ids plus one
+    ColorArena colors(sampleNames.size());
+    colors.assign(classes.size());
+    uint64_t numWords = (sampleNames.size() + 63) / 64;
+    std::vector<QueryStats> threadStats(numThreads);
+    std::vector<ColorBitset> decoded(numThreads);
+    for (auto &s : threadStats) {
+        s.numSamples = sampleNames.size();
+    }
+    PhaseTimer decodeTimer(profile, QueryPhase::decode);
+    mantis::parallel_for(classes.size(), numThreads, [&](uint64_t i, uint32_t t) {
+        mstQuery.decodeClass(classes[i] - 1, decoded[t], cache, nullptr, threadStats[t]);
+        std::copy(decoded[t].data(), decoded[t].data() + numWords, colors.color(i));
+    });
+    decodeTimer.stop();
+    for (auto &s : threadStats) {
+        profile.merge(s.profile);
+        queryStats.cacheCntr += s.cacheCntr;
+        queryStats.noCacheCntr += s.noCacheCntr;
+        queryStats.warmCntr += s.warmCntr;
+        queryStats.totSel += s.totSel;
+        queryStats.totEqcls += s.totEqcls;
+        queryStats.rootedNonZero += s.rootedNonZero;
+    }
+    auto colorOf = [&](uint64_t c) {
+        return colors.color(std::lower_bound(classes.begin(), classes.end(), c) - classes.begin());
+    };
+
+    // counting and writing are interleaved block by block
+    PhaseTimer countTimer(profile, QueryPhase::count);
+    assembleBulkResults(queries, table, sampleNames.size(), numThreads, colorOf, writer, names, mask,
+                        screening ? &totals : nullptr);
+    queryStats.cnt += reads.size();
 }
 
 std::vector<std::string> loadSampleFile(const std::string &sampleFileAddr) {
@@ -488,84 +670,189 @@ int mst_query_main(QueryOpts &opt) {
     queryStats.numSamples = sampleNames.size();
     logger->info("Number of experiments: {}", queryStats.numSamples);
 
+    MemoryPlan plan = MemoryPlan::choose(opt.prefix, true, opt.max_memory_mb << 20, opt.lazy_colors,
+                                         opt.cache_budget_mb << 20, logger);
     logger->info("Loading cqf...");
-    CQF<KeyObject> cqf(dbg_file, CQF_FREAD);
+    CQF<KeyObject> cqf(dbg_file, plan.mapCqf ? CQF_MMAP : CQF_FREAD);
     auto indexK = cqf.keybits() / 2;
     if (queryK == 0) queryK = indexK;
     logger->info("Done loading cqf. k is {}", indexK);
+    if (opt.theta > 0 and queryK != indexK) {
+        logger->error("Threshold queries need the query k ({}) to be the k of the index ({}).",
+                      queryK, indexK);
+        std::exit(1);
+    }
+    mantis::KmerSampler sampler(indexK, opt.sample_rate, opt.minimizer_window);
+    if (sampler.enabled() and queryK != indexK) {
+        logger->error("Screening queries needs the query k ({}) to be the k of the index ({}).",
+                      queryK, indexK);
+        std::exit(1);
+    }
 
     logger->info("Loading color classes...");
-    MSTQuery mstQuery(opt.prefix, indexK, queryK, queryStats.numSamples, logger);
+    MSTQuery mstQuery(std::make_shared<const MSTIndex>(opt.prefix, logger, plan.lazyColors), indexK, queryK,
+                      queryStats.numSamples, logger);
     logger->info("Done Loading color classes. Total # of color classes is {}",
-                 mstQuery.parentbv.size() - 1);
+                 mstQuery.numColorClasses());
+
+    WarmColorCache warmCache;
+    std::string warmFile(opt.prefix + mantis::WARMCACHE_FILE);
+    if (opt.load_cache and
+        warmCache.load(warmFile, queryStats.numSamples, UnitigTable::fingerprint(cqf), logger)) {
+        mstQuery.setWarmCache(&warmCache);
+    }
+    UnitigTable unitigs;
+    if (opt.use_unitigs and unitigs.load(opt.prefix + mantis::UNITIG_FILE, cqf, logger)) {
+        mstQuery.setUnitigs(&unitigs);
+    }
+    mstQuery.setSampler(sampler);
+    std::unique_ptr<SampleMask> sampleMask;
+    if (!opt.samples_file.empty()) {
+        sampleMask.reset(new SampleMask(SampleMask::load(opt.samples_file, sampleNames, logger)));
+        mstQuery.setSampleMask(sampleMask.get());
+    }
 
     logger->info("Querying colored dbg.");
-    std::ofstream opfile(opt.output);
-    LRUCacheMap cache_lru(100000);
+    ResultFormat format{ResultFormat::tsv};
+    parseResultFormat(opt.format, format);
+    std::ofstream opfile(opt.output, std::ios::binary);
+    auto writer = ResultWriter::create(format, opfile, sampleNames, "seq", opt.theta > 0, sampler.enabled());
+    ColorCache cache(queryStats.numSamples, plan.cacheBudget);
     RankScores rs(1);
-    std::ifstream ipfile(opt.query_file);
-    std::string read;
+    // the next batch of queries is read while the current one is answered
+    SequenceBatchReader input;
+    if (!input.open(opt.query_file)) {
+        logger->error("Couldn't open the query file {}.", opt.query_file);
+        std::exit(1);
+    }
+    std::vector<SequenceRecord> batch;
     uint64_t numOfQueries{0};
     CLI::AutoTimer timer{"query time ", CLI::Timer::Big};
     if (opt.process_in_bulk) {
-        while (ipfile >> read) {
-            mstQuery.parseKmers(read, indexK);
-            numOfQueries++;
-        }
-        mstQuery.findSamples(cqf, cache_lru, &rs, queryStats);
-        ipfile.clear();
-        ipfile.seekg(0, ios::beg);
-        if (opt.use_json) {
-            opfile << "[\n";
-            while (ipfile >> read) {
-                output_results_json(read, mstQuery, opfile, sampleNames, queryStats, numOfQueries);
+        std::vector<std::string> reads, names;
+        while (input.next(batch)) {
+            for (auto &record : batch) {
+                reads.push_back(std::move(record.seq));
+                names.push_back(std::move(record.name));
             }
-            opfile << "]\n";
+        }
+        numOfQueries = reads.size();
+        if (queryK == indexK) {
+            output_bulk_results(reads, names, mstQuery, cqf, cache, *writer, sampleNames, queryStats,
+                                opt.numThreads, sampleMask.get(), logger);
         } else {
-            while (ipfile >> read) {
-                output_results(read, mstQuery, opfile, sampleNames, queryStats);
+            // the k-mers of the index are only combined into query k-mers read by read
+            {
+                PhaseTimer timer(queryStats.profile, QueryPhase::parse);
+                for (auto &read : reads) {
+                    mstQuery.parseKmers(read, indexK);
+                }
+            }
+            mstQuery.findSamples(cqf, cache, &rs, queryStats);
+            PhaseTimer timer(queryStats.profile, QueryPhase::count);
+            for (uint64_t i = 0; i < reads.size(); i++) {
+                writer->writeCounts(queryStats.cnt++, names[i], reads[i].length(),
+                                    mstQuery.convertIndexK2QueryK(reads[i]));
             }
         }
     } else {
-        if (opt.use_json) {
-            opfile << "[\n";
-            while (ipfile >> read) {
-                mstQuery.reset();
-                mstQuery.parseKmers(read, indexK);
-                mstQuery.findSamples(cqf, cache_lru, &rs, queryStats);
-                if (mstQuery.indexK == mstQuery.queryK)
-                    output_results_json(mstQuery, opfile, sampleNames, queryStats, numOfQueries);
-                else
-                    output_results_json(read, mstQuery, opfile, sampleNames, queryStats, numOfQueries);
-                numOfQueries++;
-            }
-            opfile << "]\n";
-        } else {
-            while (ipfile >> read) {
-                mstQuery.reset();
-                mstQuery.parseKmers(read, indexK);
-                mstQuery.findSamples(cqf, cache_lru, &rs, queryStats);
-                if (mstQuery.indexK == mstQuery.queryK)
-                    output_results(mstQuery, opfile, sampleNames, queryStats);
-                else
-                    output_results(read, mstQuery, opfile, sampleNames, queryStats);
+        while (input.next(batch)) {
+            for (auto &record : batch) {
+                query_read(record.seq, record.name, mstQuery, cqf, cache, rs, *writer, queryStats, opt.theta,
+                           opt.refine);
                 numOfQueries++;
             }
         }
     }
+    if (!input.error().empty()) {
+        logger->error("Failed to read the queries: {}", input.error());
+        std::exit(1);
+    }
+    writer->finish();
     opfile.close();
     logger->info("Writing done.");
 
-    logger->info("cache was used {} times and not used {} times",
-                 queryStats.cacheCntr, queryStats.noCacheCntr);
-    logger->info("total selects = {}, time per select = {}",
-                 queryStats.totSel, queryStats.selectTime.count() / queryStats.totSel);
+    logger->info("cache was used {} times and not used {} times, {} colors came from the warm cache",
+                 queryStats.cacheCntr, queryStats.noCacheCntr, queryStats.warmCntr);
+    auto cacheStats = cache.stats();
+    logger->info("color cache: {} hits, {} misses, {} evictions, {} rejected, {} entries in {} bytes",
+                 cacheStats.hits, cacheStats.misses, cacheStats.evictions, cacheStats.rejections,
+                 cacheStats.entries, cacheStats.bytes);
+    logger->info("color cache: {} of {} ancestors probed while decoding were cached",
+                 cacheStats.ancestorHits, cacheStats.ancestorProbes);
+    if (mstQuery.numUnitigKmers()) {
+        logger->info("unitigs: {} of {} k-mers were looked up, the others followed their unitig",
+                     mstQuery.numUnitigLookups(), mstQuery.numUnitigKmers());
+    }
+    logger->info("total selects = {}", queryStats.totSel);
     logger->info("total # of queries = {}, total # of queries rooted at a non-zero node = {}",
                  queryStats.totEqcls, queryStats.rootedNonZero);
-/*
-    logger->info("select time was {}s, flip time was {}",
-            queryStats.selectTime.count(), queryStats.flipTime.count());
-*/
+    if (opt.theta > 0) {
+        logger->info("{} color classes didn't need decoding to answer the threshold queries",
+                     queryStats.skippedClasses);
+    }
+    if (sampler.enabled()) {
+        logger->info("screening: {} k-mers queried, {} queries with {} samples refined over all their k-mers",
+                     queryStats.sampledKmers, queryStats.refinedQueries, queryStats.refinedSamples);
+    }
+    if (queryStats.profile.queryLatency().count()) {
+        logger->info("query latency: {}", queryStats.profile.queryLatency().summary());
+    }
+    if (!opt.stats_file.empty()) {
+        std::ostringstream decode, colorCache;
+        decode << "{\"classes\": " << queryStats.totEqcls
+               << ", \"warm_cache_hits\": " << queryStats.warmCntr
+               << ", \"cache_hits\": " << queryStats.cacheCntr
+               << ", \"decoded\": " << queryStats.noCacheCntr
+               << ", \"selects\": " << queryStats.totSel
+               << ", \"rooted_non_zero\": " << queryStats.rootedNonZero
+               << ", \"skipped_classes\": " << queryStats.skippedClasses << "}";
+        colorCache << "{\"hits\": " << cacheStats.hits
+                   << ", \"misses\": " << cacheStats.misses
+                   << ", \"evictions\": " << cacheStats.evictions
+                   << ", \"rejections\": " << cacheStats.rejections
+                   << ", \"ancestor_probes\": " << cacheStats.ancestorProbes
+                   << ", \"ancestor_hits\": " << cacheStats.ancestorHits
+                   << ", \"entries\": " << cacheStats.entries
+                   << ", \"bytes\": " << cacheStats.bytes << "}";
+        std::vector<std::pair<std::string, std::string>> fields{{"encoding", "\"mst\""},
+                                                                {"queries", std::to_string(numOfQueries)},
+                                                                {"profile", queryStats.profile.toJson()},
+                                                                {"decode", decode.str()},
+                                                                {"color_cache", colorCache.str()}};
+        if (sampler.enabled()) {
+            std::ostringstream screen;
+            screen << "{\"sampled_kmers\": " << queryStats.sampledKmers
+                   << ", \"refined_queries\": " << queryStats.refinedQueries
+                   << ", \"refined_samples\": " << queryStats.refinedSamples << "}";
+            fields.emplace_back("screen", screen.str());
+        }
+        if (writeJsonSummary(opt.stats_file, fields)) {
+            logger->info("Wrote the query statistics to {}", opt.stats_file);
+        } else {
+            logger->error("Failed to write the query statistics to {}", opt.stats_file);
+        }
+    }
+
+    if (opt.save_cache) {
+        // keep what was warm before and add everything that is hot in this run
+        std::vector<std::pair<uint64_t, std::vector<uint64_t>>> colors;
+        std::unordered_set<uint64_t> seen;
+        cache.forEach([&colors, &seen](uint64_t eqid, const std::vector<uint64_t> &setbits) {
+            colors.emplace_back(eqid, setbits);
+            seen.insert(eqid);
+        });
+        warmCache.forEach([&colors, &seen](uint64_t eqid, const std::vector<uint64_t> &setbits) {
+            if (seen.find(eqid) == seen.end()) {
+                colors.emplace_back(eqid, setbits);
+            }
+        });
+        if (WarmColorCache::write(warmFile, queryStats.numSamples, UnitigTable::fingerprint(cqf), colors)) {
+            logger->info("Saved {} decoded color classes to {}", colors.size(), warmFile);
+        } else {
+            logger->error("Failed to save the color cache to {}", warmFile);
+        }
+    }
 /*for (auto &kv : queryStats.numOcc) {
     std::cout << kv.first << '\t' << kv.second << '\n';
 }*/
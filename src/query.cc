@@ -18,6 +18,7 @@
 #include <queue>
 #include <set>
 #include <unordered_set>
+#include <sstream>
 #include <set>
 #include <bitset>
 #include <cassert>
@@ -44,110 +45,84 @@
 #include "CLI/CLI.hpp"
 #include "CLI/Timer.hpp"
 #include "mantisconfig.hpp"
+#include "bulkQuery.h"
+#include "resultWriter.h"
+#include "memoryPlan.h"
 
-void output_results(mantis::QuerySets& multi_kmers,
-										ColoredDbg<SampleObject<CQF<KeyObject>*>, KeyObject>&
-										cdbg, std::ofstream& opfile, bool is_bulk,
-                    std::unordered_map<mantis::KmerHash, uint64_t> &uniqueKmers) {
-  mantis::QueryResults qres;
-  // LH: `cnt` is a counter for the number of queries completed. 
-  // LH: Max value is the number of lines in the query file.
-	uint32_t cnt= 0;
-  {
-    CLI::AutoTimer timer{"Query time ", CLI::Timer::Big};
-    if (is_bulk) {
-        std::unordered_map<uint64_t, std::vector<uint64_t>> result = cdbg.find_samples(uniqueKmers);
-        for (auto& kmers : multi_kmers) {
-            opfile <<  cnt++ << '\t' << kmers.size() << '\n';
-            std::vector<uint64_t> kmerCnt(cdbg.get_num_samples());
-            for (auto &k : kmers) {
-                if (uniqueKmers[k]) {
-                    for (auto experimentId : result[k]) {
-                        kmerCnt[experimentId]++;
-                    }
-                }
-            }
-            for (auto i=0; i<kmerCnt.size(); ++i) {
-                if (kmerCnt[i] > 0)
-                    opfile << cdbg.get_sample(i) << '\t' << kmerCnt[i] << '\n';
-            }
-            //++qctr;
-        }
-    } else {
-        for (auto &kmers : multi_kmers) {
-            //std::sort(kmers.begin(), kmers.end());
-            opfile << cnt++ << '\t' << kmers.size() << '\n';
-            mantis::QueryResult result = cdbg.find_samples(kmers);
-            for (auto i = 0; i < result.size(); ++i) {
-                if (result[i] > 0)
-                    opfile << cdbg.get_sample(i) << '\t' << result[i] << '\n';
-            }
-            //++qctr;
-        }
+/**
+ * writes, for each query, the samples containing at least a fraction theta of its k-mers
+ */
+void output_threshold_results(mantis::QuerySets& multi_kmers,
+                              ColoredDbg<SampleObject<CQF<KeyObject>*>, KeyObject>&
+                              cdbg, const std::vector<std::string>& names, ResultWriter& writer,
+                              double theta, QueryProfile& profile) {
+  uint32_t cnt= 0;
+  CLI::AutoTimer timer{"Query time ", CLI::Timer::Big};
+  for (auto &kmers : multi_kmers) {
+    profile.beginQuery();
+    std::vector<uint64_t> samples = cdbg.find_samples_above(kmers, theta);
+    {
+      PhaseTimer output_timer(profile, QueryPhase::output);
+      writer.writeSamples(cnt, names[cnt], kmers.size(), samples);
+      cnt++;
     }
+    profile.endQuery();
   }
 }
 
-void output_results_json(mantis::QuerySets& multi_kmers,
-												 ColoredDbg<SampleObject<CQF<KeyObject>*>, KeyObject>&
-												 cdbg, std::ofstream& opfile, bool is_bulk,
-                         std::unordered_map<mantis::KmerHash, uint64_t> &uniqueKmers) {
-  mantis::QueryResults qres;
+/**
+ * answers all the queries at once: every distinct k-mer of the file is looked up once
+ * and every distinct color class is extracted once, using numThreads threads
+ */
+void output_bulk_results(mantis::QuerySets& multi_kmers,
+                         const std::vector<std::string>& names,
+                         ColoredDbg<SampleObject<CQF<KeyObject>*>, KeyObject>& cdbg,
+                         ResultWriter& writer, uint32_t numThreads,
+                         const SampleMask* mask, QueryProfile& profile, spdlog::logger* console) {
+  CLI::AutoTimer timer{"Query time ", CLI::Timer::Big};
+  // bulk mode answers no query on its own, so each phase is timed as a whole
+  PhaseTimer lookup_timer(profile, QueryPhase::lookup);
+  BulkKmerTable table(multi_kmers, numThreads);
+  table.assignClasses([&cdbg](mantis::KmerHash k) { return cdbg.get_eqclass(k); });
+  std::vector<uint64_t> classes = table.classes();
+  lookup_timer.stop();
+  console->info("{} distinct k-mers in {} distinct color classes", table.size(), classes.size());
+
+  uint64_t num_samples = cdbg.get_num_samples();
+  uint64_t num_words = (num_samples + 63) / 64;
+  std::vector<uint64_t> rows(classes.size() * num_words, 0);
+  PhaseTimer decode_timer(profile, QueryPhase::decode);
+  mantis::parallel_for(classes.size(), numThreads, [&](uint64_t i, uint32_t) {
+    cdbg.get_color_row(classes[i], rows.data() + i * num_words);
+  });
+  decode_timer.stop();
+  auto colorOf = [&](uint64_t eqclass) {
+    uint64_t i = std::lower_bound(classes.begin(), classes.end(), eqclass) - classes.begin();
+    return rows.data() + i * num_words;
+  };
+
+  // counting and writing are interleaved block by block
+  PhaseTimer count_timer(profile, QueryPhase::count);
+  assembleBulkResults(multi_kmers, table, num_samples, numThreads, colorOf, writer, names, mask);
+}
+
+void output_results(mantis::QuerySets& multi_kmers,
+										ColoredDbg<SampleObject<CQF<KeyObject>*>, KeyObject>&
+										cdbg, const std::vector<std::string>& names, ResultWriter& writer,
+										QueryProfile& profile) {
+  // LH: `cnt` is a counter for the number of queries completed.
+  // LH: Max value is the number of lines in the query file.
 	uint32_t cnt= 0;
-  {
-    CLI::AutoTimer timer{"Query time ", CLI::Timer::Big};
-
-    opfile << "[\n";
-      size_t qctr{0};
-      size_t nquery{multi_kmers.size()};
-
-      if (is_bulk) {
-          std::unordered_map<uint64_t, std::vector<uint64_t>> result = cdbg.find_samples(uniqueKmers);
-          for (auto& kmers : multi_kmers) {
-              opfile << "{ \"qnum\": " << cnt++ << ",  \"num_kmers\": " << kmers.size() << ", \"res\": {\n";
-              std::vector<uint64_t> kmerCnt(cdbg.get_num_samples());
-              for (auto &k : kmers) {
-                  if (uniqueKmers[k]) {
-                      for (auto experimentId : result[k]) {
-                          kmerCnt[experimentId]++;
-                      }
-                  }
-              }
-              for (auto i=0; i<kmerCnt.size(); ++i) {
-                  if (kmerCnt[i] > 0) {
-                          opfile << " \"" << cdbg.get_sample(i) << "\": " << kmerCnt[i];
-                      if (i != kmerCnt.size()) {
-                          opfile << ",\n";
-                      }
-                  }
-              }
-              opfile << "}}";
-              if (qctr < nquery - 1) { opfile << ","; }
-              opfile << "\n";
-              ++qctr;
-          }
-      }
-      else {
-          for (auto &kmers : multi_kmers) {
-              //std::sort(kmers.begin(), kmers.end());
-              opfile << "{ \"qnum\": " << cnt++ << ",  \"num_kmers\": " << kmers.size() << ", \"res\": {\n";
-              mantis::QueryResult result = cdbg.find_samples(kmers);
-              uint64_t sampleCntr = 0;
-              for (auto it = result.begin(); it != result.end(); ++it) {
-                  if (*it > 0)
-                      opfile << " \"" << cdbg.get_sample(sampleCntr) << "\": " << *it;
-                  if (std::next(it) != result.end()) {
-                      opfile << ",\n";
-                  }
-                  sampleCntr++;
-              }
-              opfile << "}}";
-              if (qctr < nquery - 1) { opfile << ","; }
-              opfile << "\n";
-              ++qctr;
-          }
-      }
-    opfile << "]\n";
+  CLI::AutoTimer timer{"Query time ", CLI::Timer::Big};
+  for (auto &kmers : multi_kmers) {
+    profile.beginQuery();
+    mantis::QueryResult result = cdbg.find_samples(kmers);
+    {
+      PhaseTimer output_timer(profile, QueryPhase::output);
+      writer.writeCounts(cnt, names[cnt], kmers.size(), result);
+      cnt++;
+    }
+    profile.endQuery();
   }
 }
 
@@ -165,7 +140,8 @@ int query_main (QueryOpts& opt)
   std::string prefix = opt.prefix;
   std::string query_file = opt.query_file;
   std::string output_file = opt.output;//{"samples.output"};
-  bool use_json = opt.use_json;
+  ResultFormat format{ResultFormat::tsv};
+  parseResultFormat(opt.format, format);
 
   // Make sure the prefix is a full folder
   if (prefix.back() != '/') {
@@ -184,14 +160,30 @@ int query_main (QueryOpts& opt)
 	std::vector<std::string> eqclass_files = mantis::fs::GetFilesExt(prefix.c_str(),
                                                                    mantis::EQCLASS_FILE);
 
+	MemoryPlan plan = MemoryPlan::choose(prefix, false, opt.max_memory_mb << 20, opt.lazy_colors,
+	                                     opt.cache_budget_mb << 20, console);
 	ColoredDbg<SampleObject<CQF<KeyObject>*>, KeyObject> cdbg(dbg_file,
 																														eqclass_files,
 																														sample_file,
-																														MANTIS_DBG_IN_MEMORY);
+																														plan.mapCqf ? MANTIS_DBG_ON_DISK :
+																														MANTIS_DBG_IN_MEMORY,
+																														plan.lazyColors,
+																														plan.colorBudget);
+	cdbg.set_console(console);
 	uint64_t kmer_size = cdbg.get_cqf()->keybits() / 2;
   console->info("Read colored dbg with {} k-mers and {} color classes",
                 cdbg.get_cqf()->dist_elts(), cdbg.get_num_bitvectors());
 
+	// the sample names are looked up once rather than for every result
+	std::vector<std::string> sample_names(cdbg.get_num_samples());
+	for (uint64_t i = 0; i < sample_names.size(); i++)
+		sample_names[i] = cdbg.get_sample(i);
+	std::unique_ptr<SampleMask> sample_mask;
+	if (!opt.samples_file.empty()) {
+		sample_mask.reset(new SampleMask(SampleMask::load(opt.samples_file, sample_names, console)));
+		cdbg.set_sample_mask(sample_mask.get());
+	}
+
 	//cdbg.get_cqf()->dump_metadata(); 
 	//CQF<KeyObject> cqf(query_file, false);
 	//CQF<KeyObject>::Iterator it = cqf.begin(1);
@@ -209,27 +201,81 @@ int query_main (QueryOpts& opt)
 	uint32_t seed = 2038074743;
   // LH: `total_kmers` is the sum of kmers to query across all queries
 	uint64_t total_kmers = 0;
-    std::unordered_map<mantis::KmerHash, uint64_t> uniqueKmers;
+    mantis::QueryMap uniqueKmers;
   // LH: `multi_kmers` is a list of list. There are {number of lines in query file} lists.
   // LH: Each list contains the kmers for a query.
+	QueryProfile profile;
+	cdbg.set_profile(&profile);
+	PhaseTimer parse_timer(profile, QueryPhase::parse);
+	std::vector<std::string> query_names;
 	mantis::QuerySets multi_kmers = Kmer::parse_kmers(query_file.c_str(),
 																										kmer_size,
 																										total_kmers,
-																										opt.process_in_bulk,
-																										uniqueKmers);
+																										false, // bulk mode dedups in parallel
+																										uniqueKmers,
+																										&query_names);
+	parse_timer.stop();
 	console->info("Total k-mers to query: {}", total_kmers);
 
-	std::ofstream opfile(output_file);
+	// queries one at a time decode the same frequent color classes over and over, while the bulk
+	// and threshold queries decode each class once or only the parts of it they need
+	std::unique_ptr<ColorCache> cache;
+	if (opt.theta <= 0 and !opt.process_in_bulk) {
+		cache.reset(new ColorCache(cdbg.get_num_samples(), plan.cacheBudget));
+		cdbg.set_color_cache(cache.get());
+	}
+
+	std::ofstream opfile(output_file, std::ios::binary);
+	auto writer = ResultWriter::create(format, opfile, sample_names, "", opt.theta > 0);
 	console->info("Querying the colored dbg.");
 
-  if (use_json) {
-    output_results_json(multi_kmers, cdbg, opfile, opt.process_in_bulk, uniqueKmers);
-  } else {
-    output_results(multi_kmers, cdbg, opfile, opt.process_in_bulk, uniqueKmers);
+  // with --lazy, a color class block that can't be read fails the query
+  try {
+    if (opt.theta > 0) {
+      output_threshold_results(multi_kmers, cdbg, query_names, *writer, opt.theta, profile);
+    } else if (opt.process_in_bulk) {
+      output_bulk_results(multi_kmers, query_names, cdbg, *writer, opt.numThreads, sample_mask.get(),
+                          profile, console);
+    } else {
+      output_results(multi_kmers, cdbg, query_names, *writer, profile);
+    }
+  } catch (const std::runtime_error &e) {
+    console->error("Query failed: {}", e.what());
+    std::exit(1);
   }
 	//std::cout << "Writing samples and abundances out." << std::endl;
+	writer->finish();
 	opfile.close();
 	console->info("Writing done.");
 
+  ColorCacheStats cacheStats;
+  if (cache) {
+    cacheStats = cache->stats();
+    console->info("color cache: {} hits, {} misses, {} evictions, {} rejected, {} entries in {} bytes",
+                  cacheStats.hits, cacheStats.misses, cacheStats.evictions, cacheStats.rejections,
+                  cacheStats.entries, cacheStats.bytes);
+  }
+  if (profile.queryLatency().count())
+    console->info("query latency: {}", profile.queryLatency().summary());
+  if (!opt.stats_file.empty()) {
+    std::vector<std::pair<std::string, std::string>> fields{{"encoding", "\"color_classes\""},
+                                                            {"queries", std::to_string(multi_kmers.size())},
+                                                            {"profile", profile.toJson()}};
+    if (cache) {
+      std::ostringstream colorCache;
+      colorCache << "{\"hits\": " << cacheStats.hits
+                 << ", \"misses\": " << cacheStats.misses
+                 << ", \"evictions\": " << cacheStats.evictions
+                 << ", \"rejections\": " << cacheStats.rejections
+                 << ", \"entries\": " << cacheStats.entries
+                 << ", \"bytes\": " << cacheStats.bytes << "}";
+      fields.emplace_back("color_cache", colorCache.str());
+    }
+    if (writeJsonSummary(opt.stats_file, fields))
+      console->info("Wrote the query statistics to {}", opt.stats_file);
+    else
+      console->error("Failed to write the query statistics to {}", opt.stats_file);
+  }
+
 	return EXIT_SUCCESS;
 }				/* ----------  end of function main  ---------- */
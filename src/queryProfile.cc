@@ -0,0 +1,155 @@
+//
+// Instrumentation of the query pipeline: per-phase timers, latency histograms and a JSON summary.
+//
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "queryProfile.h"
+
+uint32_t LatencyHistogram::bucketOf(uint64_t ns) {
+    if (ns < (1ULL << SUB_BITS)) {
+        return static_cast<uint32_t>(ns);
+    }
+    uint32_t shift = 63 - __builtin_clzll(ns) - SUB_BITS;
+    uint64_t sub = (ns >> shift) & ((1ULL << SUB_BITS) - 1);
+    return ((shift + 1) << SUB_BITS) | static_cast<uint32_t>(sub);
+}
+
+uint64_t LatencyHistogram::bucketEnd(uint32_t bucket) {
+    if (bucket < (1U << SUB_BITS)) {
+        return bucket;
+    }
+    uint32_t shift = (bucket >> SUB_BITS) - 1;
+    uint64_t mantissa = (1ULL << SUB_BITS) | (bucket & ((1U << SUB_BITS) - 1));
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    buckets[bucketOf(ns)]++;
+    cnt++;
+    sum += ns;
+    max = std::max(max, ns);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+    for (uint32_t b = 0; b < NUM_BUCKETS; b++) {
+        buckets[b] += other.buckets[b];
+    }
+    cnt += other.cnt;
+    sum += other.sum;
+    max = std::max(max, other.max);
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    if (!cnt) return 0;
+    auto rank = static_cast<uint64_t>(p * (cnt - 1)) + 1;
+    uint64_t seen{0};
+    for (uint32_t b = 0; b < NUM_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank) {
+            return std::min(bucketEnd(b), max);
+        }
+    }
+    return max;
+}
+
+std::string LatencyHistogram::toJson() const {
+    std::ostringstream out;
+    out << "{\"count\": " << cnt
+        << ", \"mean_us\": " << (cnt ? sum / 1000.0 / cnt : 0.0)
+        << ", \"p50_us\": " << percentile(0.5) / 1000.0
+        << ", \"p99_us\": " << percentile(0.99) / 1000.0
+        << ", \"p999_us\": " << percentile(0.999) / 1000.0
+        << ", \"max_us\": " << max / 1000.0 << "}";
+    return out.str();
+}
+
+std::string LatencyHistogram::summary() const {
+    std::ostringstream out;
+    out << "p50 " << percentile(0.5) / 1000.0 << "us, p99 " << percentile(0.99) / 1000.0
+        << "us, p999 " << percentile(0.999) / 1000.0 << "us";
+    return out.str();
+}
+
+const char *QueryProfile::phaseName(QueryPhase phase) {
+    switch (phase) {
+        case QueryPhase::parse: return "parse";
+        case QueryPhase::lookup: return "lookup";
+        case QueryPhase::decode: return "decode";
+        case QueryPhase::count: return "count";
+        case QueryPhase::output: return "output";
+    }
+    return "unknown";
+}
+
+void QueryProfile::beginQuery() {
+    inQuery = true;
+    inSample = sampleEvery and (queryCntr++ % sampleEvery == 0);
+    queryStart = clock::now();
+}
+
+void QueryProfile::endQuery() {
+    latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - queryStart).count());
+    for (uint32_t p = 0; p < NUM_PHASES; p++) {
+        if (inSample) {
+            phases[p].record(current[p]);
+            phaseTotals[p] += current[p];
+        }
+        current[p] = 0;
+    }
+    inQuery = false;
+    inSample = false;
+}
+
+void QueryProfile::addPhase(QueryPhase phase, uint64_t ns) {
+    auto p = static_cast<uint32_t>(phase);
+    if (inQuery) {
+        current[p] += ns;
+    } else {
+        phaseTotals[p] += ns;
+    }
+}
+
+void QueryProfile::merge(const QueryProfile &other) {
+    for (uint32_t p = 0; p < NUM_PHASES; p++) {
+        phases[p].merge(other.phases[p]);
+        phaseTotals[p] += other.phaseTotals[p];
+    }
+    latency.merge(other.latency);
+    for (uint32_t d = 0; d <= MAX_DEPTH; d++) {
+        depths[d] += other.depths[d];
+    }
+}
+
+std::string QueryProfile::toJson() const {
+    std::ostringstream out;
+    out << "{\"query_latency\": " << latency.toJson()
+        << ", \"phase_sample_every\": " << sampleEvery
+        << ", \"phases\": {";
+    for (uint32_t p = 0; p < NUM_PHASES; p++) {
+        out << (p ? ", \"" : "\"") << phaseName(static_cast<QueryPhase>(p)) << "\": {\"measured_ms\": "
+            << phaseTotals[p] / 1e6 << ", \"per_query\": " << phases[p].toJson() << "}";
+    }
+    out << "}, \"mst_decode_depth\": [";
+    // trailing empty depths are left out
+    uint32_t end = MAX_DEPTH + 1;
+    while (end > 0 and !depths[end - 1]) end--;
+    for (uint32_t d = 0; d < end; d++) {
+        out << (d ? ", " : "") << depths[d];
+    }
+    out << "]}";
+    return out.str();
+}
+
+bool writeJsonSummary(const std::string &file, const std::vector<std::pair<std::string, std::string>> &fields) {
+    std::ofstream out(file);
+    if (!out.is_open()) return false;
+    out << "{";
+    for (uint64_t i = 0; i < fields.size(); i++) {
+        out << (i ? ",\n \"" : "\"") << fields[i].first << "\": " << fields[i].second;
+    }
+    out << "}\n";
+    return out.good();
+}
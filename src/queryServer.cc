@@ -0,0 +1,306 @@
+//
+// Query server keeping an MST index resident and answering batches over a UNIX domain socket.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <sstream>
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "queryServer.h"
+#include "memoryPlan.h"
+
+namespace {
+    std::atomic<bool> stopRequested{false};
+
+    void onStopSignal(int) {
+        stopRequested = true;
+    }
+
+    bool sendAll(int fd, const std::string &data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+}
+
+void LatencyRecorder::record(double ms) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (window.size() < WINDOW) {
+        window.push_back(ms);
+    } else {
+        window[next] = ms;
+    }
+    next = (next + 1) % WINDOW;
+    cnt++;
+    total += ms;
+    max = std::max(max, ms);
+}
+
+std::string LatencyRecorder::toJson() const {
+    std::vector<double> sorted;
+    uint64_t n;
+    double sum, mx;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        sorted = window;
+        n = cnt;
+        sum = total;
+        mx = max;
+    }
+    std::sort(sorted.begin(), sorted.end());
+    auto pct = [&sorted](double p) {
+        return sorted.empty() ? 0.0 : sorted[static_cast<uint64_t>(p * (sorted.size() - 1))];
+    };
+    std::ostringstream out;
+    out << "{\"count\": " << n
+        << ", \"mean\": " << (n ? sum / n : 0.0)
+        << ", \"p50\": " << pct(0.5)
+        << ", \"p99\": " << pct(0.99)
+        << ", \"max\": " << mx << "}";
+    return out.str();
+}
+
+QueryServer::QueryServer(ServeOpts &optIn) : opt(optIn), logger(optIn.console.get()) {
+    if (opt.prefix.back() != '/') {
+        opt.prefix.push_back('/');
+    }
+    sampleNames = loadSampleFile(opt.prefix + mantis::SAMPLEID_FILE);
+    logger->info("Number of experiments: {}", sampleNames.size());
+
+    MemoryPlan plan = MemoryPlan::choose(opt.prefix, true, opt.max_memory_mb << 20, opt.lazy_colors,
+                                         opt.cache_budget_mb << 20, logger);
+    logger->info("Loading cqf...");
+    std::string dbg_file(opt.prefix + mantis::CQF_FILE);
+    cqf.reset(new CQF<KeyObject>(dbg_file, plan.mapCqf ? CQF_MMAP : CQF_FREAD));
+    indexK = cqf->keybits() / 2;
+    queryK = opt.k ? opt.k : indexK;
+    logger->info("Done loading cqf. k is {}", indexK);
+
+    logger->info("Loading color classes...");
+    index = std::make_shared<const MSTIndex>(opt.prefix, logger, plan.lazyColors);
+    logger->info("Done Loading color classes. Total # of color classes is {}",
+                 index->numColorClasses());
+
+    if (opt.load_cache) {
+        useWarmCache = warmCache.load(opt.prefix + mantis::WARMCACHE_FILE, sampleNames.size(),
+                                      UnitigTable::fingerprint(*cqf), logger);
+    }
+    cache.reset(new ColorCache(sampleNames.size(), plan.cacheBudget));
+}
+
+int QueryServer::run() {
+    if (opt.socket.size() >= sizeof(sockaddr_un::sun_path)) {
+        logger->error("Socket path {} is too long.", opt.socket);
+        return EXIT_FAILURE;
+    }
+    struct stat sb;
+    if (stat(opt.socket.c_str(), &sb) == 0) {
+        if (!S_ISSOCK(sb.st_mode)) {
+            logger->error("{} exists and is not a socket.", opt.socket);
+            return EXIT_FAILURE;
+        }
+        // left over by a server that didn't shut down cleanly
+        unlink(opt.socket.c_str());
+    }
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        logger->error("Couldn't create a socket: {}", std::strerror(errno));
+        return EXIT_FAILURE;
+    }
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, opt.socket.c_str(), sizeof(addr.sun_path) - 1);
+    if (bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 or
+        listen(listenFd, SOMAXCONN) < 0) {
+        logger->error("Couldn't listen on {}: {}", opt.socket, std::strerror(errno));
+        close(listenFd);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onStopSignal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    std::vector<std::thread> workers;
+    for (uint32_t t = 0; t < std::max<uint32_t>(1, opt.numThreads); t++) {
+        workers.emplace_back(&QueryServer::worker, this);
+    }
+    logger->info("Serving queries on {} with {} workers", opt.socket, workers.size());
+
+    pollfd pfd{listenFd, POLLIN, 0};
+    while (!stopRequested) {
+        // wake up regularly to notice a stop request
+        int ready = poll(&pfd, 1, 200);
+        if (ready <= 0) continue;
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) continue;
+        connections++;
+        std::lock_guard<std::mutex> lock(queueMtx);
+        pending.push_back(fd);
+        queueCv.notify_one();
+    }
+
+    logger->info("Shutting down...");
+    close(listenFd);
+    unlink(opt.socket.c_str());
+    {
+        std::lock_guard<std::mutex> lock(queueMtx);
+        stopping = true;
+        for (auto fd : pending) {
+            close(fd);
+        }
+        pending.clear();
+        // unblocks the workers waiting on their clients
+        for (auto fd : active) {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    queueCv.notify_all();
+    for (auto &t : workers) {
+        t.join();
+    }
+    logger->info("Server statistics: {}", statsJson());
+    return EXIT_SUCCESS;
+}
+
+void QueryServer::worker() {
+    // each worker has its own query state over the shared index, CQF and caches
+    MSTQuery mstQuery(index, indexK, queryK, sampleNames.size(), logger);
+    if (useWarmCache) {
+        mstQuery.setWarmCache(&warmCache);
+    }
+    QueryStats queryStats;
+    queryStats.numSamples = sampleNames.size();
+    RankScores rs(1);
+    while (true) {
+        int fd;
+        {
+            std::unique_lock<std::mutex> lock(queueMtx);
+            queueCv.wait(lock, [this] { return stopping or !pending.empty(); });
+            if (stopping) return;
+            fd = pending.front();
+            pending.pop_front();
+            active.insert(fd);
+        }
+        serveConnection(fd, mstQuery, queryStats, rs);
+        {
+            std::lock_guard<std::mutex> lock(queueMtx);
+            active.erase(fd);
+        }
+        close(fd);
+    }
+}
+
+void QueryServer::serveConnection(int fd, MSTQuery &mstQuery, QueryStats &queryStats,
+                                  RankScores &rs) {
+    bool use_json{false};
+    std::vector<std::string> reads;
+    std::string buffer;
+    char chunk[1 << 16];
+    while (true) {
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 and errno == EINTR) continue;
+        if (n <= 0) break;
+        buffer.append(chunk, n);
+        size_t start = 0, end;
+        while ((end = buffer.find('\n', start)) != std::string::npos) {
+            std::string line = buffer.substr(start, end - start);
+            start = end + 1;
+            if (!line.empty() and line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.empty()) {
+                if (!answerBatch(fd, reads, use_json, mstQuery, queryStats, rs)) return;
+            } else if (line[0] == '#') {
+                if (line == "#json") {
+                    use_json = true;
+                } else if (line == "#tsv") {
+                    use_json = false;
+                } else if (line == "#stats") {
+                    if (!sendAll(fd, statsJson() + "\n\n")) return;
+                }
+            } else {
+                reads.push_back(std::move(line));
+            }
+        }
+        buffer.erase(0, start);
+    }
+    // the client closed its side, answer what is left
+    if (!buffer.empty()) {
+        reads.push_back(buffer);
+    }
+    if (!reads.empty()) {
+        answerBatch(fd, reads, use_json, mstQuery, queryStats, rs);
+    }
+}
+
+bool QueryServer::answerBatch(int fd, std::vector<std::string> &reads, bool use_json,
+                              MSTQuery &mstQuery, QueryStats &queryStats, RankScores &rs) {
+    auto start = std::chrono::steady_clock::now();
+    std::ostringstream out;
+    // results are numbered from 0 in every batch, as in a `mantis query` output
+    queryStats.cnt = 0;
+    auto writer = ResultWriter::create(use_json ? ResultFormat::json : ResultFormat::tsv, out, sampleNames,
+                                       "seq", false);
+    for (uint64_t i = 0; i < reads.size(); i++) {
+        query_read(reads[i], "", mstQuery, *cqf, *cache, rs, *writer, queryStats);
+    }
+    writer->finish();
+    out << "\n";
+    bool ok = sendAll(fd, out.str());
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    latency.record(elapsed.count());
+    batches++;
+    queries += reads.size();
+    reads.clear();
+    return ok;
+}
+
+std::string QueryServer::statsJson() {
+    uint64_t queued, busy;
+    {
+        std::lock_guard<std::mutex> lock(queueMtx);
+        queued = pending.size();
+        busy = active.size();
+    }
+    auto cacheStats = cache->stats();
+    std::ostringstream out;
+    out << "{\"queue_depth\": " << queued
+        << ", \"active_connections\": " << busy
+        << ", \"connections\": " << connections.load()
+        << ", \"batches\": " << batches.load()
+        << ", \"queries\": " << queries.load()
+        << ", \"batch_latency_ms\": " << latency.toJson()
+        << ", \"cache_hits\": " << cacheStats.hits
+        << ", \"cache_misses\": " << cacheStats.misses << "}";
+    return out.str();
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  main
+ *  Description:  loads an MST index once and answers queries over a UNIX domain socket
+ * ============================================================================
+ */
+int serve_main(ServeOpts &opt) {
+    QueryServer server(opt);
+    return server.run();
+}
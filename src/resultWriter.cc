@@ -0,0 +1,521 @@
+//
+// Writers of query results in TSV, JSON and a compact binary format, and a reader of the latter.
+//
+
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "ProgOpts.h"
+#include "resultWriter.h"
+
+namespace {
+    void appendNumber(std::string &s, uint64_t n) {
+        char digits[20];
+        auto res = std::to_chars(digits, digits + sizeof(digits), n);
+        s.append(digits, res.ptr - digits);
+    }
+
+    void appendU32(std::string &s, uint32_t n) {
+        char bytes[4];
+        for (uint32_t i = 0; i < 4; i++) bytes[i] = static_cast<char>(n >> (8 * i));
+        s.append(bytes, 4);
+    }
+
+    /** a fraction in [0, 1], to four decimals */
+    void appendFraction(std::string &s, double x) {
+        char digits[24];
+        auto res = std::to_chars(digits, digits + sizeof(digits), x, std::chars_format::fixed, 4);
+        s.append(digits, res.ptr - digits);
+    }
+
+    void appendFloat(std::string &s, float x) {
+        uint32_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        appendU32(s, bits);
+    }
+
+    void appendU64(std::string &s, uint64_t n) {
+        char bytes[8];
+        for (uint32_t i = 0; i < 8; i++) bytes[i] = static_cast<char>(n >> (8 * i));
+        s.append(bytes, 8);
+    }
+
+    uint64_t decodeLE(const unsigned char *bytes, uint32_t len) {
+        uint64_t n{0};
+        for (uint32_t i = 0; i < len; i++) n |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+        return n;
+    }
+
+    float decodeFloat(const unsigned char *bytes) {
+        uint32_t bits = decodeLE(bytes, 4);
+        float x;
+        std::memcpy(&x, &bits, sizeof(x));
+        return x;
+    }
+
+    std::string jsonString(const std::string &s) {
+        std::string res("\"");
+        for (char c : s) {
+            if (c == '"' or c == '\\') {
+                res += '\\';
+                res += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char esc[8];
+                snprintf(esc, sizeof(esc), "\\u%04x", c);
+                res += esc;
+            } else {
+                res += c;
+            }
+        }
+        return res + '"';
+    }
+
+    /**
+     * qnum and numKmers on a line, then a line per sample: its name, a tab and its count,
+     * and with bounds a tab and its low bound and a tab and its high bound
+     */
+    class TsvResultWriter : public ResultWriter {
+    public:
+        TsvResultWriter(std::ostream &out, const std::vector<std::string> &sampleNames,
+                        const std::string &queryPrefixIn, bool samplesOnly, bool withBounds) :
+                ResultWriter(out, withBounds), queryPrefix(queryPrefixIn) {
+            names.reserve(sampleNames.size());
+            for (auto &name : sampleNames) {
+                names.push_back(name + (samplesOnly and !withBounds ? '\n' : '\t'));
+            }
+        }
+
+        void formatCounts(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                          const mantis::QueryResult &counts, const SampleBounds *bounds,
+                          std::string &record) const override {
+            formatHeader(qnum, name, numKmers, record);
+            for (uint64_t i = 0; i < counts.size(); i++) {
+                if (counts[i]) {
+                    record += names[i];
+                    appendNumber(record, counts[i]);
+                    if (withBounds) {
+                        record += '\t';
+                        formatBounds(bounds, i, record);
+                    } else {
+                        record += '\n';
+                    }
+                }
+            }
+        }
+
+        void formatSamples(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                           const std::vector<uint64_t> &samples, const SampleBounds *bounds,
+                           std::string &record) const override {
+            formatHeader(qnum, name, numKmers, record);
+            for (auto s : samples) {
+                record += names[s];
+                if (withBounds) formatBounds(bounds, s, record);
+            }
+        }
+
+    private:
+        static void formatBounds(const SampleBounds *bounds, uint64_t s, std::string &record) {
+            double low, high;
+            boundsOf(bounds, s, low, high);
+            appendFraction(record, low);
+            record += '\t';
+            appendFraction(record, high);
+            record += '\n';
+        }
+
+        void formatHeader(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                          std::string &record) const {
+            if (name.empty()) {
+                record += queryPrefix;
+                appendNumber(record, qnum);
+            } else {
+                record += name;
+            }
+            record += '\t';
+            appendNumber(record, numKmers);
+            record += '\n';
+        }
+
+        std::string queryPrefix;
+        std::vector<std::string> names;
+    };
+
+    /**
+     * an array with an object per query, its "res" mapping samples to counts or listing samples,
+     * and with bounds its "bounds" mapping the same samples to [low, high]
+     */
+    class JsonResultWriter : public ResultWriter {
+    public:
+        JsonResultWriter(std::ostream &out, const std::vector<std::string> &sampleNames,
+                         bool samplesOnly, bool withBounds) : ResultWriter(out, withBounds) {
+            names.reserve(sampleNames.size());
+            keys.reserve(sampleNames.size());
+            for (auto &name : sampleNames) {
+                keys.push_back(jsonString(name) + ": ");
+                names.push_back(samplesOnly ? jsonString(name) : keys.back());
+            }
+            buffer += "[\n";
+        }
+
+        void formatCounts(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                          const mantis::QueryResult &counts, const SampleBounds *bounds,
+                          std::string &record) const override {
+            formatHeader(qnum, name, numKmers, record);
+            record += '{';
+            bool first{true};
+            for (uint64_t i = 0; i < counts.size(); i++) {
+                if (counts[i]) {
+                    if (!first) record += ", ";
+                    first = false;
+                    record += names[i];
+                    appendNumber(record, counts[i]);
+                }
+            }
+            record += '}';
+            if (withBounds) {
+                record += ", \"bounds\": {";
+                first = true;
+                for (uint64_t i = 0; i < counts.size(); i++) {
+                    if (counts[i]) {
+                        if (!first) record += ", ";
+                        first = false;
+                        formatBounds(bounds, i, record);
+                    }
+                }
+                record += '}';
+            }
+            record += '}';
+        }
+
+        void formatSamples(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                           const std::vector<uint64_t> &samples, const SampleBounds *bounds,
+                           std::string &record) const override {
+            formatHeader(qnum, name, numKmers, record);
+            record += '[';
+            for (uint64_t i = 0; i < samples.size(); i++) {
+                if (i) record += ", ";
+                record += names[samples[i]];
+            }
+            record += ']';
+            if (withBounds) {
+                record += ", \"bounds\": {";
+                for (uint64_t i = 0; i < samples.size(); i++) {
+                    if (i) record += ", ";
+                    formatBounds(bounds, samples[i], record);
+                }
+                record += '}';
+            }
+            record += '}';
+        }
+
+    protected:
+        const char *separator() const override { return ",\n"; }
+
+        void writeFooter() override { buffer += records ? "\n]\n" : "]\n"; }
+
+    private:
+        static void formatHeader(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                                 std::string &record) {
+            record += "{\"qnum\": ";
+            appendNumber(record, qnum);
+            if (!name.empty()) {
+                record += ", \"name\": ";
+                record += jsonString(name);
+            }
+            record += ", \"num_kmers\": ";
+            appendNumber(record, numKmers);
+            record += ", \"res\": ";
+        }
+
+        void formatBounds(const SampleBounds *bounds, uint64_t s, std::string &record) const {
+            double low, high;
+            boundsOf(bounds, s, low, high);
+            record += keys[s];
+            record += '[';
+            appendFraction(record, low);
+            record += ", ";
+            appendFraction(record, high);
+            record += ']';
+        }
+
+        std::vector<std::string> names;
+        // the names of the samples as keys of the bounds
+        std::vector<std::string> keys;
+    };
+
+    /** see ResultReader for the layout */
+    class BinaryResultWriter : public ResultWriter {
+    public:
+        BinaryResultWriter(std::ostream &out, const std::vector<std::string> &sampleNames,
+                           const std::string &queryPrefix, bool samplesOnly, bool withBounds) :
+                ResultWriter(out, withBounds) {
+            buffer.append(ResultReader::MAGIC, 8);
+            appendU32(buffer, ResultReader::VERSION);
+            appendU32(buffer, (samplesOnly ? ResultReader::SAMPLES_ONLY : 0) |
+                              (withBounds ? ResultReader::BOUNDS : 0));
+            appendU64(buffer, sampleNames.size());
+            appendU32(buffer, queryPrefix.size());
+            buffer += queryPrefix;
+            for (auto &name : sampleNames) {
+                appendU32(buffer, name.size());
+                buffer += name;
+            }
+        }
+
+        void formatCounts(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                          const mantis::QueryResult &counts, const SampleBounds *bounds,
+                          std::string &record) const override {
+            appendU64(record, qnum);
+            appendU32(record, name.size());
+            record += name;
+            appendU64(record, numKmers);
+            // the number of hits goes before the columns, so it's patched once they are counted
+            auto numHitsPos = record.size();
+            appendU32(record, 0);
+            uint32_t numHits{0};
+            for (uint64_t i = 0; i < counts.size(); i++) {
+                if (counts[i]) {
+                    appendU32(record, i);
+                    numHits++;
+                }
+            }
+            for (auto c : counts) {
+                if (c) appendU32(record, c);
+            }
+            if (withBounds) {
+                for (bool high : {false, true}) {
+                    for (uint64_t i = 0; i < counts.size(); i++) {
+                        if (counts[i]) appendBound(bounds, i, high, record);
+                    }
+                }
+            }
+            for (uint32_t i = 0; i < 4; i++) {
+                record[numHitsPos + i] = static_cast<char>(numHits >> (8 * i));
+            }
+        }
+
+        void formatSamples(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                           const std::vector<uint64_t> &samples, const SampleBounds *bounds,
+                           std::string &record) const override {
+            appendU64(record, qnum);
+            appendU32(record, name.size());
+            record += name;
+            appendU64(record, numKmers);
+            appendU32(record, samples.size());
+            for (auto s : samples) {
+                appendU32(record, s);
+            }
+            if (withBounds) {
+                for (bool high : {false, true}) {
+                    for (auto s : samples) appendBound(bounds, s, high, record);
+                }
+            }
+        }
+
+    protected:
+        void writeFooter() override { appendU64(buffer, ResultReader::END_OF_RESULTS); }
+
+    private:
+        static void appendBound(const SampleBounds *bounds, uint64_t s, bool high, std::string &record) {
+            double lowBound, highBound;
+            boundsOf(bounds, s, lowBound, highBound);
+            appendFloat(record, high ? highBound : lowBound);
+        }
+    };
+}
+
+bool parseResultFormat(const std::string &name, ResultFormat &format) {
+    if (name == "tsv") {
+        format = ResultFormat::tsv;
+    } else if (name == "json") {
+        format = ResultFormat::json;
+    } else if (name == "binary") {
+        format = ResultFormat::binary;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<ResultWriter> ResultWriter::create(ResultFormat format, std::ostream &out,
+                                                   const std::vector<std::string> &sampleNames,
+                                                   const std::string &queryPrefix, bool samplesOnly,
+                                                   bool withBounds) {
+    switch (format) {
+        case ResultFormat::json:
+            return std::unique_ptr<ResultWriter>(
+                    new JsonResultWriter(out, sampleNames, samplesOnly, withBounds));
+        case ResultFormat::binary:
+            return std::unique_ptr<ResultWriter>(
+                    new BinaryResultWriter(out, sampleNames, queryPrefix, samplesOnly, withBounds));
+        case ResultFormat::tsv:
+            break;
+    }
+    return std::unique_ptr<ResultWriter>(
+            new TsvResultWriter(out, sampleNames, queryPrefix, samplesOnly, withBounds));
+}
+
+void ResultWriter::emit(const std::string &record) {
+    if (records++) {
+        buffer += separator();
+    }
+    buffer += record;
+    if (buffer.size() >= BUFFER_SIZE) {
+        flush();
+    }
+}
+
+void ResultWriter::writeCounts(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                               const mantis::QueryResult &counts, const SampleBounds *bounds) {
+    scratch.clear();
+    formatCounts(qnum, name, numKmers, counts, bounds, scratch);
+    emit(scratch);
+}
+
+void ResultWriter::writeSamples(uint64_t qnum, const std::string &name, uint64_t numKmers,
+                                const std::vector<uint64_t> &samples, const SampleBounds *bounds) {
+    scratch.clear();
+    formatSamples(qnum, name, numKmers, samples, bounds, scratch);
+    emit(scratch);
+}
+
+void ResultWriter::finish() {
+    if (finished) return;
+    writeFooter();
+    flush();
+    out.flush();
+    finished = true;
+}
+
+void ResultWriter::flush() {
+    out.write(buffer.data(), buffer.size());
+    buffer.clear();
+}
+
+constexpr char ResultReader::MAGIC[9];
+
+bool ResultReader::open(const std::string &file) {
+    in.open(file, std::ios::binary);
+    if (!in.is_open()) return false;
+    char magic[8];
+    unsigned char header[16];
+    if (!in.read(magic, 8) or std::memcmp(magic, MAGIC, 8) != 0 or
+        !in.read(reinterpret_cast<char *>(header), 16) or decodeLE(header, 4) != VERSION) {
+        return false;
+    }
+    uint32_t flags = decodeLE(header + 4, 4);
+    onlySamples = flags & SAMPLES_ONLY;
+    bounds = flags & BOUNDS;
+    names.resize(decodeLE(header + 8, 8));
+    if (!readString(prefix)) return false;
+    for (auto &name : names) {
+        if (!readString(name)) return false;
+    }
+    return true;
+}
+
+bool ResultReader::next(ResultRecord &record) {
+    unsigned char header[20];
+    if (!in.read(reinterpret_cast<char *>(header), 8)) return false;
+    record.qnum = decodeLE(header, 8);
+    if (record.qnum == END_OF_RESULTS) {
+        complete = true;
+        return false;
+    }
+    if (!readString(record.name) or !in.read(reinterpret_cast<char *>(header + 8), 12)) return false;
+    record.numKmers = decodeLE(header + 8, 8);
+    uint32_t numHits = decodeLE(header + 16, 4);
+    uint64_t columns = 1 + (onlySamples ? 0 : 1) + (bounds ? 2 : 0);
+    std::vector<unsigned char> bytes(numHits * 4ULL * columns);
+    if (!in.read(reinterpret_cast<char *>(bytes.data()), bytes.size())) return false;
+    record.samples.resize(numHits);
+    record.counts.resize(onlySamples ? 0 : numHits);
+    record.low.resize(bounds ? numHits : 0);
+    record.high.resize(bounds ? numHits : 0);
+    const unsigned char *column = bytes.data();
+    for (uint32_t i = 0; i < numHits; i++, column += 4) {
+        record.samples[i] = decodeLE(column, 4);
+    }
+    for (uint32_t i = 0; i < record.counts.size(); i++, column += 4) {
+        record.counts[i] = decodeLE(column, 4);
+    }
+    for (uint32_t i = 0; i < record.low.size(); i++, column += 4) {
+        record.low[i] = decodeFloat(column);
+    }
+    for (uint32_t i = 0; i < record.high.size(); i++, column += 4) {
+        record.high[i] = decodeFloat(column);
+    }
+    return true;
+}
+
+bool ResultReader::readString(std::string &s) {
+    unsigned char len[4];
+    if (!in.read(reinterpret_cast<char *>(len), 4)) return false;
+    s.resize(decodeLE(len, 4));
+    return static_cast<bool>(in.read(&s[0], s.size()));
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  main
+ *  Description:  converts a binary query output to the TSV or JSON format
+ * ============================================================================
+ */
+int results_main(ResultsOpts &opt) {
+    spdlog::logger *logger = opt.console.get();
+    ResultReader reader;
+    if (!reader.open(opt.input)) {
+        logger->error("{} is not a binary mantis query output.", opt.input);
+        std::exit(1);
+    }
+    std::ofstream out(opt.output);
+    if (!out.is_open()) {
+        logger->error("Couldn't open {} for writing.", opt.output);
+        std::exit(1);
+    }
+    auto writer = ResultWriter::create(opt.use_json ? ResultFormat::json : ResultFormat::tsv, out,
+                                       reader.sampleNames(), reader.queryPrefix(), reader.samplesOnly(),
+                                       reader.hasBounds());
+    ResultRecord record;
+    mantis::QueryResult counts(reader.sampleNames().size(), 0);
+    std::vector<uint64_t> samples;
+    SampleBounds bounds;
+    if (reader.hasBounds()) {
+        bounds.low.resize(counts.size());
+        bounds.high.resize(counts.size());
+    }
+    while (reader.next(record)) {
+        for (auto s : record.samples) {
+            if (s >= counts.size()) {
+                logger->error("{} has a result for sample {} out of {}.", opt.input, s, counts.size());
+                std::exit(1);
+            }
+        }
+        for (uint64_t i = 0; i < record.low.size(); i++) {
+            bounds.low[record.samples[i]] = record.low[i];
+            bounds.high[record.samples[i]] = record.high[i];
+        }
+        const SampleBounds *recordBounds = reader.hasBounds() ? &bounds : nullptr;
+        if (reader.samplesOnly()) {
+            samples.assign(record.samples.begin(), record.samples.end());
+            writer->writeSamples(record.qnum, record.name, record.numKmers, samples, recordBounds);
+        } else {
+            for (uint64_t i = 0; i < record.samples.size(); i++) {
+                counts[record.samples[i]] = record.counts[i];
+            }
+            writer->writeCounts(record.qnum, record.name, record.numKmers, counts, recordBounds);
+            for (auto s : record.samples) {
+                counts[s] = 0;
+            }
+        }
+    }
+    if (reader.truncated()) {
+        logger->error("{} is truncated.", opt.input);
+        std::exit(1);
+    }
+    writer->finish();
+    logger->info("Converted {} query results.", writer->numRecords());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+//
+// Per-sample hit counting over color bitsets, shared by the RRR and MST queries.
+//
+
+#include <algorithm>
+#include <cmath>
+
+#include "resultWriter.h"
+#include "sampleCounter.h"
+
+// theta * n is off by an ulp for these, a sample with exactly that fraction must still pass
+static_assert(ThresholdFilter::minCountFor(0.7, 10) == 7, "0.7 of 10");
+static_assert(ThresholdFilter::minCountFor(0.3, 10) == 3, "0.3 of 10");
+static_assert(ThresholdFilter::minCountFor(0.07, 100) == 7, "0.07 of 100");
+static_assert(ThresholdFilter::minCountFor(0.14, 100) == 14, "0.14 of 100");
+static_assert(ThresholdFilter::minCountFor(0.29, 100) == 29, "0.29 of 100");
+static_assert(ThresholdFilter::minCountFor(0.71, 10) == 8, "0.71 of 10");
+static_assert(ThresholdFilter::minCountFor(1, 12345) == 12345, "all the k-mers");
+static_assert(ThresholdFilter::minCountFor(0.001, 10) == 1, "at least one k-mer");
+
+SampleCounter::SampleCounter(uint64_t numSamplesIn) :
+        numSamples(numSamplesIn),
+        numWrds((numSamplesIn + 63) / 64),
+        wordEnd((numSamplesIn + 63) / 64),
+        planes(((numSamplesIn + 63) / 64) * NUM_PLANES, 0),
+        totals(numSamplesIn, 0) {}
+
+void SampleCounter::add(const uint64_t *bits, uint64_t multiplicity) {
+    if (multiplicity == 0) return;
+    if (multiplicity > MAX_PENDING) {
+        // too large for the slices, a direct update is cheaper anyway
+        for (uint64_t w = wordBegin; w < wordEnd; w++) {
+            uint64_t wrd = bits[w];
+            while (wrd) {
+                totals[(w << 6) + __builtin_ctzll(wrd)] += multiplicity;
+                wrd &= wrd - 1;
+            }
+        }
+        return;
+    }
+    if (pending + multiplicity > MAX_PENDING) {
+        flush();
+    }
+    pending += multiplicity;
+    for (uint64_t w = wordBegin; w < wordEnd; w++) {
+        uint64_t wrd = bits[w];
+        if (!wrd) continue;
+        uint64_t *slices = planes.data() + w * NUM_PLANES;
+        // add wrd * 2^p for every set bit p of the multiplicity
+        uint64_t m = multiplicity;
+        for (uint32_t p = 0; m; p++, m >>= 1) {
+            if (!(m & 0x01)) continue;
+            uint64_t carry = wrd;
+            // pending bounds every counter, so the carry never leaves the top slice
+            for (uint32_t q = p; carry; q++) {
+                uint64_t c = slices[q] & carry;
+                slices[q] ^= carry;
+                carry = c;
+            }
+        }
+    }
+}
+
+void SampleCounter::flush() {
+    if (!pending) return;
+    for (uint64_t w = wordBegin; w < wordEnd; w++) {
+        uint64_t *slices = planes.data() + w * NUM_PLANES;
+        for (uint32_t p = 0; p < NUM_PLANES; p++) {
+            uint64_t wrd = slices[p];
+            while (wrd) {
+                totals[(w << 6) + __builtin_ctzll(wrd)] += (1ULL << p);
+                wrd &= wrd - 1;
+            }
+            slices[p] = 0;
+        }
+    }
+    pending = 0;
+}
+
+std::vector<uint64_t> &SampleCounter::counts() {
+    flush();
+    return totals;
+}
+
+void SampleCounter::reset() {
+    std::fill(planes.begin(), planes.end(), 0);
+    std::fill(totals.begin(), totals.end(), 0);
+    pending = 0;
+}
+
+ThresholdFilter::ThresholdFilter(uint64_t numSamplesIn, uint64_t numKmers, double theta,
+                                 uint64_t foundKmers, const uint64_t *candidates) :
+        numSamples(numSamplesIn),
+        remaining(foundKmers),
+        numUndecided(numSamplesIn),
+        counts(numSamplesIn, 0),
+        undecidedBits((numSamplesIn + 63) / 64, ~0ULL),
+        acceptedBits((numSamplesIn + 63) / 64, 0) {
+    minCount = minCountFor(theta, numKmers);
+    if (numSamples % 64) {
+        undecidedBits.back() = (1ULL << (numSamples % 64)) - 1;
+    }
+    if (candidates) {
+        numUndecided = 0;
+        for (uint64_t w = 0; w < undecidedBits.size(); w++) {
+            undecidedBits[w] &= candidates[w];
+            numUndecided += __builtin_popcountll(undecidedBits[w]);
+        }
+    }
+    prune();
+}
+
+void ThresholdFilter::add(const uint64_t *bits, uint64_t multiplicity) {
+    for (uint64_t w = 0; w < undecidedBits.size(); w++) {
+        uint64_t wrd = bits[w] & undecidedBits[w];
+        while (wrd) {
+            uint64_t s = (w << 6) + __builtin_ctzll(wrd);
+            counts[s] += multiplicity;
+            if (counts[s] >= minCount) {
+                acceptedBits[w] |= (1ULL << (s & 63));
+                undecidedBits[w] &= ~(1ULL << (s & 63));
+                numUndecided--;
+            }
+            wrd &= wrd - 1;
+        }
+    }
+    remaining -= std::min(remaining, multiplicity);
+    prune();
+}
+
+void ThresholdFilter::prune() {
+    // nobody can be left behind while the k-mers to come could reach the threshold on their own
+    if (remaining >= minCount) return;
+    uint64_t needed = minCount - remaining;
+    for (uint64_t w = 0; w < undecidedBits.size(); w++) {
+        uint64_t wrd = undecidedBits[w];
+        while (wrd) {
+            uint64_t s = (w << 6) + __builtin_ctzll(wrd);
+            if (counts[s] < needed) {
+                undecidedBits[w] &= ~(1ULL << (s & 63));
+                numUndecided--;
+            }
+            wrd &= wrd - 1;
+        }
+    }
+}
+
+std::vector<uint64_t> ThresholdFilter::accepted() const {
+    std::vector<uint64_t> res;
+    for (uint64_t w = 0; w < acceptedBits.size(); w++) {
+        uint64_t wrd = acceptedBits[w];
+        while (wrd) {
+            res.push_back((w << 6) + __builtin_ctzll(wrd));
+            wrd &= wrd - 1;
+        }
+    }
+    return res;
+}
+
+void containmentBounds(uint64_t hits, uint64_t sampled, uint64_t total, double &low, double &high) {
+    if (sampled == 0) {
+        low = 0;
+        high = 1;
+        return;
+    }
+    const double z{1.96};
+    double n = sampled, p = hits / n, z2 = z * z;
+    double center = (p + z2 / (2 * n)) / (1 + z2 / n);
+    double half = z * std::sqrt(p * (1 - p) / n + z2 / (4 * n * n)) / (1 + z2 / n);
+    double fpc = total > sampled ? std::sqrt((total - sampled) / static_cast<double>(total - 1)) : 0;
+    low = p - (p - std::max(0.0, center - half)) * fpc;
+    high = p + (std::min(1.0, center + half) - p) * fpc;
+}
+
+void containmentBounds(const std::vector<uint64_t> &counts, uint64_t sampled, uint64_t total,
+                       SampleBounds &bounds) {
+    bounds.low.resize(counts.size());
+    bounds.high.resize(counts.size());
+    for (uint64_t s = 0; s < counts.size(); s++) {
+        containmentBounds(counts[s], sampled, total, bounds.low[s], bounds.high[s]);
+    }
+}
@@ -0,0 +1,81 @@
+//
+// Restricts queries to a subset of the samples of an index.
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <unordered_map>
+
+#include "sampleMask.h"
+
+namespace {
+    std::string fileName(const std::string &path) {
+        auto pos = path.find_last_of('/');
+        return pos == std::string::npos ? path : path.substr(pos + 1);
+    }
+}
+
+SampleMask SampleMask::load(const std::string &file, const std::vector<std::string> &sampleNames,
+                            spdlog::logger *logger) {
+    std::ifstream in(file);
+    if (!in.is_open()) {
+        logger->error("Couldn't open the sample list {}.", file);
+        std::exit(1);
+    }
+    // names are matched in full first, then by their file name if that is unique
+    std::unordered_map<std::string, uint64_t> byName, byFileName;
+    for (uint64_t i = 0; i < sampleNames.size(); i++) {
+        byName[sampleNames[i]] = i;
+        auto res = byFileName.emplace(fileName(sampleNames[i]), i);
+        if (!res.second) {
+            res.first->second = UINT64_MAX;
+        }
+    }
+    SampleMask mask(sampleNames.size());
+    std::string name;
+    while (std::getline(in, name)) {
+        if (!name.empty() and name.back() == '\r') {
+            name.pop_back();
+        }
+        if (name.empty()) continue;
+        auto it = byName.find(name);
+        if (it == byName.end()) {
+            it = byFileName.find(name);
+            if (it == byFileName.end() or it->second == UINT64_MAX) {
+                logger->error("{} in {} doesn't name exactly one sample of the index.", name, file);
+                std::exit(1);
+            }
+        }
+        mask.add(it->second);
+    }
+    if (mask.empty()) {
+        logger->error("The sample list {} is empty.", file);
+        std::exit(1);
+    }
+    logger->info("Restricting the queries to {} of the {} samples.", mask.count(), sampleNames.size());
+    return mask;
+}
+
+void SampleMask::add(uint64_t sampleId) {
+    bits.set(sampleId);
+    minSample = std::min(minSample, sampleId);
+    maxSample = std::max(maxSample, sampleId);
+}
+
+void SampleMask::apply(uint64_t *row) const {
+    const uint64_t *m = bits.data();
+    uint64_t begin = firstWord(), end = endWord();
+    std::fill(row, row + begin, 0);
+    for (uint64_t w = begin; w < end; w++) {
+        row[w] &= m[w];
+    }
+    std::fill(row + end, row + bits.numWords(), 0);
+}
+
+bool SampleMask::intersects(const uint64_t *row) const {
+    for (uint64_t w = firstWord(); w < endWord(); w++) {
+        if (row[w]) return true;
+    }
+    return false;
+}
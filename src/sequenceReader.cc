@@ -0,0 +1,223 @@
+//
+// Streaming reader of query sequences: FASTA, FASTQ or bare sequences, plain or gzipped.
+//
+
+#include <algorithm>
+#include <cstring>
+
+#include "sequenceReader.h"
+
+namespace {
+    /** the header of a record up to the first whitespace, without its '>' or '@' */
+    std::string headerName(const std::string &line) {
+        auto nameEnd = line.find_first_of(" \t", 1);
+        return line.substr(1, nameEnd == std::string::npos ? std::string::npos : nameEnd - 1);
+    }
+}
+
+SequenceReader::~SequenceReader() {
+    if (in) {
+        gzclose(in);
+    }
+}
+
+bool SequenceReader::open(const std::string &file) {
+    fileName = file;
+    in = gzopen(file.c_str(), "rb");
+    if (!in) return false;
+    gzbuffer(in, BLOCK_SIZE);
+    block.resize(BLOCK_SIZE);
+    return true;
+}
+
+bool SequenceReader::fill() {
+    if (eof) return false;
+    int n = gzread(in, block.data(), BLOCK_SIZE);
+    if (n < 0) {
+        int errnum;
+        err = fileName + ": " + gzerror(in, &errnum);
+    }
+    if (n <= 0) {
+        eof = true;
+        return false;
+    }
+    pos = 0;
+    end = static_cast<uint64_t>(n);
+    return true;
+}
+
+bool SequenceReader::readLine(std::string &line) {
+    if (hasPending) {
+        line = std::move(pending);
+        hasPending = false;
+        return true;
+    }
+    line.clear();
+    bool found{false};
+    while (pos < end or fill()) {
+        found = true;
+        const char *start = block.data() + pos;
+        auto newline = static_cast<const char *>(std::memchr(start, '\n', end - pos));
+        if (newline) {
+            line.append(start, newline - start);
+            pos += newline - start + 1;
+            break;
+        }
+        line.append(start, end - pos);
+        pos = end;
+    }
+    if (!line.empty() and line.back() == '\r') {
+        line.pop_back();
+    }
+    return found;
+}
+
+bool SequenceReader::peekLine(std::string &line) {
+    do {
+        if (!readLine(line)) return false;
+    } while (line.find_first_not_of(" \t") == std::string::npos);
+    pending = line;
+    hasPending = true;
+    return true;
+}
+
+bool SequenceReader::next(SequenceRecord &record) {
+    if (format == Format::unknown) {
+        std::string first;
+        if (!peekLine(first)) return false;
+        char c = first[first.find_first_not_of(" \t")];
+        format = c == '>' ? Format::fasta : c == '@' ? Format::fastq : Format::bare;
+    }
+    switch (format) {
+        case Format::fasta: return nextFasta(record);
+        case Format::fastq: return nextFastq(record);
+        default: return nextBare(record);
+    }
+}
+
+bool SequenceReader::nextFasta(SequenceRecord &record) {
+    std::string line;
+    do {
+        if (!readLine(line)) return false;
+    } while (line.empty());
+    if (line[0] != '>') {
+        err = fileName + ": expected a FASTA header instead of " + line.substr(0, 32);
+        return false;
+    }
+    record.name = headerName(line);
+    record.seq.clear();
+    while (readLine(line)) {
+        if (!line.empty() and line[0] == '>') {
+            pending = std::move(line);
+            hasPending = true;
+            break;
+        }
+        record.seq += line;
+    }
+    return err.empty();
+}
+
+bool SequenceReader::nextFastq(SequenceRecord &record) {
+    std::string line;
+    do {
+        if (!readLine(line)) return false;
+    } while (line.empty());
+    if (line[0] != '@') {
+        err = fileName + ": expected a FASTQ header instead of " + line.substr(0, 32);
+        return false;
+    }
+    record.name = headerName(line);
+    record.seq.clear();
+    // the sequence may span lines up to the '+' line, then as many quality values follow
+    while (true) {
+        if (!readLine(line)) {
+            err = fileName + ": the FASTQ record " + record.name + " is truncated";
+            return false;
+        }
+        if (!line.empty() and line[0] == '+') break;
+        record.seq += line;
+    }
+    uint64_t numQualities{0};
+    while (numQualities < record.seq.size()) {
+        if (!readLine(line)) {
+            err = fileName + ": the FASTQ record " + record.name + " is truncated";
+            return false;
+        }
+        numQualities += line.size();
+    }
+    return true;
+}
+
+bool SequenceReader::nextBare(SequenceRecord &record) {
+    std::string line;
+    while (tokens.empty()) {
+        if (!readLine(line)) return false;
+        for (uint64_t start = line.find_first_not_of(" \t"); start != std::string::npos;) {
+            auto tokenEnd = line.find_first_of(" \t", start);
+            tokens.push_back(line.substr(start, tokenEnd == std::string::npos ? std::string::npos
+                                                                              : tokenEnd - start));
+            start = tokenEnd == std::string::npos ? tokenEnd : line.find_first_not_of(" \t", tokenEnd);
+        }
+        std::reverse(tokens.begin(), tokens.end());
+    }
+    record.name.clear();
+    record.seq = std::move(tokens.back());
+    tokens.pop_back();
+    return true;
+}
+
+SequenceBatchReader::~SequenceBatchReader() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    spaceCv.notify_all();
+    if (producer.joinable()) {
+        producer.join();
+    }
+}
+
+bool SequenceBatchReader::open(const std::string &file) {
+    if (!reader.open(file)) return false;
+    producer = std::thread(&SequenceBatchReader::produce, this);
+    return true;
+}
+
+void SequenceBatchReader::produce() {
+    while (true) {
+        std::vector<SequenceRecord> batch;
+        uint64_t bases{0};
+        bool last{true};
+        SequenceRecord record;
+        while (reader.next(record)) {
+            bases += record.seq.size();
+            batch.push_back(std::move(record));
+            if (batch.size() == BATCH_RECORDS or bases >= BATCH_BASES) {
+                last = false;
+                break;
+            }
+        }
+        std::unique_lock<std::mutex> lock(mtx);
+        spaceCv.wait(lock, [this] { return ready.size() < MAX_READY or stopping; });
+        if (stopping) return;
+        if (!batch.empty()) {
+            ready.push_back(std::move(batch));
+        }
+        if (last) {
+            err = reader.error();
+            done = true;
+        }
+        readyCv.notify_all();
+        if (last) return;
+    }
+}
+
+bool SequenceBatchReader::next(std::vector<SequenceRecord> &batch) {
+    std::unique_lock<std::mutex> lock(mtx);
+    readyCv.wait(lock, [this] { return !ready.empty() or done; });
+    if (ready.empty()) return false;
+    batch = std::move(ready.front());
+    ready.pop_front();
+    spaceCv.notify_all();
+    return true;
+}
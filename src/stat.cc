@@ -133,18 +133,17 @@ std::vector<uint64_t> Stat::queryColor() {
     RankScores rs(1);
     nonstd::optional<uint64_t> dummy{nonstd::nullopt};
 
-    if (cache_lru->contains(idx)) {
-        setbits = (*cache_lru)[idx];//.get(eqclass_id);
+    if (cache->get(idx, setbits)) {
         queryStats.cacheCntr++;
     } else {
         queryStats.noCacheCntr++;
         queryStats.trySample = (queryStats.noCacheCntr % 10 == 0);
         toDecode.reset();
-        setbits = mstQuery->buildColor(idx, queryStats, cache_lru, &rs, toDecode);
-        cache_lru->emplace(idx, setbits);
+        setbits = mstQuery->buildColor(idx, queryStats, cache, &rs, toDecode);
+        cache->put(idx, setbits);
         if (queryStats.trySample and toDecode) {
             auto s = mstQuery->buildColor(*toDecode, queryStats, nullptr, nullptr, dummy);
-            cache_lru->emplace(*toDecode, s);
+            cache->put(*toDecode, s);
         }
     }
     return setbits;
@@ -0,0 +1,286 @@
+//
+// Compacted unitigs of the colored dBG, stored next to the index, so a query can follow
+// a read along a unitig instead of looking every k-mer up in the CQF.
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ProgOpts.h"
+#include "common_types.h"
+#include "unitigTable.h"
+#include "gqf/gqf_int.h"
+#include "gqf/hashutil.h"
+
+UnitigTable::~UnitigTable() {
+    if (mapped) {
+        munmap(mapped, mappedSize);
+    }
+}
+
+bool UnitigTable::load(const std::string &file, const CQF<KeyObject> &cqf, spdlog::logger *logger) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        logger->warn("Unitig file {} could not be opened.", file);
+        return false;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 or static_cast<size_t>(sb.st_size) < sizeof(Header)) {
+        logger->warn("Unitig file {} is truncated.", file);
+        close(fd);
+        return false;
+    }
+    mappedSize = sb.st_size;
+    mapped = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        mapped = nullptr;
+        logger->warn("Couldn't mmap the unitig file {}.", file);
+        return false;
+    }
+    header = reinterpret_cast<const Header *>(mapped);
+    uint64_t expectedSize = sizeof(Header) +
+                            sizeof(uint64_t) * 2 * (header->numUnitigs + 1) +
+                            sizeof(Run) * header->numRuns +
+                            sizeof(uint64_t) * ((1ULL << header->bucketBits) + 1) +
+                            sizeof(Entry) * header->numKmers +
+                            sizeof(uint64_t) * ((header->numBases + 31) / 32);
+    const char *error = nullptr;
+    if (header->magic != MAGIC or header->version != VERSION) {
+        error = "is not a unitig file of this version of mantis";
+    } else if (mappedSize != expectedSize) {
+        error = "is truncated";
+    } else if (header->k != cqf.keybits() / 2 or header->numKmers != cqf.dist_elts() or
+               header->cqfFingerprint != fingerprint(cqf)) {
+        error = "was built for another index, run mantis unitigs again";
+    }
+    if (error) {
+        logger->warn("Unitig file {} {}.", file, error);
+        munmap(mapped, mappedSize);
+        mapped = nullptr;
+        header = nullptr;
+        return false;
+    }
+    k = header->k;
+    unitigStart = reinterpret_cast<const uint64_t *>(header + 1);
+    runStart = unitigStart + header->numUnitigs + 1;
+    runs = reinterpret_cast<const Run *>(runStart + header->numUnitigs + 1);
+    buckets = reinterpret_cast<const uint64_t *>(runs + header->numRuns);
+    entries = reinterpret_cast<const Entry *>(buckets + (1ULL << header->bucketBits) + 1);
+    bases = reinterpret_cast<const uint64_t *>(entries + header->numKmers);
+    // seeds are random probes, the unitigs are then read sequentially from there
+    madvise(mapped, mappedSize, MADV_RANDOM);
+    logger->info("Loaded {} unitigs of {} k-mers from {}", header->numUnitigs, header->numKmers, file);
+    return true;
+}
+
+uint64_t UnitigTable::fingerprint(const CQF<KeyObject> &cqf) {
+    // a few thousand words, so that loading the table only touches a few thousand pages of the CQF
+    constexpr uint64_t SAMPLES{4096};
+    const QF *qf = cqf.get_cqf();
+    std::vector<uint64_t> words{cqf.numslots(), cqf.seed(), cqf.total_elts(), cqf.dist_elts(),
+                                qf->metadata->total_size_in_bytes};
+    const auto *slots = reinterpret_cast<const uint8_t *>(qf->blocks);
+    uint64_t numWords = qf->metadata->total_size_in_bytes / sizeof(uint64_t);
+    uint64_t step = std::max<uint64_t>(numWords / SAMPLES, 1);
+    for (uint64_t i = 0; i < numWords; i += step) {
+        uint64_t w;
+        std::memcpy(&w, slots + i * sizeof(uint64_t), sizeof(w));
+        words.push_back(w);
+    }
+    return MurmurHash64A(words.data(), static_cast<int>(words.size() * sizeof(uint64_t)), 2038074743);
+}
+
+namespace {
+    /** a k-mer (forward, as it reads) of a dBG stored in a CQF, and its neighbors */
+    class DbgWalker {
+    public:
+        DbgWalker(CQF<KeyObject> &cqfIn, uint32_t kIn) :
+                cqf(cqfIn), k(kIn), mask(kIn == 32 ? ~0ULL : (1ULL << (2 * kIn)) - 1) {}
+
+        uint64_t canonical(uint64_t kmer) const {
+            return mantis::canonicalKmer(kmer, mantis::reverseComplement(kmer, k));
+        }
+
+        /** @return the color class of kmer counting from 1, 0 if it isn't in the dBG */
+        uint64_t eqclass(uint64_t kmer) {
+            return cqf.query(KeyObject(canonical(kmer), 0, 0), QF_NO_LOCK);
+        }
+
+        /**
+         * counts the k-mers following kmer in the dBG
+         * @param next set to one of them
+         */
+        uint32_t successors(uint64_t kmer, uint64_t &next, uint64_t &nextClass) {
+            uint32_t cnt{0};
+            for (uint64_t b = 0; b < 4; b++) {
+                uint64_t succ = ((kmer << 2) | b) & mask;
+                uint64_t c = eqclass(succ);
+                if (c) {
+                    cnt++;
+                    next = succ;
+                    nextClass = c;
+                }
+            }
+            return cnt;
+        }
+
+        uint32_t predecessors(uint64_t kmer) {
+            uint64_t next, nextClass;
+            return successors(mantis::reverseComplement(kmer, k), next, nextClass);
+        }
+
+        /**
+         * extends kmer to the right for as long as the path doesn't branch, marking the
+         * k-mers added as visited
+         * @param codes the bases added
+         * @param classes the color classes (counting from 0) of the k-mers added
+         */
+        void extend(uint64_t kmer, tsl::hopscotch_set<uint64_t> &visited,
+                    std::vector<uint8_t> &codes, std::vector<uint64_t> &classes) {
+            uint64_t next, nextClass;
+            while (successors(kmer, next, nextClass) == 1 and predecessors(next) == 1) {
+                // a cycle or a path turning back on its own reverse complement
+                if (!visited.insert(canonical(next)).second) break;
+                codes.push_back(next & 3);
+                classes.push_back(nextClass - 1);
+                kmer = next;
+            }
+        }
+
+    private:
+        CQF<KeyObject> &cqf;
+        uint32_t k;
+        uint64_t mask;
+    };
+}
+
+bool UnitigTable::build(CQF<KeyObject> &cqf, const std::string &file, spdlog::logger *logger) {
+    uint32_t k = cqf.keybits() / 2;
+    DbgWalker walker(cqf, k);
+    std::vector<uint64_t> unitigStarts, runStarts, words;
+    std::vector<Run> allRuns;
+    std::vector<Entry> allEntries;
+    allEntries.reserve(cqf.dist_elts());
+    uint64_t numBases{0};
+    tsl::hopscotch_set<uint64_t> visited;
+    visited.reserve(cqf.dist_elts());
+
+    std::vector<uint8_t> left, right, codes;
+    std::vector<uint64_t> leftClasses, rightClasses, classes;
+    for (auto it = cqf.begin(); !it.done(); ++it) {
+        KeyObject keyObject = *it;
+        uint64_t start = keyObject.key;
+        if (!visited.insert(start).second) continue;
+        left.clear();
+        right.clear();
+        leftClasses.clear();
+        rightClasses.clear();
+        walker.extend(start, visited, right, rightClasses);
+        walker.extend(mantis::reverseComplement(start, k), visited, left, leftClasses);
+
+        // the left extension was walked on the other strand: reverse and complement it
+        codes.clear();
+        classes.clear();
+        for (auto c = left.rbegin(); c != left.rend(); ++c) codes.push_back(3 - *c);
+        for (uint32_t i = 0; i < k; i++) codes.push_back((start >> (2 * (k - 1 - i))) & 3);
+        codes.insert(codes.end(), right.begin(), right.end());
+        classes.assign(leftClasses.rbegin(), leftClasses.rend());
+        classes.push_back(keyObject.count - 1);
+        classes.insert(classes.end(), rightClasses.begin(), rightClasses.end());
+
+        uint64_t unitig = unitigStarts.size();
+        unitigStarts.push_back(numBases);
+        runStarts.push_back(allRuns.size());
+        for (uint64_t i = 0; i < classes.size(); i++) {
+            if (i == 0 or classes[i] != allRuns.back().eqid) {
+                allRuns.push_back(Run{classes[i], i + 1});
+            } else {
+                allRuns.back().end = i + 1;
+            }
+        }
+        mantis::RollingKmer kmer(k);
+        for (uint64_t i = 0; i < codes.size(); i++) {
+            if ((numBases & 31) == 0) words.push_back(0);
+            words.back() |= static_cast<uint64_t>(codes[i]) << ((numBases & 31) << 1);
+            numBases++;
+            kmer.push(codes[i]);
+            if (i + 1 >= k) {
+                uint64_t flag = kmer.canonical() == kmer.forward() ? CANONICAL_FLAG : 0;
+                allEntries.push_back(Entry{kmer.canonical(), numBases - k, unitig | flag});
+            }
+        }
+    }
+    unitigStarts.push_back(numBases);
+    runStarts.push_back(allRuns.size());
+    uint64_t numUnitigs = unitigStarts.size() - 1;
+    logger->info("{} k-mers in {} unitigs of {} bases and {} color runs",
+                 allEntries.size(), numUnitigs, numBases, allRuns.size());
+
+    // about four k-mers per bucket, so a lookup reads a cache line or two of entries
+    uint64_t bucketBits{0};
+    while ((4ULL << bucketBits) < allEntries.size()) bucketBits++;
+    std::sort(allEntries.begin(), allEntries.end(), [bucketBits](const Entry &e1, const Entry &e2) {
+        uint64_t b1 = bucketOf(e1.kmer, bucketBits), b2 = bucketOf(e2.kmer, bucketBits);
+        return b1 != b2 ? b1 < b2 : e1.kmer < e2.kmer;
+    });
+    std::vector<uint64_t> bucketStarts((1ULL << bucketBits) + 1, 0);
+    for (auto &e : allEntries) bucketStarts[bucketOf(e.kmer, bucketBits) + 1]++;
+    for (uint64_t b = 1; b < bucketStarts.size(); b++) bucketStarts[b] += bucketStarts[b - 1];
+
+    std::string tmpFile = file + ".tmp";
+    std::ofstream out(tmpFile, std::ios::out | std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    Header h{MAGIC, VERSION, k, allEntries.size(), numUnitigs, allRuns.size(), numBases, bucketBits,
+             fingerprint(cqf)};
+    out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+    out.write(reinterpret_cast<const char *>(unitigStarts.data()), sizeof(uint64_t) * unitigStarts.size());
+    out.write(reinterpret_cast<const char *>(runStarts.data()), sizeof(uint64_t) * runStarts.size());
+    out.write(reinterpret_cast<const char *>(allRuns.data()), sizeof(Run) * allRuns.size());
+    out.write(reinterpret_cast<const char *>(bucketStarts.data()), sizeof(uint64_t) * bucketStarts.size());
+    out.write(reinterpret_cast<const char *>(allEntries.data()), sizeof(Entry) * allEntries.size());
+    out.write(reinterpret_cast<const char *>(words.data()), sizeof(uint64_t) * words.size());
+    out.close();
+    if (!out) {
+        std::remove(tmpFile.c_str());
+        return false;
+    }
+    return std::rename(tmpFile.c_str(), file.c_str()) == 0;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  main
+ *  Description:  compacts the dBG of an index into unitigs and writes them,
+ *                with their colors, to the unitig file of the index
+ * ============================================================================
+ */
+int unitigs_main(UnitigOpts &opt) {
+    spdlog::logger *logger = opt.console.get();
+    std::string prefix = opt.prefix;
+    if (prefix.back() != '/') {
+        prefix.push_back('/');
+    }
+
+    std::string dbg_file(prefix + mantis::CQF_FILE);
+    CQF<KeyObject> cqf(dbg_file, CQF_FREAD);
+    logger->info("Compacting the {} k-mers of the dBG (k = {}) into unitigs", cqf.dist_elts(),
+                 cqf.keybits() / 2);
+    std::string unitigFile = prefix + mantis::UNITIG_FILE;
+    if (!UnitigTable::build(cqf, unitigFile, logger)) {
+        logger->error("Failed to write the unitigs to {}", unitigFile);
+        return EXIT_FAILURE;
+    }
+    logger->info("Wrote the unitigs to {}", unitigFile);
+    return EXIT_SUCCESS;
+}
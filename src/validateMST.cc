@@ -2,9 +2,12 @@
 // Created by Fatemeh Almodaresi on 2018-10-18.
 //
 #include <MantisFS.h>
+#include <atomic>
+#include <chrono>
 #include <sstream>
 #include "mstQuery.h"
 #include "ProgOpts.h"
+#include "bulkQuery.h"
 
 typedef std::vector<sdsl::rrr_vector < 63>> eqvec;
 
@@ -56,19 +59,141 @@ std::vector<uint64_t> buildColor(eqvec &bvs,
 }
 
 
+namespace {
+    /** number of occurrences of each value, e.g. of each decode depth */
+    class CountHistogram {
+    public:
+        void add(uint64_t value) {
+            if (value >= counts.size()) counts.resize(value + 1);
+            counts[value]++;
+        }
+
+        void merge(const CountHistogram &other) {
+            if (other.counts.size() > counts.size()) counts.resize(other.counts.size());
+            for (uint64_t v = 0; v < other.counts.size(); v++) counts[v] += other.counts[v];
+        }
+
+        /** the smallest value that at least a fraction p of the values are at most */
+        uint64_t percentile(double p) const {
+            uint64_t total{0}, seen{0};
+            for (auto c : counts) total += c;
+            for (uint64_t v = 0; v < counts.size(); v++) {
+                seen += counts[v];
+                if (seen and seen >= p * total) return v;
+            }
+            return 0;
+        }
+
+        double mean() const {
+            double sum{0}, total{0};
+            for (uint64_t v = 0; v < counts.size(); v++) {
+                sum += v * static_cast<double>(counts[v]);
+                total += counts[v];
+            }
+            return total ? sum / total : 0;
+        }
+
+        uint64_t max() const { return counts.empty() ? 0 : counts.size() - 1; }
+
+        std::string summary() const {
+            std::ostringstream out;
+            out << "mean " << mean() << ", p50 " << percentile(0.5) << ", p99 " << percentile(0.99)
+                << ", max " << max();
+            return out.str();
+        }
+
+        /** the summary and the number of values in [2^i, 2^(i+1)) (0 in the first bucket) */
+        std::string toJson() const {
+            std::vector<uint64_t> log2Buckets;
+            for (uint64_t v = 0; v < counts.size(); v++) {
+                uint64_t b = v ? 64 - __builtin_clzll(v) - 1 : 0;
+                if (b >= log2Buckets.size()) log2Buckets.resize(b + 1);
+                log2Buckets[b] += counts[v];
+            }
+            std::ostringstream out;
+            out << "{\"mean\": " << mean() << ", \"p50\": " << percentile(0.5)
+                << ", \"p99\": " << percentile(0.99) << ", \"max\": " << max() << ", \"log2_buckets\": [";
+            for (uint64_t b = 0; b < log2Buckets.size(); b++) {
+                out << (b ? ", " : "") << log2Buckets[b];
+            }
+            out << "]}";
+            return out.str();
+        }
+
+    private:
+        std::vector<uint64_t> counts;
+    };
+
+    /** the decode state and the measures of one thread */
+    struct Validator {
+        std::unique_ptr<MSTQuery> mstQuery;
+        std::unique_ptr<ColorCache> cache;
+        QueryStats queryStats;
+        LatencyHistogram decodeTimes;
+        CountHistogram depths;
+        CountHistogram deltaLengths;
+        std::vector<uint64_t> mismatches;
+        std::vector<uint64_t> unbounded; // color classes with no boundary after their deltas
+    };
+
+    /**
+     * sets n to the number of deltas of color class i, up to the next boundary
+     * @return false if the boundary vector ends before that boundary
+     */
+    bool numDeltas(const MSTIndex &index, uint64_t i, uint64_t &n) {
+        uint64_t from = index.deltaStart(i), to = from;
+        while (to < index.bbv.size()) {
+            uint64_t len = std::min<uint64_t>(64, index.bbv.size() - to);
+            uint64_t wrd = index.bbv.get_int(to, len);
+            if (wrd) {
+                n = to + __builtin_ctzll(wrd) - from + 1;
+                return true;
+            }
+            to += len;
+        }
+        return false;
+    }
+
+    void logMismatch(spdlog::logger *logger, uint64_t idx, const std::vector<uint64_t> &newEq,
+                     const std::vector<uint64_t> &oldEq) {
+        std::ostringstream out;
+        out << "Color class " << idx << " differs: MST " << newEq.size() << " samples, RRR "
+            << oldEq.size() << " samples\n\tMST:";
+        for (auto s : newEq) out << " " << s;
+        out << "\n\tRRR:";
+        for (auto s : oldEq) out << " " << s;
+        logger->error("{}", out.str());
+    }
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  main
+ *  Description:  checks that the MST decodes every color class to its RRR row,
+ *                and measures how fast it does
+ * ============================================================================
+ */
 int validate_mst_main(MSTValidateOpts &opt) {
+    // mismatching color classes logged in full, the others are only counted
+    constexpr uint64_t LOGGED_MISMATCHES{10};
     spdlog::logger *logger = opt.console.get();
-    std::string dbg_file(opt.prefix + mantis::CQF_FILE);
-    std::string sample_file(opt.prefix + mantis::SAMPLEID_FILE);
-
-    QueryStats queryStats;
-    queryStats.numSamples = opt.numSamples;
-    logger->info("Number of experiments: {}", queryStats.numSamples);
+    uint32_t numThreads = std::max<uint32_t>(1, opt.numThreads);
+    logger->info("Number of experiments: {}", opt.numSamples);
 
     logger->info("Loading parentbv, deltabv, and bbv...");
-    MSTQuery mstQuery(opt.prefix, opt.k, opt.k, queryStats.numSamples, logger);
+    auto index = std::make_shared<const MSTIndex>(opt.prefix, logger);
     logger->info("Done Loading data structure. Total # of color classes is {}",
-                 mstQuery.parentbv.size() - 1);
+                 index->numColorClasses());
+    // every color class, the dummy root included, ends at a set bit of the boundary vector
+    uint64_t numBoundaries{0};
+    for (uint64_t i = 0; i < index->bbv.size(); i += 64) {
+        numBoundaries += __builtin_popcountll(index->bbv.get_int(i, std::min<uint64_t>(64, index->bbv.size() - i)));
+    }
+    if (numBoundaries < index->parentbv.size()) {
+        logger->error("Validation failed: the boundary vector is corrupt, it ends {} color classes but there are {}",
+                      numBoundaries, index->parentbv.size());
+        return EXIT_FAILURE;
+    }
 
     logger->info("Loading color classes...");
     eqvec bvs;
@@ -80,32 +205,99 @@ int validate_mst_main(MSTValidateOpts &opt) {
     logger->info("Done Loading color classes."
                  "\n\t# of color classes: {}"
                  "\n\t# of Samples: {}", eqCount, opt.numSamples);
-    uint64_t cntr{0};
-    LRUCacheMap cache_lru(100000);
-    for (uint64_t idx = 0; idx < eqCount; idx++) {
+
+    // each thread decodes with its own query state and cache, and keeps its own measures
+    std::vector<Validator> validators(numThreads);
+    for (auto &v : validators) {
+        v.mstQuery.reset(new MSTQuery(index, opt.k, opt.k, opt.numSamples, logger));
+        if (opt.cache_budget_mb) {
+            v.cache.reset(new ColorCache(opt.numSamples, (opt.cache_budget_mb << 20) / numThreads));
+        }
+        v.queryStats.numSamples = opt.numSamples;
+    }
+    std::atomic<uint64_t> cntr{0};
+    auto start = std::chrono::steady_clock::now();
+    mantis::parallel_for(eqCount, numThreads, [&](uint64_t idx, uint32_t t) {
+        Validator &v = validators[t];
         nonstd::optional<uint64_t> dummy{nonstd::nullopt};
-        std::vector<uint64_t> newEq = mstQuery.buildColor(idx, queryStats, &cache_lru, nullptr, dummy);
-        cache_lru.emplace(idx, newEq);
-        std::vector<uint64_t> oldEq = buildColor(bvs, idx, opt.numSamples);
-        if (newEq != oldEq) {
-            std::cerr << "AAAAA! LOOOSER!!\n";
-            std::cerr << "index=" << idx << "\n";
-            std::cerr << "new size: " << newEq.size() << " old size: " << oldEq.size() << "\n";
-            std::cerr << "new: ";
-            for (unsigned long k : newEq) {
-                std::cerr << k << " ";
-            }
-            std::cerr << "\nold: ";
-            for (unsigned long k : oldEq) {
-                std::cerr << k << " ";
-            }
-            std::cerr << "\n";
-            std::exit(1);
+        uint64_t selects = v.queryStats.totSel;
+        auto decodeStart = std::chrono::steady_clock::now();
+        std::vector<uint64_t> newEq = v.mstQuery->buildColor(idx, v.queryStats, v.cache.get(), nullptr, dummy);
+        v.decodeTimes.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - decodeStart).count());
+        v.depths.add(v.queryStats.totSel - selects);
+        uint64_t deltas;
+        if (numDeltas(*index, idx, deltas)) {
+            v.deltaLengths.add(deltas);
+        } else {
+            v.unbounded.push_back(idx);
+        }
+        if (v.cache) {
+            v.cache->put(idx, newEq);
+        }
+        if (newEq != buildColor(bvs, idx, opt.numSamples)) {
+            v.mismatches.push_back(idx);
         }
-        cntr++;
-        if (cntr % 1000000 == 0) {
-            std::cerr << "\r" << cntr/1000000 << "M eqs were the same";
+        uint64_t done = ++cntr;
+        if (done % 1000000 == 0) {
+            std::cerr << "\r" << done/1000000 << "M eqs were checked";
         }
+    }, 1024);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (cntr >= 1000000) {
+        std::cerr << "\n";
     }
-    logger->info("\nWOOOOW! Validation passed\n");
-}
\ No newline at end of file
+
+    Validator total;
+    std::vector<uint64_t> &mismatches = total.mismatches;
+    for (auto &v : validators) {
+        total.decodeTimes.merge(v.decodeTimes);
+        total.depths.merge(v.depths);
+        total.deltaLengths.merge(v.deltaLengths);
+        mismatches.insert(mismatches.end(), v.mismatches.begin(), v.mismatches.end());
+        total.unbounded.insert(total.unbounded.end(), v.unbounded.begin(), v.unbounded.end());
+    }
+    std::sort(mismatches.begin(), mismatches.end());
+    for (uint64_t i = 0; i < std::min(LOGGED_MISMATCHES, mismatches.size()); i++) {
+        nonstd::optional<uint64_t> dummy{nonstd::nullopt};
+        uint64_t idx = mismatches[i];
+        logMismatch(logger, idx, validators[0].mstQuery->buildColor(idx, total.queryStats, nullptr, nullptr, dummy),
+                    buildColor(bvs, idx, opt.numSamples));
+    }
+
+    double decodeSeconds = total.decodeTimes.total() / 1e9;
+    logger->info("Checked {} color classes in {:.3f}s on {} threads", eqCount, seconds, numThreads);
+    logger->info("decode: {:.0f} color classes/s per thread, {}", decodeSeconds ? eqCount / decodeSeconds : 0,
+                 total.decodeTimes.summary());
+    logger->info("decode depth{}: {}", opt.cache_budget_mb ? " (down to a cached ancestor)" : "",
+                 total.depths.summary());
+    logger->info("deltas per color class: {}", total.deltaLengths.summary());
+    if (!opt.stats_file.empty()) {
+        std::vector<std::pair<std::string, std::string>> fields{
+                {"color_classes", std::to_string(eqCount)},
+                {"mismatches", std::to_string(mismatches.size())},
+                {"threads", std::to_string(numThreads)},
+                {"seconds", std::to_string(seconds)},
+                {"decode_latency", total.decodeTimes.toJson()},
+                {"decode_depth", total.depths.toJson()},
+                {"deltas_per_class", total.deltaLengths.toJson()}};
+        if (writeJsonSummary(opt.stats_file, fields)) {
+            logger->info("Wrote the validation statistics to {}", opt.stats_file);
+        } else {
+            logger->error("Failed to write the validation statistics to {}", opt.stats_file);
+        }
+    }
+
+    if (!total.unbounded.empty()) {
+        std::sort(total.unbounded.begin(), total.unbounded.end());
+        logger->error("Validation failed: the boundary vector is corrupt, it has no boundary after the "
+                      "deltas of {} color classes (the first is {})", total.unbounded.size(), total.unbounded[0]);
+        return EXIT_FAILURE;
+    }
+    if (!mismatches.empty()) {
+        logger->error("Validation failed: {} of {} color classes differ", mismatches.size(), eqCount);
+        return EXIT_FAILURE;
+    }
+    logger->info("Validation passed");
+    return EXIT_SUCCESS;
+}
@@ -39,9 +39,194 @@
 #include "coloreddbg.h"
 #include "mantisconfig.hpp"
 #include "squeakrconfig.h"
+#include "bulkQuery.h"
+#include "kmerExtractor.h"
 
 #include	<stdlib.h>
 
+namespace {
+	using CDbg = ColoredDbg<SampleObject<CQF<KeyObject>*>, KeyObject>;
+
+	// mismatching k-mers reported per sample and kind, the others are only counted
+	constexpr uint64_t REPORT_LIMIT{1000};
+
+	enum Mismatch : uint8_t { MISSING = 0, NOT_IN_COLOR = 1, EXTRA = 2, NUM_MISMATCHES = 3 };
+	const char *MISMATCH_NAMES[NUM_MISMATCHES] = {"missing", "not_in_color", "extra"};
+
+	struct KmerCheck {
+		uint64_t checked{0};
+		uint64_t present{0};
+		uint64_t mismatches[NUM_MISMATCHES] = {0, 0, 0};
+	};
+
+	/**
+	 * the number of ranges of the hash space forEachKmer splits a CQF into, a power of two: an
+	 * iterator set on a range that doesn't start at a quotient boundary may repeat k-mers
+	 */
+	uint64_t numParts(uint32_t numThreads) {
+		uint64_t parts = 1;
+		while (numThreads > 1 and parts < numThreads * 16ULL)
+			parts <<= 1;
+		return parts;
+	}
+
+	/**
+	 * calls f(it, part, threadId) for every k-mer of cqf, on numThreads threads that each take
+	 * ranges of the hash space, as the MST construction does. The k-mers of a range are visited
+	 * in the order of their hashes, and the ranges are numbered in that order.
+	 */
+	template <typename F>
+	void forEachKmer(const CQF<KeyObject>& cqf, uint32_t numThreads, F f) {
+		uint64_t parts = numParts(numThreads);
+		__uint128_t step = cqf.range() / parts;
+		mantis::parallel_for(parts, numThreads, [&](uint64_t p, uint32_t t) {
+			__uint128_t start = p * step;
+			__uint128_t end = p + 1 == parts ? cqf.range() + 1 : (p + 1) * step;
+			for (auto it = cqf.setIteratorLimits(start, end); !it.reachedHashLimit(); ++it)
+				f(it, p, t);
+		}, 1);
+	}
+
+	/**
+	 * checks the k-mers of the inputs (or the sample of them kept by --sample-rate) against the
+	 * index, streaming the inputs one at a time:
+	 * - every k-mer of an input must be in the index, with the sample in its color;
+	 * - the index must not have more k-mers in the color of a sample than its input has. This is
+	 *   checked by counting them once for all samples, and only the samples whose counts differ
+	 *   are looked for the extra k-mers.
+	 */
+	bool validate_kmers(ValidateOpts& opt, const std::vector<std::string>& squeakr_files,
+											CDbg& cdbg, uint64_t kmer_size) {
+		spdlog::logger* console = opt.console.get();
+		uint32_t threads = std::max<uint32_t>(1, opt.numThreads);
+		uint64_t max_hash = std::numeric_limits<uint64_t>::max();
+		if (opt.sample_rate < 1)
+			max_hash = static_cast<uint64_t>(opt.sample_rate * 18446744073709551616.0);
+		uint64_t seed = opt.seed;
+		auto keep = [max_hash, seed](uint64_t hash) { return mantis::mixKmer(hash ^ seed) <= max_hash; };
+		const CQF<KeyObject>& index_cqf = *cdbg.get_cqf();
+		uint64_t num_samples = cdbg.get_num_samples();
+
+		std::unordered_map<std::string, uint64_t> sample_ids;
+		for (uint64_t i = 0; i < num_samples; i++)
+			sample_ids[cdbg.get_sample(i)] = i;
+
+		// k-mers of the index in the color of each sample
+		console->info("Counting the k-mers of each sample in the index.");
+		std::vector<tsl::hopscotch_map<uint64_t, uint64_t>> class_cnts(threads);
+		forEachKmer(index_cqf, threads, [&](const CQF<KeyObject>::Iterator& it, uint64_t, uint32_t t) {
+			KeyObject hash = it.get_cur_hash();
+			if (keep(hash.key))
+				class_cnts[t][hash.count] += 1;
+		});
+		for (uint32_t t = 1; t < threads; t++) {
+			for (auto& kv : class_cnts[t])
+				class_cnts[0][kv.first] += kv.second;
+			tsl::hopscotch_map<uint64_t, uint64_t>().swap(class_cnts[t]);
+		}
+		SampleCounter counter(num_samples);
+		std::vector<uint64_t> row((num_samples + 63) / 64);
+		for (auto& kv : class_cnts[0]) {
+			cdbg.get_color_row(kv.first, row.data());
+			counter.add(row.data(), kv.second);
+		}
+		std::vector<uint64_t> index_counts = counter.counts();
+
+		std::ofstream report;
+		if (!opt.report_file.empty()) {
+			report.open(opt.report_file);
+			if (!report.is_open()) {
+				console->error("Could not open the report file {}.", opt.report_file);
+				std::exit(1);
+			}
+		}
+		bool fail{false};
+		for (uint64_t i = 0; i < squeakr_files.size(); i++) {
+			std::string file = squeakr_files[i];
+			uint64_t sample = i;
+			auto found = sample_ids.find(file);
+			if (found != sample_ids.end()) {
+				sample = found->second;
+			} else if (i < num_samples) {
+				console->warn("Squeakr file {} is not a sample of the index, checking it as sample {} ({}).",
+											file, i, cdbg.get_sample(i));
+			} else {
+				console->error("Squeakr file {} is not a sample of the index.", file);
+				std::exit(1);
+			}
+			CQF<KeyObject> incqf(file, CQF_MMAP);
+			if (!index_cqf.check_similarity(&incqf)) {
+				console->error("Squeakr file {} is not similar to the CQF of the index.", file);
+				std::exit(1);
+			}
+
+			std::vector<KmerCheck> checks(threads);
+			// the first mismatching k-mers of each range, so that the report takes the first ones
+			// in the order of their hashes whatever the number of threads
+			std::vector<std::vector<std::string>> lines(numParts(threads) * NUM_MISMATCHES);
+			auto record = [&](Mismatch kind, const CQF<KeyObject>::Iterator& it, uint64_t p, uint32_t t) {
+				checks[t].mismatches[kind]++;
+				auto& part_lines = lines[p * NUM_MISMATCHES + kind];
+				if (report.is_open() and part_lines.size() < REPORT_LIMIT)
+					part_lines.push_back(Kmer::int_to_str((*it).key, kmer_size));
+			};
+			forEachKmer(incqf, threads, [&](const CQF<KeyObject>::Iterator& it, uint64_t p, uint32_t t) {
+				uint64_t hash = it.get_cur_hash().key;
+				if (!keep(hash))
+					return;
+				checks[t].checked++;
+				uint64_t eqclass = cdbg.get_eqclass_of_hash(hash);
+				if (!eqclass)
+					record(MISSING, it, p, t);
+				else if (!cdbg.has_sample(eqclass, sample))
+					record(NOT_IN_COLOR, it, p, t);
+				else
+					checks[t].present++;
+			});
+			KmerCheck total;
+			for (auto& c : checks) {
+				total.present += c.present;
+				total.checked += c.checked;
+			}
+			if (total.present != index_counts[sample]) {
+				forEachKmer(index_cqf, threads, [&](const CQF<KeyObject>::Iterator& it, uint64_t p, uint32_t t) {
+					KeyObject hash = it.get_cur_hash();
+					if (keep(hash.key) and cdbg.has_sample(hash.count, sample) and
+							!incqf.query(KeyObject(hash.key, 0, 0), QF_KEY_IS_HASH))
+						record(EXTRA, it, p, t);
+				});
+			}
+			incqf.close();
+
+			for (auto& c : checks) {
+				for (uint32_t m = 0; m < NUM_MISMATCHES; m++)
+					total.mismatches[m] += c.mismatches[m];
+			}
+			if (total.mismatches[MISSING] or total.mismatches[NOT_IN_COLOR] or total.mismatches[EXTRA]) {
+				console->info("Failed for sample: {} {} k-mers checked, {} missing from the index, {} without "
+											"the sample in their color, {} in the index only",
+											file, total.checked, total.mismatches[MISSING],
+											total.mismatches[NOT_IN_COLOR], total.mismatches[EXTRA]);
+				fail = true;
+			} else {
+				console->info("Sample {} ({}/{}): {} k-mers checked", file, i + 1, squeakr_files.size(),
+											total.checked);
+			}
+			for (uint32_t m = 0; m < NUM_MISMATCHES; m++) {
+				uint64_t reported{0};
+				for (uint64_t p = 0; p < numParts(threads) and reported < REPORT_LIMIT; p++) {
+					for (auto& kmer : lines[p * NUM_MISMATCHES + m]) {
+						if (reported++ == REPORT_LIMIT)
+							break;
+						report << file << '\t' << MISMATCH_NAMES[m] << '\t' << kmer << '\n';
+					}
+				}
+			}
+		}
+		return !fail;
+	}
+}
+
 /* 
  * ===  FUNCTION  ======================================================================
  *         Name:  main
@@ -66,16 +251,9 @@ validate_main ( ValidateOpts& opt )
     std::exit(1);
   }
 
-	std::vector<SampleObject<CQF<KeyObject>*>> inobjects;
-  std::vector<CQF<KeyObject>> cqfs;
-
-	// reserve QF structs for input CQFs
-  inobjects.reserve(num_samples);
-  cqfs.reserve(num_samples);
-
-	// mmap all the input cqfs
+	// check the inputs before anything is loaded
+	std::vector<std::string> squeakr_files;
 	std::string squeakr_file;
-	uint32_t nqf = 0;
 	uint64_t kmer_size;
 	while (infile >> squeakr_file) {
 		if (!mantis::fs::FileExists(squeakr_file.c_str())) {
@@ -89,7 +267,7 @@ validate_main ( ValidateOpts& opt )
 										 squeakr::INDEX_VERSION, config.version);
 			exit(1);
 		}
-		if (cqfs.size() == 0)
+		if (squeakr_files.size() == 0)
 			kmer_size = config.kmer_size;
 		else {
 			if (kmer_size != config.kmer_size) {
@@ -101,19 +279,7 @@ validate_main ( ValidateOpts& opt )
 		if (config.cutoff == 1) {
 			console->warn("Squeakr file {} is not filtered.", squeakr_file);
 		}
-
-    cqfs.emplace_back(squeakr_file, CQF_FREAD);
-		std::string sample_id = first_part(first_part(last_part(squeakr_file, '/'),
-																									'.'), '_');
-		console->info("Reading CQF {} Seed {}", nqf, cqfs[nqf].seed());
-		console->info("Sample id {}", sample_id);
-		cqfs[nqf].dump_metadata();
-    inobjects.emplace_back(&cqfs[nqf], sample_id, nqf);
-		if (!cqfs.front().check_similarity(&cqfs.back())) {
-			console->error("Passed Squeakr files are not similar.", squeakr_file);
-			exit(1);
-		}
-		nqf++;
+		squeakr_files.push_back(squeakr_file);
 	}
 
 	std::string prefix = opt.prefix;
@@ -140,10 +306,40 @@ validate_main ( ValidateOpts& opt )
 	console->info("Read colored dbg with {} k-mers and {} color classes",
 								cdbg.get_cqf()->dist_elts(), cdbg.get_num_bitvectors());
 
+	if (opt.query_file.empty()) {
+		if (validate_kmers(opt, squeakr_files, cdbg, kmer_size)) {
+			console->info("Mantis validation passed!");
+			return EXIT_SUCCESS;
+		}
+		console->info("Mantis validation failed!");
+		return EXIT_FAILURE;
+	}
+
+	// mmap all the input cqfs
+	std::vector<SampleObject<CQF<KeyObject>*>> inobjects;
+	std::vector<CQF<KeyObject>> cqfs;
+	inobjects.reserve(num_samples);
+	cqfs.reserve(num_samples);
+	uint32_t nqf = 0;
+	for (auto& file : squeakr_files) {
+		cqfs.emplace_back(file, CQF_MMAP);
+		std::string sample_id = first_part(first_part(last_part(file, '/'),
+																									'.'), '_');
+		console->info("Reading CQF {} Seed {}", nqf, cqfs[nqf].seed());
+		console->info("Sample id {}", sample_id);
+		cqfs[nqf].dump_metadata();
+		inobjects.emplace_back(&cqfs[nqf], sample_id, nqf);
+		if (!cqfs.front().check_similarity(&cqfs.back())) {
+			console->error("Passed Squeakr files are not similar.", file);
+			exit(1);
+		}
+		nqf++;
+	}
+
 	std::string query_file = opt.query_file;
 	console->info("Reading query kmers from disk.");
 	uint64_t total_kmers = 0;
-	std::unordered_map<mantis::KmerHash, uint64_t> _dummy_uniqueKmers;
+	mantis::QueryMap _dummy_uniqueKmers;
 	mantis::QuerySets multi_kmers = Kmer::parse_kmers(query_file.c_str(),
 																										kmer_size,
 																										total_kmers,
@@ -180,10 +376,11 @@ validate_main ( ValidateOpts& opt )
 		ground_truth.push_back(fraction_present);
 		cdbg_output.push_back(result);
 	}
-	if (fail)
+	if (fail) {
 		console->info("Mantis validation failed!");
-	else
-		console->info("Mantis validation passed!");
+		return EXIT_FAILURE;
+	}
+	console->info("Mantis validation passed!");
 
 #if 0
 	// This is x-axis
@@ -0,0 +1,264 @@
+//
+// Read-only table of pre-decoded color classes stored next to the MST index.
+//
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "MantisFS.h"
+#include "ProgOpts.h"
+#include "gqf_cpp.h"
+#include "mstQuery.h"
+#include "warmCache.h"
+
+WarmColorCache::~WarmColorCache() {
+    if (mapped) {
+        munmap(mapped, mappedSize);
+    }
+}
+
+bool WarmColorCache::load(const std::string &file, uint64_t numSamplesIn, uint64_t cqfFingerprint,
+                          spdlog::logger *logger) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        logger->warn("Warm cache file {} could not be opened.", file);
+        return false;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 or static_cast<size_t>(sb.st_size) < sizeof(Header)) {
+        logger->warn("Warm cache file {} is truncated.", file);
+        close(fd);
+        return false;
+    }
+    mappedSize = sb.st_size;
+    mapped = mmap(nullptr, mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        mapped = nullptr;
+        logger->warn("Couldn't mmap the warm cache file {}.", file);
+        return false;
+    }
+    auto header = reinterpret_cast<const Header *>(mapped);
+    if (header->magic != MAGIC or header->version != VERSION) {
+        logger->warn("{} is not a warm cache file of this version of mantis.", file);
+        munmap(mapped, mappedSize);
+        mapped = nullptr;
+        return false;
+    }
+    if (header->numSamples != numSamplesIn) {
+        logger->warn("Warm cache {} was built for {} experiments, but the index has {}.",
+                     file, header->numSamples, numSamplesIn);
+        munmap(mapped, mappedSize);
+        mapped = nullptr;
+        return false;
+    }
+    if (header->cqfFingerprint != cqfFingerprint) {
+        logger->warn("Warm cache {} was built for another index, run mantis warmcache again.", file);
+        munmap(mapped, mappedSize);
+        mapped = nullptr;
+        return false;
+    }
+    if (header->numColors > (mappedSize - sizeof(Header)) / sizeof(Record)) {
+        logger->warn("Warm cache file {} is truncated.", file);
+        munmap(mapped, mappedSize);
+        mapped = nullptr;
+        return false;
+    }
+    numSamples = numSamplesIn;
+    numWrds = (numSamples + 63) / 64;
+    numColors = header->numColors;
+    records = reinterpret_cast<const Record *>(header + 1);
+    payload = reinterpret_cast<const uint64_t *>(records + numColors);
+    // the colors are checked against it when read, so a truncated payload costs no scan here
+    payloadWords = (mappedSize - sizeof(Header) - numColors * sizeof(Record)) / sizeof(uint64_t);
+    // the table is probed by binary search and colors are read at random
+    madvise(mapped, mappedSize, MADV_RANDOM);
+    logger->info("Loaded {} warm color classes from {}", numColors, file);
+    return true;
+}
+
+const WarmColorCache::Record *WarmColorCache::find(uint64_t eqid) const {
+    if (!records) return nullptr;
+    auto end = records + numColors;
+    auto it = std::lower_bound(records, end, eqid,
+                               [](const Record &r, uint64_t id) { return r.eqid < id; });
+    return (it != end and it->eqid == eqid) ? it : nullptr;
+}
+
+const uint64_t *WarmColorCache::colorOf(const Record &r, uint32_t &len) const {
+    if (r.enc == ColorCache::BITSET) {
+        len = static_cast<uint32_t>(numWrds);
+    } else if (r.enc == ColorCache::IDLIST and r.card <= numSamples) {
+        len = (r.card + 1) / 2;
+    } else {
+        return nullptr;
+    }
+    if (r.offset > payloadWords or len > payloadWords - r.offset) return nullptr;
+    return payload + r.offset;
+}
+
+bool WarmColorCache::get(uint64_t eqid, std::vector<uint64_t> &setbits) const {
+    auto r = find(eqid);
+    if (!r) return false;
+    uint32_t len;
+    auto color = colorOf(*r, len);
+    if (!color) return false;
+    ColorCache::decode(color, len, r->card, static_cast<ColorCache::Encoding>(r->enc), setbits);
+    return true;
+}
+
+bool WarmColorCache::xorInto(uint64_t eqid, uint64_t *dst) const {
+    auto r = find(eqid);
+    if (!r) return false;
+    uint32_t len;
+    auto color = colorOf(*r, len);
+    if (!color) return false;
+    ColorCache::xorDecoded(color, len, r->card, static_cast<ColorCache::Encoding>(r->enc), dst);
+    return true;
+}
+
+bool WarmColorCache::write(const std::string &file, uint64_t numSamples, uint64_t cqfFingerprint,
+                           std::vector<std::pair<uint64_t, std::vector<uint64_t>>> &colors) {
+    uint64_t numWrds = (numSamples + 63) / 64;
+    std::sort(colors.begin(), colors.end(),
+              [](const std::pair<uint64_t, std::vector<uint64_t>> &c1,
+                 const std::pair<uint64_t, std::vector<uint64_t>> &c2) {
+                  return c1.first < c2.first;
+              });
+
+    std::vector<Record> recs;
+    recs.reserve(colors.size());
+    std::vector<uint64_t> words;
+    for (auto &c : colors) {
+        ColorCache::Encoding enc;
+        uint32_t len = ColorCache::encodedWords(c.second.size(), numWrds, enc);
+        Record r{c.first, words.size(), static_cast<uint32_t>(c.second.size()), enc};
+        recs.push_back(r);
+        words.resize(words.size() + len, 0);
+        ColorCache::encode(c.second, enc, words.data() + r.offset);
+    }
+
+    // write to a temporary file first, the old file may still be mapped by this process
+    std::string tmpFile = file + ".tmp";
+    std::ofstream out(tmpFile, std::ios::out | std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    Header header{MAGIC, VERSION, 0, numSamples, recs.size(), cqfFingerprint};
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(recs.data()), sizeof(Record) * recs.size());
+    out.write(reinterpret_cast<const char *>(words.data()), sizeof(uint64_t) * words.size());
+    out.close();
+    if (!out) {
+        std::remove(tmpFile.c_str());
+        return false;
+    }
+    return std::rename(tmpFile.c_str(), file.c_str()) == 0;
+}
+
+/**
+ * returns the number of k-mers of each color class, either from the
+ * distribution written by `build -e` or by scanning the CQF
+ */
+static std::vector<uint64_t> colorAbundance(const std::string &prefix, CQF<KeyObject> &cqf,
+                                            uint64_t numColors, spdlog::logger *logger) {
+    std::vector<uint64_t> abundance(numColors, 0);
+    std::string distFile = prefix + mantis::EQCLASS_DIST_FILE;
+    if (mantis::fs::FileExists(distFile.c_str())) {
+        logger->info("Reading color class abundances from {}", distFile);
+        std::ifstream dist(distFile);
+        uint64_t eqid, cnt;
+        while (dist >> eqid >> cnt) {
+            // eq class ids in the distribution start from 1
+            if (eqid > 0 and eqid <= numColors) {
+                abundance[eqid - 1] = cnt;
+            }
+        }
+    } else {
+        logger->info("{} not found, counting color class abundances over the CQF", distFile);
+        auto it = cqf.begin();
+        while (!it.done()) {
+            uint64_t eqid = (*it).count - 1;
+            if (eqid < numColors) {
+                abundance[eqid]++;
+            }
+            ++it;
+        }
+    }
+    return abundance;
+}
+
+/*
+ * ===  FUNCTION  =============================================================
+ *         Name:  main
+ *  Description:  decodes the most abundant color classes of an MST index
+ *                and writes them to the warm cache file of the index
+ * ============================================================================
+ */
+int warm_cache_main(WarmCacheOpts &opt) {
+    spdlog::logger *logger = opt.console.get();
+    std::string prefix = opt.prefix;
+    if (prefix.back() != '/') {
+        prefix.push_back('/');
+    }
+
+    std::vector<std::string> sampleNames = loadSampleFile(prefix + mantis::SAMPLEID_FILE);
+    uint64_t numSamples = sampleNames.size();
+    logger->info("Number of experiments: {}", numSamples);
+
+    std::string dbg_file(prefix + mantis::CQF_FILE);
+    CQF<KeyObject> cqf(dbg_file, CQF_FREAD);
+    uint32_t indexK = cqf.keybits() / 2;
+
+    MSTQuery mstQuery(prefix, indexK, indexK, numSamples, logger);
+    uint64_t numColors = mstQuery.numColorClasses();
+    logger->info("Total # of color classes is {}", numColors);
+
+    std::vector<uint64_t> abundance = colorAbundance(prefix, cqf, numColors, logger);
+    uint64_t cqfFingerprint = UnitigTable::fingerprint(cqf);
+    cqf.free();
+
+    std::vector<uint64_t> ids(numColors);
+    for (uint64_t i = 0; i < numColors; i++) ids[i] = i;
+    uint64_t n = std::min(opt.num_colors, numColors);
+    std::partial_sort(ids.begin(), ids.begin() + n, ids.end(),
+                      [&abundance](uint64_t c1, uint64_t c2) {
+                          return abundance[c1] > abundance[c2];
+                      });
+    ids.resize(n);
+    uint32_t numThreads = std::max<uint32_t>(1, opt.numThreads);
+    logger->info("Decoding the {} most abundant color classes using {} threads", n, numThreads);
+
+    // neighboring classes share most of their path to the root, so keep the decoded ones around
+    ColorCache cache(numSamples, mantis::DEFAULT_COLOR_CACHE_MB << 20);
+    std::vector<std::pair<uint64_t, std::vector<uint64_t>>> colors(n);
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < numThreads; ++t) {
+        threads.emplace_back([&, t]() {
+            QueryStats queryStats;
+            queryStats.numSamples = numSamples;
+            nonstd::optional<uint64_t> dummy{nonstd::nullopt};
+            for (uint64_t i = t; i < n; i += numThreads) {
+                colors[i].first = ids[i];
+                colors[i].second = mstQuery.buildColor(ids[i], queryStats, &cache, nullptr, dummy);
+                cache.put(ids[i], colors[i].second);
+            }
+        });
+    }
+    for (auto &t : threads) { t.join(); }
+
+    std::string warmFile = prefix + mantis::WARMCACHE_FILE;
+    if (!WarmColorCache::write(warmFile, numSamples, cqfFingerprint, colors)) {
+        logger->error("Failed to write the warm cache to {}", warmFile);
+        return EXIT_FAILURE;
+    }
+    logger->info("Wrote {} color classes to {}", n, warmFile);
+    return EXIT_SUCCESS;
+}